@@ -0,0 +1,473 @@
+// Measures the throughput of the hot loops used by the LED and PIO classes,
+// so changes to them can be compared on real hardware. Results are printed
+// to the USB serial port.
+
+// pi-pico-cpp headers
+#include <cpp/Hub75Panel.hpp>
+#include <cpp/LedCalibration.hpp>
+#include <cpp/LedCompositor.hpp>
+#include <cpp/LedMatrix.hpp>
+#include <cpp/N64Controller.hpp>
+#include <cpp/Palette.hpp>
+#include <cpp/SpiDisplay.hpp>
+
+// Pico SDK headers
+#include <pico/stdlib.h>
+#include <pico/stdio.h>
+
+// std headers
+#include <iostream>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Keeps the compiler from optimizing away benchmark results
+static volatile uint32_t sink;
+
+template <typename Func>
+void benchmark(const char* name, size_t itemsPerRun, Func func, int runs = 20)
+{
+  uint64_t startUs = time_us_64();
+  for (int i = 0; i < runs; ++i)
+  {
+    func();
+  }
+  uint64_t elapsedUs = time_us_64() - startUs;
+  double itemsPerSec = (double)itemsPerRun * (double)runs * 1000000.0 / (double)elapsedUs;
+  std::cout << name << ": " << (elapsedUs / runs) << " us per run, " << (uint32_t)itemsPerSec << " items/sec" << std::endl;
+}
+
+// Packs through the virtual interface, the way PioMachine did before the
+// buffer types were known at the call site
+__attribute__((noinline)) void packVirtual(const PioBuffer& buf, uint32_t* dst)
+{
+  for (size_t i = 0; i < buf.size; ++i)
+  {
+    buf.pack(dst[i], i);
+  }
+}
+
+__attribute__((noinline)) void unpackVirtual(PioBuffer& buf, const uint32_t* src)
+{
+  for (size_t i = 0; i < buf.size; ++i)
+  {
+    buf.unpack(src[i], i);
+  }
+}
+
+// A bare state machine, to time PioMachine's own bookkeeping
+struct BenchMachine : PioMachine
+{
+  BenchMachine() : PioMachine(&joybus_host_program) {}
+};
+
+int main()
+{
+  stdio_init_all();
+
+  // Give USB terminals a chance to connect
+  sleep_ms(2000);
+
+  // A typical installation: 600 pixels with a rainbow-ish fill
+  std::vector<RGBColor> pixels(600);
+  for (size_t i = 0; i < pixels.size(); ++i)
+  {
+    pixels[i] = {(uint8_t)(i * 3), (uint8_t)(i * 5), (uint8_t)(i * 7)};
+  }
+
+  Vec3f colorBalance {1.0f, 0.8f, 0.7f};
+  float gamma = 2.5f;
+  float brightness = 0.75f;
+
+  std::cout << "Pixel packing, " << pixels.size() << " pixels" << std::endl;
+
+  benchmark("  float + powf", pixels.size(), [&]()
+  {
+    for (const RGBColor& c : pixels)
+    {
+      RGBColor calibrated = c * colorBalance * brightness;
+      calibrated.applyGamma(gamma);
+      sink = (uint32_t)calibrated.G << 16 | (uint32_t)calibrated.R << 8 | (uint32_t)calibrated.B;
+    }
+  }, 2);
+
+  // Static, to keep the tables off main's stack
+  static LedCalibration calibration;
+  calibration.colorBalance(colorBalance);
+  calibration.gamma(gamma);
+  calibration.brightness(brightness);
+  calibration.update();
+
+  benchmark("  LedCalibration", pixels.size(), [&]()
+  {
+    for (const RGBColor& c : pixels)
+    {
+      sink = calibration.packGRB(c);
+    }
+  });
+
+  benchmark("  LedCalibration rebuild", 1, [&]()
+  {
+    calibration.brightness(calibration.brightness() == 0.75f ? 0.5f : 0.75f);
+    calibration.update();
+  }, 4);
+
+  LEDBuffer16 pixels16(pixels.size());
+  for (size_t i = 0; i < pixels.size(); ++i)
+  {
+    pixels16[i] = RGBColor16::fromRGB(pixels[i]);
+  }
+  std::vector<uint8_t> ditherError(pixels.size() * 3);
+  calibration.update16();
+
+  benchmark("  LedCalibration dithered", pixels.size(), [&]()
+  {
+    uint8_t* error = ditherError.data();
+    for (const RGBColor16& c : pixels16)
+    {
+      sink = calibration.packGRBDithered(c, error);
+      error += 3;
+    }
+  });
+
+  LEDBuffer target(pixels.size(), RGBColor{10, 200, 30});
+  LEDBuffer scratch(pixels.size());
+
+  std::cout << "Color math, " << pixels.size() << " pixels" << std::endl;
+
+  benchmark("  blend float", pixels.size(), [&]()
+  {
+    for (size_t i = 0; i < pixels.size(); ++i)
+    {
+      scratch[i] = RGBColor::blend(pixels[i], target[i], 0.3f);
+    }
+  });
+
+  benchmark("  nblend8", pixels.size(), [&]()
+  {
+    scratch = pixels;
+    nblend8(scratch, target, 77);
+  });
+
+  benchmark("  operator*(Vec3f)", pixels.size(), [&]()
+  {
+    for (size_t i = 0; i < pixels.size(); ++i)
+    {
+      scratch[i] = pixels[i] * colorBalance;
+    }
+  });
+
+  benchmark("  nscaleQ8_8", pixels.size(), [&]()
+  {
+    scratch = pixels;
+    nscaleQ8_8(scratch, colorBalance);
+  });
+
+  std::vector<LabColor> lab(pixels.size());
+
+  std::cout << "Color space conversion, " << pixels.size() << " pixels" << std::endl;
+
+  benchmark("  rgbToLab", pixels.size(), [&]()
+  {
+    for (size_t i = 0; i < pixels.size(); ++i)
+    {
+      rgbToLab(pixels[i], lab[i]);
+    }
+  }, 2);
+
+  benchmark("  convert RGB to Lab", pixels.size(), [&]()
+  {
+    convert(pixels.data(), lab.data(), pixels.size());
+  });
+
+  benchmark("  labToRgb", pixels.size(), [&]()
+  {
+    for (size_t i = 0; i < pixels.size(); ++i)
+    {
+      labToRgb(lab[i], scratch[i]);
+    }
+  }, 2);
+
+  benchmark("  convert Lab to RGB", pixels.size(), [&]()
+  {
+    convert(lab.data(), scratch.data(), pixels.size());
+  });
+
+  // A 240x240 image quantized to a 16 color palette, as for a small TFT
+  // Scoped so the image is freed before the display allocates its framebuffer
+  {
+    LEDBuffer image(240 * 240);
+    for (size_t i = 0; i < image.size(); ++i)
+    {
+      image[i] = {(uint8_t)(i % 240), (uint8_t)(i / 240), (uint8_t)(i * 7)};
+    }
+    // Static, the grid is too big for the stack
+    static Palette palette;
+    for (int i = 0; i < 16; ++i)
+    {
+      palette.add(HSV8{(uint8_t)(i * 16), 255, (uint8_t)(i & 1 ? 255 : 128)}.toRGB());
+    }
+    std::vector<uint8_t> indices(image.size());
+
+    std::cout << "Palette quantize, " << image.size() << " pixels, " << palette.size() << " colors" << std::endl;
+
+    benchmark("  nearest", image.size(), [&]()
+    {
+      for (size_t i = 0; i < image.size(); ++i)
+      {
+        indices[i] = palette.nearest(image[i]);
+      }
+    }, 1);
+
+    benchmark("  buildGrid", 1, [&]()
+    {
+      palette.buildGrid();
+    }, 2);
+
+    benchmark("  quantize", image.size(), [&]()
+    {
+      palette.quantize(image, indices);
+    }, 5);
+  }
+
+  std::cout << "HSV to RGB, " << pixels.size() << " pixels" << std::endl;
+
+  benchmark("  HSVColor::toRGB", pixels.size(), [&]()
+  {
+    for (size_t i = 0; i < pixels.size(); ++i)
+    {
+      scratch[i] = HSVColor{(float)(i % 360), 1.0f, 1.0f}.toRGB();
+    }
+  }, 2);
+
+  benchmark("  fillRainbow", pixels.size(), [&]()
+  {
+    fillRainbow(scratch, 0, 1);
+  });
+
+  std::vector<uint16_t> rgb565(pixels.size());
+
+  benchmark("  toRGB565", pixels.size(), [&]()
+  {
+    for (size_t i = 0; i < pixels.size(); ++i)
+    {
+      rgb565[i] = pixels[i].toRGB565();
+    }
+  });
+
+  benchmark("  packRGB565", pixels.size(), [&]()
+  {
+    packRGB565(pixels.data(), rgb565.data(), pixels.size());
+  });
+
+  // 600 pixels as a 4x2 grid of serpentine panels
+  LedMatrix matrix(scratch, {15, 10, true, LedMatrix::Rotation::Rotate90, 4, 2, true});
+
+  std::cout << "LedMatrix, " << matrix.width() << "x" << matrix.height() << std::endl;
+
+  benchmark("  per pixel set", pixels.size(), [&]()
+  {
+    for (int y = 0; y < matrix.height(); ++y)
+    {
+      for (int x = 0; x < matrix.width(); ++x)
+      {
+        matrix.set(x, y, pixels[y * matrix.width() + x]);
+      }
+    }
+  });
+
+  benchmark("  blit", pixels.size(), [&]()
+  {
+    matrix.blit(pixels.data(), matrix.width(), matrix.height(), 0, 0);
+  });
+
+  benchmark("  scroll", pixels.size(), [&]()
+  {
+    matrix.scroll(1, 0);
+  });
+
+  std::cout << "LedCompositor, " << pixels.size() << " pixels" << std::endl;
+
+  benchmark("  blend Normal", pixels.size(), [&]()
+  {
+    LedCompositor::blend(scratch.data(), pixels.data(), pixels.size(), LedCompositor::BlendMode::Normal, 255);
+  });
+
+  benchmark("  blend Add, opacity 128", pixels.size(), [&]()
+  {
+    LedCompositor::blend(scratch.data(), pixels.data(), pixels.size(), LedCompositor::BlendMode::Add, 128);
+  });
+
+  benchmark("  blend Screen, opacity 128", pixels.size(), [&]()
+  {
+    LedCompositor::blend(scratch.data(), pixels.data(), pixels.size(), LedCompositor::BlendMode::Screen, 128);
+  });
+
+  // Three layers rendered on this core, released straight away
+  LedCompositor compositor(pixels.size());
+  compositor.addLayer([](LEDBuffer& layer, uint32_t frame, uint64_t)
+  {
+    fillRainbow(layer, (uint8_t)frame, 2);
+  });
+  compositor.addLayer([&](LEDBuffer& layer, uint32_t, uint64_t)
+  {
+    layer = pixels;
+  }, LedCompositor::BlendMode::Screen, 96);
+  compositor.addLayer([](LEDBuffer& layer, uint32_t frame, uint64_t)
+  {
+    std::fill(layer.begin(), layer.end(), RGBColor{0, 0, 0});
+    layer[frame % layer.size()] = {255, 255, 255};
+  }, LedCompositor::BlendMode::Lighten);
+
+  benchmark("  renderFrame, 3 layers", pixels.size(), [&]()
+  {
+    compositor.renderFrame();
+    compositor.release();
+  });
+  for (size_t i = 0; i < compositor.layerCount(); ++i)
+  {
+    std::cout << "    layer " << i << ": " << compositor.layerRenderUs(i) << " us" << std::endl;
+  }
+
+  // Joybus buffers, packed 1000 times per run
+  N64ControllerButtonState buttonState;
+  buttonState.buttons = N64Buttons::A;
+  buttonState.xAxis = 40;
+  std::vector<uint16_t> accessory(16, 0x1234);
+  JoybusBuffer16 accessoryBuffer(accessory.data(), accessory.size());
+  uint32_t words[PioMachine::maxPackedWords];
+
+  std::cout << "PioBuffer packing, 1000 buffers" << std::endl;
+
+  benchmark("  N64 state, virtual pack", 1000, [&]()
+  {
+    uint32_t sum = 0;
+    for (int i = 0; i < 1000; ++i)
+    {
+      buttonState.xAxis = (int8_t)i;
+      packVirtual(buttonState, words);
+      sum += words[2];
+    }
+    sink = sum;
+  });
+
+  benchmark("  N64 state, packAll", 1000, [&]()
+  {
+    uint32_t sum = 0;
+    for (int i = 0; i < 1000; ++i)
+    {
+      buttonState.xAxis = (int8_t)i;
+      buttonState.packAll(words);
+      sum += words[2];
+    }
+    sink = sum;
+  });
+
+  benchmark("  N64 state, virtual unpack", 1000, [&]()
+  {
+    uint32_t sum = 0;
+    for (int i = 0; i < 1000; ++i)
+    {
+      words[2] = (uint32_t)i;
+      unpackVirtual(buttonState, words);
+      sum += (uint32_t)buttonState.xAxis;
+    }
+    sink = sum;
+  });
+
+  benchmark("  N64 state, unpackAll", 1000, [&]()
+  {
+    uint32_t sum = 0;
+    for (int i = 0; i < 1000; ++i)
+    {
+      words[2] = (uint32_t)i;
+      buttonState.unpackAll(words);
+      sum += (uint32_t)buttonState.xAxis;
+    }
+    sink = sum;
+  });
+
+  benchmark("  32 byte accessory, virtual pack", 1000, [&]()
+  {
+    uint32_t sum = 0;
+    for (int i = 0; i < 1000; ++i)
+    {
+      accessory[0] = (uint16_t)i;
+      packVirtual(accessoryBuffer, words);
+      sum += words[0];
+    }
+    sink = sum;
+  });
+
+  benchmark("  32 byte accessory, packAll", 1000, [&]()
+  {
+    uint32_t sum = 0;
+    for (int i = 0; i < 1000; ++i)
+    {
+      accessory[0] = (uint16_t)i;
+      accessoryBuffer.packAll(words);
+      sum += words[0];
+    }
+    sink = sum;
+  });
+
+  // Every state machine of both PIOs, claimed then released
+  std::optional<BenchMachine> machines[8];
+
+  std::cout << "PioMachine, 8 state machines" << std::endl;
+
+  benchmark("  construct and destroy", 8, [&]()
+  {
+    for (std::optional<BenchMachine>& machine : machines)
+    {
+      machine.emplace();
+    }
+    for (std::optional<BenchMachine>& machine : machines)
+    {
+      machine.reset();
+    }
+  });
+
+  // Nothing needs to be connected, the pins just toggle
+  LEDBuffer panelPixels(64 * 32);
+  for (size_t i = 0; i < panelPixels.size(); ++i)
+  {
+    panelPixels[i] = {(uint8_t)(i * 3), (uint8_t)(i * 5), (uint8_t)(i * 7)};
+  }
+
+  std::cout << "Hub75Panel, 64x32" << std::endl;
+
+  for (int bitDepth : {6, 8, 10})
+  {
+    Hub75Panel panel(0, 6, 11, 12, 64, 32, bitDepth);
+    panel.gamma(gamma);
+    std::string name = "  writeColors " + std::to_string(bitDepth) + " bit";
+    benchmark(name.c_str(), panelPixels.size(), [&]()
+    {
+      panel.writeColors(panelPixels);
+    });
+    std::cout << "    " << (uint32_t)panel.refreshHz() << " Hz refresh, "
+              << panel.cpuLoad(60.0f) * 100.0f << "% CPU at 60 fps" << std::endl;
+  }
+
+  // Nothing needs to be connected, the flushes are timed on the SPI bus
+  SpiDisplay display(spi1, 11, 10, 9, 8, SPIDevice::NoPin, {});
+  display.fill({0, 0, 255});
+
+  std::cout << "SpiDisplay, " << display.width() << "x" << display.height() << std::endl;
+
+  benchmark("  full flush", (size_t)(display.width() * display.height()), [&]()
+  {
+    display.flushAll();
+  }, 5);
+
+  benchmark("  32x32 flush", 32 * 32, [&]()
+  {
+    display.blit(pixels.data(), 32, 32, 100, 100);
+    display.flush();
+  });
+
+  std::cout << "    " << display.flushTimeUs(32 * 32) << " us on the wire" << std::endl;
+
+  return 0;
+}
@@ -4,13 +4,70 @@
 
 #include <unordered_map>
 #include <algorithm>
+#include <array>
 #include <vector>
 #include <cmath>
+#include <cstring>
 
 struct RGBColor;
 struct HSVColor;
 struct LabColor;
 
+// Integer color math for hot loops. The RP2040 has no FPU, so these avoid
+// software float entirely. Results match the float versions to within +/-1.
+
+// Scale i by scale/255. A scale of 255 leaves i unchanged.
+inline uint8_t scale8(uint8_t i, uint8_t scale)
+{
+  return (uint8_t)(((uint16_t)i * ((uint16_t)scale + 1)) >> 8);
+}
+
+// Scale three channels by scale/255 in place
+inline void nscale8x3(uint8_t& r, uint8_t& g, uint8_t& b, uint8_t scale)
+{
+  uint16_t s = (uint16_t)scale + 1;
+  r = (uint8_t)(((uint16_t)r * s) >> 8);
+  g = (uint8_t)(((uint16_t)g * s) >> 8);
+  b = (uint8_t)(((uint16_t)b * s) >> 8);
+}
+
+// Convert a float factor to unsigned Q8.8 fixed point (0 to 255.996)
+inline uint16_t toQ8_8(float f)
+{
+  return (uint16_t)std::clamp(f * 256.0f + 0.5f, 0.0f, 65535.0f);
+}
+
+// Scale i by a Q8.8 factor, saturating at 255
+inline uint8_t scaleQ8_8(uint8_t i, uint16_t factor)
+{
+  uint32_t v = ((uint32_t)i * factor) >> 8;
+  return (uint8_t)(v > 255 ? 255 : v);
+}
+
+// Linear interpolation from a to b by t/255. t = 0 gives a, t = 255 gives b.
+inline uint8_t lerp8(uint8_t a, uint8_t b, uint8_t t)
+{
+  uint16_t s = (uint16_t)t + 1;
+  if (b >= a)
+  {
+    return a + (uint8_t)(((uint16_t)(b - a) * s) >> 8);
+  }
+  return a - (uint8_t)(((uint16_t)(a - b) * s) >> 8);
+}
+
+// Add, saturating at 255
+inline uint8_t qadd8(uint8_t a, uint8_t b)
+{
+  uint16_t v = (uint16_t)a + b;
+  return (uint8_t)(v > 255 ? 255 : v);
+}
+
+// Subtract, saturating at 0
+inline uint8_t qsub8(uint8_t a, uint8_t b)
+{
+  return a > b ? a - b : 0;
+}
+
 #pragma pack(push, 1)
 
 struct HSVColor
@@ -22,6 +79,17 @@ struct HSVColor
   RGBColor toRGB() const;
 };
 
+// Compact HSV with every channel 0 to 255. Hue 256 wraps around to red.
+// Converts to RGB with integer math only, for per pixel hue effects.
+struct HSV8
+{
+  uint8_t H = 0;
+  uint8_t S = 0;
+  uint8_t V = 0;
+
+  RGBColor toRGB() const;
+};
+
 struct YUVColor
 {
   uint8_t Y = 0;
@@ -74,17 +142,26 @@ struct RGBColor
     B = (uint8_t)std::clamp(powf((float)B / 255.0f, gamma) * 255.0f, 0.0f, 255.0f);
   }
 
+  // RGB565 words are byte swapped, so that in memory they are in the big
+  // endian order displays expect on the wire
   static RGBColor fromRGB565(uint16_t rgb565)
   {
     return
     {
       (uint8_t)  (rgb565 & (uint16_t)0b0000000011111000),
       (uint8_t)(((rgb565 & (uint16_t)0b0000000000000111) << 5) | 
-                ((rgb565 & (uint16_t)0b1110000000000000) << 11)),
+                ((rgb565 & (uint16_t)0b1110000000000000) >> 11)),
       (uint8_t) ((rgb565 & (uint16_t)0b0001111100000000) >> 5),
     };
   }
 
+  // Inverse of fromRGB565()
+  uint16_t toRGB565() const
+  {
+    uint16_t rgb565 = (uint16_t)((R & 0xF8) << 8 | (G & 0xFC) << 3 | B >> 3);
+    return (uint16_t)(rgb565 << 8 | rgb565 >> 8);
+  }
+
   static RGBColor blend(const RGBColor& a, const RGBColor& b, float t = 0.5f)
   {
     float invT = (1.0f - t);
@@ -94,6 +171,38 @@ struct RGBColor
     return { (uint8_t)R, (uint8_t)G, (uint8_t)B };
   }
 
+  // Fixed point version of blend(), t is 0 to 255 instead of 0 to 1
+  static RGBColor blend8(const RGBColor& a, const RGBColor& b, uint8_t t = 128)
+  {
+    return { lerp8(a.R, b.R, t), lerp8(a.G, b.G, t), lerp8(a.B, b.B, t) };
+  }
+
+  // Fixed point version of operator*(float) for factors 0 to 1, as scale/255
+  RGBColor scale8(uint8_t scale) const
+  {
+    RGBColor c = *this;
+    nscale8x3(c.R, c.G, c.B, scale);
+    return c;
+  }
+
+  // Fixed point version of operator*(float), with a Q8.8 factor (see toQ8_8)
+  RGBColor scaleQ8_8(uint16_t factor) const
+  {
+    return { ::scaleQ8_8(R, factor), ::scaleQ8_8(G, factor), ::scaleQ8_8(B, factor) };
+  }
+
+  // Fixed point version of operator*(Vec3f), with a Q8.8 factor per channel
+  RGBColor scaleQ8_8(uint16_t factorR, uint16_t factorG, uint16_t factorB) const
+  {
+    return { ::scaleQ8_8(R, factorR), ::scaleQ8_8(G, factorG), ::scaleQ8_8(B, factorB) };
+  }
+
+  // Saturating per-channel add
+  RGBColor addSaturate(const RGBColor& c) const
+  {
+    return { qadd8(R, c.R), qadd8(G, c.G), qadd8(B, c.B) };
+  }
+
   Vec3f toVec3f() const
   {
     return {(float)R / 255.0f, (float)G / 255.0f, (float)B / 255.0f};
@@ -106,6 +215,25 @@ struct RGBColor
   uint8_t getGrayValue() const;
 };
 
+// RGB with 16 bits per channel, 65535 = 255 in RGBColor. Used as input for
+// temporal dithering, where the extra bits are spread across frames.
+struct RGBColor16
+{
+  uint16_t R = 0;
+  uint16_t G = 0;
+  uint16_t B = 0;
+
+  static RGBColor16 fromRGB(const RGBColor& c)
+  {
+    return { (uint16_t)(c.R * 257), (uint16_t)(c.G * 257), (uint16_t)(c.B * 257) };
+  }
+
+  RGBColor toRGB() const
+  {
+    return { (uint8_t)(R >> 8), (uint8_t)(G >> 8), (uint8_t)(B >> 8) };
+  }
+};
+
 struct XYZColor
 {
   float X = 0;
@@ -153,7 +281,10 @@ struct LabColor
       return {c*rhs.L, c*rhs.a, c*rhs.b};
   }
 
+  // CIE76 color difference, and its square for comparisons that don't
+  // need the square root
   float deltaE(const LabColor& other) const;
+  float deltaE2(const LabColor& other) const;
 };
 #pragma pack(pop)
 
@@ -163,15 +294,151 @@ static_assert(std::is_trivially_copyable<Vec3f>::value, "Vec3f must be trivially
 static_assert(std::is_standard_layout<HSVColor>::value, "HSVColor must have standard layout.");
 static_assert(std::is_trivially_copyable<HSVColor>::value, "HSVColor must be trivially copyable.");
 
+static_assert(std::is_standard_layout<HSV8>::value, "HSV8 must have standard layout.");
+static_assert(std::is_trivially_copyable<HSV8>::value, "HSV8 must be trivially copyable.");
+
 static_assert(std::is_standard_layout<RGBColor>::value, "RGBColor must have standard layout.");
 static_assert(std::is_trivially_copyable<RGBColor>::value, "RGBColor must be trivially copyable.");
 
+static_assert(std::is_standard_layout<RGBColor16>::value, "RGBColor16 must have standard layout.");
+static_assert(std::is_trivially_copyable<RGBColor16>::value, "RGBColor16 must be trivially copyable.");
+
 static_assert(std::is_standard_layout<XYZColor>::value, "XYZColor must have standard layout.");
 static_assert(std::is_trivially_copyable<XYZColor>::value, "XYZColor must be trivially copyable.");
 
 static_assert(std::is_standard_layout<LabColor>::value, "LabColor must have standard layout.");
 static_assert(std::is_trivially_copyable<LabColor>::value, "LabColor must be trivially copyable.");
 
+using LEDBuffer = std::vector<RGBColor>;
+using LEDBuffer16 = std::vector<RGBColor16>;
+
+// Batch versions of the fixed point color operations. These are the inner
+// loops of most effects, so they work over a span of colors in place.
+
+// Scale n colors by scale/255
+inline void nscale8(RGBColor* colors, size_t n, uint8_t scale)
+{
+  uint16_t s = (uint16_t)scale + 1;
+  for (size_t i = 0; i < n; ++i)
+  {
+    colors[i].R = (uint8_t)(((uint16_t)colors[i].R * s) >> 8);
+    colors[i].G = (uint8_t)(((uint16_t)colors[i].G * s) >> 8);
+    colors[i].B = (uint8_t)(((uint16_t)colors[i].B * s) >> 8);
+  }
+}
+
+inline void nscale8(LEDBuffer& colors, uint8_t scale)
+{
+  nscale8(colors.data(), colors.size(), scale);
+}
+
+// Scale n colors by a Q8.8 factor per channel, saturating at 255
+inline void nscaleQ8_8(RGBColor* colors, size_t n, uint16_t factorR, uint16_t factorG, uint16_t factorB)
+{
+  for (size_t i = 0; i < n; ++i)
+  {
+    colors[i] = colors[i].scaleQ8_8(factorR, factorG, factorB);
+  }
+}
+
+inline void nscaleQ8_8(LEDBuffer& colors, const Vec3f& factor)
+{
+  nscaleQ8_8(colors.data(), colors.size(), toQ8_8(factor.X), toQ8_8(factor.Y), toQ8_8(factor.Z));
+}
+
+// Blend n colors of src into dst by t/255 (t = 255 copies src)
+inline void nblend8(RGBColor* dst, const RGBColor* src, size_t n, uint8_t t)
+{
+  for (size_t i = 0; i < n; ++i)
+  {
+    dst[i] = RGBColor::blend8(dst[i], src[i], t);
+  }
+}
+
+inline void nblend8(LEDBuffer& dst, const LEDBuffer& src, uint8_t t)
+{
+  nblend8(dst.data(), src.data(), std::min(dst.size(), src.size()), t);
+}
+
+// Saturating add of n colors of src into dst
+inline void naddSaturate(RGBColor* dst, const RGBColor* src, size_t n)
+{
+  for (size_t i = 0; i < n; ++i)
+  {
+    dst[i] = dst[i].addSaturate(src[i]);
+  }
+}
+
+inline void naddSaturate(LEDBuffer& dst, const LEDBuffer& src)
+{
+  naddSaturate(dst.data(), src.data(), std::min(dst.size(), src.size()));
+}
+
+// Convert colors to byte swapped RGB565, as RGBColor::toRGB565(). Two
+// pixels are converted per loop, with one 32 bit store.
+inline void packRGB565(const RGBColor* src, uint16_t* dst, size_t n)
+{
+  size_t i = 0;
+  if (((uintptr_t)dst & 3) != 0 && n > 0)
+  {
+    dst[0] = src[0].toRGB565();
+    i = 1;
+  }
+  for (; i + 1 < n; i += 2)
+  {
+    uint32_t pair = (uint32_t)src[i].toRGB565() | (uint32_t)src[i + 1].toRGB565() << 16;
+    memcpy(&dst[i], &pair, sizeof(pair));
+  }
+  if (i < n)
+  {
+    dst[i] = src[i].toRGB565();
+  }
+}
+
+inline RGBColor HSV8::toRGB() const
+{
+  // Split hue into one of six sextants and a position f within it
+  uint16_t h6 = (uint16_t)H * 6;
+  uint8_t sextant = h6 >> 8;
+  uint16_t f = h6 & 0xFF;
+
+  // The four levels any channel can take: value, falling, floor, rising.
+  // Using 256 instead of 255 keeps S = 0 and S = 255 exact.
+  uint16_t v = V;
+  uint8_t levels[4] = 
+  {
+    V,
+    (uint8_t)((v * (256 - ((S * f) >> 8))) >> 8),
+    (uint8_t)((v * (256 - S)) >> 8),
+    (uint8_t)((v * (256 - ((S * (256 - f)) >> 8))) >> 8),
+  };
+
+  // Which level each of R, G, B takes in each sextant
+  static constexpr uint8_t select[6][3] = 
+  {
+    {0, 3, 2}, {1, 0, 2}, {2, 0, 3}, {2, 1, 0}, {3, 2, 0}, {0, 2, 1}
+  };
+  const uint8_t* sel = select[sextant];
+  return { levels[sel[0]], levels[sel[1]], levels[sel[2]] };
+}
+
+// Fill n colors with a rainbow, starting at startHue and stepping the
+// hue by deltaHue per pixel (hue wraps at 256)
+inline void fillRainbow(RGBColor* colors, size_t n, uint8_t startHue, uint8_t deltaHue, uint8_t saturation = 255, uint8_t value = 255)
+{
+  HSV8 hsv {startHue, saturation, value};
+  for (size_t i = 0; i < n; ++i)
+  {
+    colors[i] = hsv.toRGB();
+    hsv.H += deltaHue;
+  }
+}
+
+inline void fillRainbow(LEDBuffer& colors, uint8_t startHue, uint8_t deltaHue, uint8_t saturation = 255, uint8_t value = 255)
+{
+  fillRainbow(colors.data(), colors.size(), startHue, deltaHue, saturation, value);
+}
+
 // Get an RGBColor corresponding to a color teperature in kelvin.
 // Works for all float values but returns colors are clamped 
 // between 1000k and 12000k
@@ -344,6 +611,216 @@ void labToRgb(const LabColor &lab, RGBColor &rgb)
   xyzToRgb({x, y, z}, rgb);
 }
 
+// Batch color space conversion
+//
+// These convert whole spans of colors with lookup tables and fixed point
+// math instead of powf and cbrtf per channel:
+//   - sRGB to linear is a 256 entry table (Q15)
+//   - the RGB/XYZ matrices are fixed point, with the D65 white point folded in
+//   - the Lab cube root is range reduced to [1/8, 1] then linearly
+//     interpolated from a 65 point table
+//   - linear to sRGB is a binary search of the sRGB to linear table, which
+//     truncates the same way the scalar path does
+//
+// Accuracy against rgbToLab()/labToRgb(), over every 8 bit RGB color:
+//   - RGB to Lab: deltaE < 0.11 (L within 0.03, a within 0.1, b within 0.06)
+//   - Lab to RGB: channels within +/-1 for in gamut colors. Out of gamut
+//     colors are clamped, where the scalar path wraps.
+
+// Lookup tables built at compile time. As constexpr data they are placed in
+// flash and shared by every translation unit, with no RAM or boot cost.
+
+// sRGB 8 bit value to linear light, Q15 (32768 = 1.0)
+constexpr std::array<uint16_t, 256> makeSrgbToLinearTable()
+{
+  std::array<uint16_t, 256> table {};
+  for (int i = 0; i < 256; ++i)
+  {
+    double c = (double)i / 255.0;
+    c = (c > 0.04045) ? constexprPow((c + 0.055) / 1.055, 2.4) : (c / 12.92);
+    table[i] = (uint16_t)(c * 32768.0 + 0.5);
+  }
+  return table;
+}
+
+inline constexpr std::array<uint16_t, 256> srgbToLinearTable = makeSrgbToLinearTable();
+
+// cbrt(x) for x in [1/8, 1], sampled at 65 evenly spaced points, Q16
+constexpr std::array<uint32_t, 65> makeCbrtTable()
+{
+  std::array<uint32_t, 65> table {};
+  for (int i = 0; i <= 64; ++i)
+  {
+    double x = 0.125 + 0.875 * (double)i / 64.0;
+    table[i] = (uint32_t)(constexprPow(x, 1.0 / 3.0) * 65536.0 + 0.5);
+  }
+  return table;
+}
+
+inline constexpr std::array<uint32_t, 65> cbrtTable = makeCbrtTable();
+
+// Gamma curve for 8 bit values, matching RGBColor::applyGamma(gamma)
+constexpr std::array<uint8_t, 256> makeGammaTable(double gamma)
+{
+  std::array<uint8_t, 256> table {};
+  for (int i = 0; i < 256; ++i)
+  {
+    double v = constexprPow((double)i / 255.0, gamma) * 255.0;
+    table[i] = (uint8_t)(v > 255.0 ? 255.0 : v);
+  }
+  return table;
+}
+
+// Common gamma curves, for products with a fixed gamma
+inline constexpr std::array<uint8_t, 256> gamma22Table = makeGammaTable(2.2);
+inline constexpr std::array<uint8_t, 256> gamma25Table = makeGammaTable(2.5);
+
+// The Lab f(t) function in Q16: cube root above (6/29)^3, linear below
+inline int32_t labF(int32_t t)
+{
+  // (6/29)^3 = 0.008856 in Q16
+  if (t <= 580)
+  {
+    // 7.787 * t + 16/116, 7.787 as Q10
+    return ((t * 7974) >> 10) + 9039;
+  }
+
+  // Scale t into [1/8, 1] (8192 to 65536 in Q16) by powers of 8,
+  // which scales the cube root by powers of 2
+  const std::array<uint32_t, 65>& table = cbrtTable;
+  uint32_t x = (uint32_t)std::min(t, (int32_t)65536);
+  int shift = 0;
+  while (x < 8192)
+  {
+    x <<= 3;
+    ++shift;
+  }
+
+  // 64 segments of 896 across [8192, 65536]
+  uint32_t pos = x - 8192;
+  uint32_t seg = std::min(pos / 896, (uint32_t)63);
+  uint32_t frac = pos - seg * 896;
+  uint32_t lo = table[seg];
+  uint32_t hi = table[seg + 1];
+  uint32_t y = lo + ((hi - lo) * frac) / 896;
+  return (int32_t)(y >> shift);
+}
+
+// RGB to Lab with integer math only, each component in Q16
+inline void rgbToLabQ16(const RGBColor& rgb, int32_t& L, int32_t& a, int32_t& b)
+{
+  // sRGB to XYZ divided by the D65 white point, Q15
+  constexpr int32_t m[3][3] = 
+  {
+    {14220, 12328, 6221},   // 0.4124564, 0.3575761, 0.1804375 / 0.95047
+    { 6969, 23434, 2365},   // 0.2126729, 0.7151522, 0.0721750 / 1.00000
+    {  582,  3587, 28599},  // 0.0193339, 0.1191920, 0.9503041 / 1.08883
+  };
+  const std::array<uint16_t, 256>& lin = srgbToLinearTable;
+
+  int32_t r = lin[rgb.R];
+  int32_t g = lin[rgb.G];
+  int32_t bl = lin[rgb.B];
+
+  // Q15 * Q15 >> 14 = Q16
+  int32_t fx = labF((r * m[0][0] + g * m[0][1] + bl * m[0][2]) >> 14);
+  int32_t fy = labF((r * m[1][0] + g * m[1][1] + bl * m[1][2]) >> 14);
+  int32_t fz = labF((r * m[2][0] + g * m[2][1] + bl * m[2][2]) >> 14);
+
+  L = 116 * fy - 16 * 65536;
+  a = 500 * (fx - fy);
+  b = 200 * (fy - fz);
+}
+
+// Convert n colors from RGB to Lab
+inline void convert(const RGBColor* src, LabColor* dst, size_t n)
+{
+  for (size_t i = 0; i < n; ++i)
+  {
+    int32_t L, a, b;
+    rgbToLabQ16(src[i], L, a, b);
+
+    constexpr float q16 = 1.0f / 65536.0f;
+    dst[i].L = (float)L * q16;
+    dst[i].a = (float)a * q16;
+    dst[i].b = (float)b * q16;
+  }
+}
+
+// Convert n colors from Lab to RGB
+inline void convert(const LabColor* src, RGBColor* dst, size_t n)
+{
+  // XYZ to linear sRGB with the D65 white point multiplied in, Q12
+  constexpr int32_t m[3][3] = 
+  {
+    {12615, -6296, -2223},  //  3.2404542 * 0.95047, -1.5371385, -0.4985314 * 1.08883
+    {-3773,  7684,   185},  // -0.9692660 * 0.95047,  1.8760108,  0.0415560 * 1.08883
+    {  217,  -836,  4715},  //  0.0556434 * 0.95047, -0.2040259,  1.0572252 * 1.08883
+  };
+  const std::array<uint16_t, 256>& lin = srgbToLinearTable;
+
+  // Inverse of labF(), f in Q16, result in Q16 clamped to [0, 1]
+  auto labFInv = [](int32_t f) -> int32_t
+  {
+    int32_t t;
+    // 6/29 in Q16
+    if (f > 13559)
+    {
+      int64_t f64 = f;
+      t = (int32_t)((((f64 * f64) >> 16) * f64) >> 16);
+    }
+    else
+    {
+      // (f - 16/116) / 7.787, 1/7.787 as Q16
+      t = ((f - 9039) * 8416) >> 16;
+    }
+    return std::clamp(t, (int32_t)0, (int32_t)65536);
+  };
+
+  // Largest 8 bit value whose linear light is <= l (Q15), like truncating.
+  // Binary search, 8 steps.
+  auto toSrgb = [&lin](int32_t l) -> uint8_t
+  {
+    if (l <= 0) return 0;
+    if (l >= lin[255]) return 255;
+    uint32_t i = 0;
+    for (uint32_t step = 128; step > 0; step >>= 1)
+    {
+      if (lin[i + step] <= l) i += step;
+    }
+    return (uint8_t)i;
+  };
+
+  for (size_t i = 0; i < n; ++i)
+  {
+    // f values in Q16
+    int32_t fy = (int32_t)((src[i].L + 16.0f) * (65536.0f / 116.0f));
+    int32_t fx = (int32_t)(src[i].a * (65536.0f / 500.0f)) + fy;
+    int32_t fz = fy - (int32_t)(src[i].b * (65536.0f / 200.0f));
+
+    int32_t x = labFInv(fx);
+    int32_t y = labFInv(fy);
+    int32_t z = labFInv(fz);
+
+    // Q16 * Q12 >> 13 = Q15
+    dst[i].R = toSrgb((x * m[0][0] + y * m[0][1] + z * m[0][2]) >> 13);
+    dst[i].G = toSrgb((x * m[1][0] + y * m[1][1] + z * m[1][2]) >> 13);
+    dst[i].B = toSrgb((x * m[2][0] + y * m[2][1] + z * m[2][2]) >> 13);
+  }
+}
+
+inline void convert(const LEDBuffer& src, std::vector<LabColor>& dst)
+{
+  dst.resize(src.size());
+  convert(src.data(), dst.data(), src.size());
+}
+
+inline void convert(const std::vector<LabColor>& src, LEDBuffer& dst)
+{
+  dst.resize(src.size());
+  convert(src.data(), dst.data(), src.size());
+}
+
 LabColor RGBColor::toLab() const
 {
   LabColor lab;
@@ -370,11 +847,20 @@ RGBColor YUVColor::toRGB() const
 
 float LabColor::deltaE(const LabColor& other) const
 {
-  return sqrtf(powf(L-other.L, 2) + powf(a-other.a, 2) + powf(b-other.b, 2));
+  return sqrtf(deltaE2(other));
 }
 
-static const std::vector<RGBColor> kelvinTable = 
+float LabColor::deltaE2(const LabColor& other) const
 {
+  float dL = L - other.L;
+  float da = a - other.a;
+  float db = b - other.b;
+  return dL * dL + da * da + db * db;
+}
+
+// Color temperatures from 1000K to 12000K in steps of 100K
+inline constexpr std::array<RGBColor, 111> kelvinTable =
+{{
   /* 1000:  */ {255, 56, 0},
   /* 1100:  */ {255, 71, 0},
   /* 1200:  */ {255, 83, 0},
@@ -486,13 +972,18 @@ static const std::vector<RGBColor> kelvinTable =
   /* 11800: */ {196, 210, 255},
   /* 11900: */ {195, 210, 255},
   /* 12000: */ {195, 209, 255}
-};
+}};
 
 RGBColor GetColorFromTemperature(float tempK)
 {
-  float indexf = (tempK / 100.0f) - 10.0f;
-  int indexLo = std::clamp((int) indexf, 0, (int)(kelvinTable.size() - 1));
-  int indexHi = std::clamp((int) indexf + 1, 0, (int)(kelvinTable.size() - 1));
-  float t = std::clamp(indexf - (float)indexLo, 0.0f, 1.0f);
-  return RGBColor::blend(kelvinTable[indexLo], kelvinTable[indexHi], t);
+  // Integer interpolation between table entries, with the position in
+  // 1/256ths of a 100K step
+  constexpr int32_t lastIndex = (int32_t)kelvinTable.size() - 1;
+  int32_t pos = std::clamp((int32_t)tempK - 1000, (int32_t)0, lastIndex * 100) * 256 / 100;
+  int32_t index = pos >> 8;
+  if (index >= lastIndex)
+  {
+    return kelvinTable[lastIndex];
+  }
+  return RGBColor::blend8(kelvinTable[index], kelvinTable[index + 1], (uint8_t)(pos & 0xFF));
 }
\ No newline at end of file
@@ -66,6 +66,14 @@ public:
     return tachRpm_;
   }
 
+  // Call after changing the system clock. The PWM stays at 25kHz and the
+  // tach keeps sampling once a second.
+  void retune()
+  {
+    pwm_.retune();
+    tach_.retune();
+  }
+
   // Release all hardware resources held by the fan
   void release()
   {
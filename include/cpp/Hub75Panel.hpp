@@ -0,0 +1,465 @@
+#pragma once
+
+#include "Logging.hpp"
+#include "Color.hpp"
+#include "LedCalibration.hpp"
+#include "Pio.hpp"
+#include "hub75.pio.h"
+
+#include <pico/stdlib.h>
+#include <hardware/pio.h>
+#include <hardware/dma.h>
+#include <hardware/clocks.h>
+#include <hardware/timer.h>
+
+#include <array>
+#include <vector>
+
+// Drive a HUB75 RGB matrix panel (64x32, 64x64, and the like) with two
+// state machines on one PIO and four DMA channels, so refreshing the panel
+// takes no CPU time at all.
+//
+// Colors are shown with binary coded modulation: every row pair is shown
+// once per bit of color depth, each time for twice as long as the last.
+// The frame is kept as bit planes, one byte per pixel pair per bit, which
+// a DMA channel streams to hub75_data over and over. A second DMA channel
+// feeds hub75_row the row address and display time of every plane, and the
+// two programs keep in step through PIO IRQ flags 4 and 5, so each panel
+// needs a PIO of its own. A panel goes on the first PIO without one, and
+// doesn't start if there is none; check loaded().
+//
+// Each stream is restarted by a control channel that reloads its read
+// address when it finishes. writeColors() packs a frame into the back
+// buffer and points the control channel at it, so the panel switches
+// frames between refreshes and never shows half of one.
+//
+// Pins, in the usual HUB75 order:
+//   rgbBasePin     R1, G1, B1, R2, G2, B2 on 6 consecutive GPIOs
+//   addressBasePin A, B, C, D, E on consecutive GPIOs, as many as needed
+//   clockPin       CLK
+//   latchPin       LAT, with OE on the next GPIO
+class Hub75Panel : PioMachine
+{
+  // hub75_data sends a pixel every 3 cycles, so this clocks pixels in at
+  // about 21MHz whatever the system clock is
+  static constexpr float dataClockHz = 62500000.0f;
+  static constexpr uint32_t dataCyclesPerPixel = 3;
+
+  // Display time of the least significant bit. hub75_row runs at the
+  // system clock and counts it in cycles.
+  static constexpr uint32_t lsbNs = 256;
+
+  // hub75_row cycles per plane other than the display time
+  static constexpr uint32_t rowOverheadCycles = 6;
+
+  class RowMachine : public PioMachine
+  {
+  public:
+    RowMachine(PIO pio, uint addressBasePin, uint addressPinCount, uint latchPin) :
+      PioMachine(&hub75_row_program, pio)
+    {
+      if (!loaded_) return;
+
+      uint offset = prog_->offset();
+      config_ = hub75_row_program_get_default_config(offset);
+
+      sm_config_set_out_pins(&config_, addressBasePin, addressPinCount);
+      sm_config_set_sideset_pins(&config_, latchPin);
+
+      // One command word per plane
+      sm_config_set_out_shift(&config_, true, true, 32);
+      sm_config_set_fifo_join(&config_, PIO_FIFO_JOIN_TX);
+
+      for (uint i = 0; i < addressPinCount; ++i)
+      {
+        pio_gpio_init(pio_, addressBasePin + i);
+      }
+      pio_gpio_init(pio_, latchPin);
+      pio_gpio_init(pio_, latchPin + 1);
+      pio_sm_set_consecutive_pindirs(pio_, sm_, addressBasePin, addressPinCount, true);
+      pio_sm_set_consecutive_pindirs(pio_, sm_, latchPin, 2, true);
+
+      // Start blanked, with OE high
+      pio_sm_set_pins_with_mask(pio_, sm_, 1u << (latchPin + 1), 3u << latchPin);
+
+      pio_sm_init(pio_, sm_, offset, &config_);
+    }
+
+    uint sm() const
+    {
+      return sm_;
+    }
+
+    void enable(bool enabled)
+    {
+      pio_sm_set_enabled(pio_, sm_, enabled);
+    }
+  };
+
+public:
+  Hub75Panel(uint rgbBasePin,
+             uint addressBasePin,
+             uint clockPin,
+             uint latchPin,
+             int width = 64,
+             int height = 32,
+             int bitDepth = 8)
+    : PioMachine(&hub75_data_program, panelPio())
+    , width_{width}
+    , height_{height}
+    , scanRows_{height / 2}
+    , bitDepth_{std::clamp(bitDepth, 1, 10)}
+    , row_{loaded_ ? pio_ : pio0, addressBasePin, addressPinCount(height / 2), latchPin}
+  {
+    if (!loaded_ || !row_.loaded())
+    {
+      DEBUG_LOG("HUB75 panel needs two state machines on one PIO");
+      return;
+    }
+    if (panels_[PIO_NUM(pio_)])
+    {
+      DEBUG_LOG("PIO" << PIO_NUM(pio_) << " already drives a HUB75 panel");
+      return;
+    }
+
+    uint offset = prog_->offset();
+    config_ = hub75_data_program_get_default_config(offset);
+
+    sm_config_set_out_pins(&config_, rgbBasePin, 6);
+    sm_config_set_sideset_pins(&config_, clockPin);
+
+    // Autopull 4 pixels per word, first pixel in the least significant byte
+    sm_config_set_out_shift(&config_, true, true, 32);
+    sm_config_set_fifo_join(&config_, PIO_FIFO_JOIN_TX);
+    setClockHz(dataClockHz);
+
+    for (uint i = 0; i < 6; ++i)
+    {
+      pio_gpio_init(pio_, rgbBasePin + i);
+    }
+    pio_gpio_init(pio_, clockPin);
+    pio_sm_set_consecutive_pindirs(pio_, sm_, rgbBasePin, 6, true);
+    pio_sm_set_consecutive_pindirs(pio_, sm_, clockPin, 1, true);
+
+    pio_sm_init(pio_, sm_, offset, &config_);
+
+    // Park the row width in ISR, then empty OSR so the first autopull
+    // fetches pixels
+    pio_sm_put_blocking(pio_, sm_, (uint32_t)width_ - 1);
+    pio_sm_exec(pio_, sm_, pio_encode_pull(false, true));
+    pio_sm_exec(pio_, sm_, pio_encode_mov(pio_isr, pio_osr));
+    pio_sm_exec(pio_, sm_, pio_encode_out(pio_null, 32));
+
+    rowCommands_.resize(scanRows_ * bitDepth_);
+    buildRowCommands();
+
+    // Both frame buffers start black
+    size_t planeWords = (size_t)scanRows_ * bitDepth_ * width_ / 4;
+    frames_[0].assign(planeWords, 0);
+    frames_[1].assign(planeWords, 0);
+    frontFrame_ = frames_[0].data();
+    backFrame_ = 1;
+    rowSource_ = rowCommands_.data();
+
+    if (!claimDma())
+    {
+      return;
+    }
+
+    panels_[PIO_NUM(pio_)] = true;
+    pio_sm_set_enabled(pio_, sm_, true);
+    row_.enable(true);
+    dma_start_channel_mask(1u << dataControlChannel_ | 1u << rowControlChannel_);
+  }
+
+  // The DMA channels point into the panel, so it can't be copied or moved
+  Hub75Panel(const Hub75Panel&) = delete;
+  Hub75Panel& operator=(const Hub75Panel&) = delete;
+
+  ~Hub75Panel()
+  {
+    // Stop the state machines so the streams stall on their DREQs, then
+    // disable every channel and break the chains between them before
+    // aborting, so no channel can trigger another once it is stopped
+    if (loaded_)
+    {
+      pio_sm_set_enabled(pio_, sm_, false);
+    }
+    if (row_.loaded())
+    {
+      row_.enable(false);
+    }
+    if (dataChannel_ < 0) return;
+
+    for (int channel : {dataControlChannel_, rowControlChannel_, dataChannel_, rowChannel_})
+    {
+      dma_channel_config config = dma_get_channel_config(channel);
+      channel_config_set_chain_to(&config, channel);
+      channel_config_set_enable(&config, false);
+      dma_channel_set_config(channel, &config, false);
+    }
+    for (int channel : {dataControlChannel_, rowControlChannel_, dataChannel_, rowChannel_})
+    {
+      dma_channel_abort(channel);
+      dma_channel_unclaim(channel);
+    }
+    panels_[PIO_NUM(pio_)] = false;
+  }
+
+  // Whether the panel is refreshing. false if there was no PIO, state
+  // machines, or DMA channels for it.
+  bool loaded() const
+  {
+    return dataChannel_ >= 0;
+  }
+
+  // Pack buffer, width * height pixels in row major order, into bit planes
+  // and show it from the next refresh on. Brightness, color balance, and
+  // gamma are applied like on the LED strips, at the panel's bit depth.
+  void writeColors(const LEDBuffer& buffer, float brightness = 1.0f)
+  {
+    if (dataChannel_ < 0 || buffer.size() < (size_t)(width_ * height_)) return;
+
+    uint64_t startUs = time_us_64();
+
+    calibration_.brightness(brightness);
+    calibration_.update16();
+    if (calibration_.generation() != tableGeneration_)
+    {
+      buildTables();
+    }
+
+    // The back buffer may still be streaming if the last swap hasn't been
+    // picked up yet
+    waitForSwap();
+
+    uint8_t* planes = (uint8_t*)frames_[backFrame_].data();
+    for (int row = 0; row < scanRows_; ++row)
+    {
+      const RGBColor* top = &buffer[row * width_];
+      const RGBColor* bottom = &buffer[(row + scanRows_) * width_];
+      uint8_t* out = planes + row * bitDepth_ * width_;
+      for (int x = 0; x < width_; ++x)
+      {
+        uint32_t r1 = lutR_[top[x].R];
+        uint32_t g1 = lutG_[top[x].G];
+        uint32_t b1 = lutB_[top[x].B];
+        uint32_t r2 = lutR_[bottom[x].R];
+        uint32_t g2 = lutG_[bottom[x].G];
+        uint32_t b2 = lutB_[bottom[x].B];
+        for (int bit = 0; bit < bitDepth_; ++bit)
+        {
+          out[bit * width_ + x] = (uint8_t)(((r1 >> bit) & 1) |
+                                            ((g1 >> bit) & 1) << 1 |
+                                            ((b1 >> bit) & 1) << 2 |
+                                            ((r2 >> bit) & 1) << 3 |
+                                            ((g2 >> bit) & 1) << 4 |
+                                            ((b2 >> bit) & 1) << 5);
+        }
+      }
+    }
+
+    // The data control channel picks this up at the end of the refresh
+    frontFrame_ = frames_[backFrame_].data();
+    backFrame_ ^= 1;
+
+    lastWriteUs_ = time_us_64() - startUs;
+  }
+
+  int width() const
+  {
+    return width_;
+  }
+
+  int height() const
+  {
+    return height_;
+  }
+
+  int bitDepth() const
+  {
+    return bitDepth_;
+  }
+
+  // Full refreshes of the panel per second. A plane's display overlaps
+  // with shifting in the next one, so each takes the longer of the two.
+  float refreshHz() const
+  {
+    uint32_t shiftCycles = (uint32_t)((float)(width_ * dataCyclesPerPixel + 3) * clockDivider(dataClockHz));
+    uint64_t rowCycles = 0;
+    for (int bit = 0; bit < bitDepth_; ++bit)
+    {
+      rowCycles += std::max(shiftCycles, (lsbCycles_ << bit) + rowOverheadCycles);
+    }
+    return (float)clock_get_hz(clk_sys) / (float)(rowCycles * scanRows_);
+  }
+
+  // CPU time taken by the last writeColors(). Refreshing takes none, so
+  // the CPU load is this times the rate frames are written at.
+  uint64_t lastWriteUs() const
+  {
+    return lastWriteUs_;
+  }
+
+  // Fraction of one core spent packing frames written framesPerSecond
+  // times a second
+  float cpuLoad(float framesPerSecond) const
+  {
+    return (float)lastWriteUs_ * framesPerSecond / 1000000.0f;
+  }
+
+  inline void gamma(float gamma)
+  {
+    calibration_.gamma(gamma);
+  }
+
+  inline void colorBalance(const Vec3f& colorBalance)
+  {
+    calibration_.colorBalance(colorBalance);
+  }
+
+  // Call after changing the system clock. The pixel clock goes back to
+  // about 21MHz, and the row commands are rewritten in place for the same
+  // display times, so the refresh keeps running through the change.
+  void retune() override
+  {
+    if (dataChannel_ < 0) return;
+    PioMachine::retune();
+    buildRowCommands();
+  }
+
+private:
+  // The first PIO without a panel that has two free state machines. If
+  // there isn't one the constructor fails on whichever PIO it gets.
+  static PIO panelPio()
+  {
+    for (uint i = 0; i < NUM_PIOS; ++i)
+    {
+      PIO pio = PIO_INSTANCE(i);
+      uint free = 0;
+      for (uint sm = 0; sm < NUM_PIO_STATE_MACHINES; ++sm)
+      {
+        if (!pio_sm_is_claimed(pio, sm)) ++free;
+      }
+      if (!panels_[i] && free >= 2) return pio;
+    }
+    return PIO_INSTANCE(0);
+  }
+
+  static uint addressPinCount(int scanRows)
+  {
+    uint count = 1;
+    while ((1 << count) < scanRows) ++count;
+    return count;
+  }
+
+  // One command per plane: the row address, and a display time that
+  // doubles with each bit
+  void buildRowCommands()
+  {
+    lsbCycles_ = std::max(1u, (uint32_t)((uint64_t)clock_get_hz(clk_sys) * lsbNs / 1000000000));
+    for (int row = 0; row < scanRows_; ++row)
+    {
+      for (int bit = 0; bit < bitDepth_; ++bit)
+      {
+        rowCommands_[row * bitDepth_ + bit] = (uint32_t)row | ((lsbCycles_ << bit) - 1) << 5;
+      }
+    }
+  }
+
+  // Output codes at the panel's bit depth for each 8 bit channel value
+  void buildTables()
+  {
+    uint32_t maxCode = (1u << bitDepth_) - 1;
+    for (int i = 0; i < 256; ++i)
+    {
+      RGBColor16 c = calibration_.apply16(RGBColor16::fromRGB({(uint8_t)i, (uint8_t)i, (uint8_t)i}));
+      lutR_[i] = (uint16_t)((c.R * maxCode + 32640) / 65280);
+      lutG_[i] = (uint16_t)((c.G * maxCode + 32640) / 65280);
+      lutB_[i] = (uint16_t)((c.B * maxCode + 32640) / 65280);
+    }
+    tableGeneration_ = calibration_.generation();
+  }
+
+  // Wait until the data channel is streaming from the front buffer
+  void waitForSwap() const
+  {
+    const uint8_t* begin = (const uint8_t*)frontFrame_;
+    const uint8_t* end = begin + frames_[0].size() * sizeof(uint32_t);
+    while (true)
+    {
+      const uint8_t* reading = (const uint8_t*)(uintptr_t)dma_channel_hw_addr(dataChannel_)->read_addr;
+      if (reading >= begin && reading < end) break;
+      tight_loop_contents();
+    }
+  }
+
+  bool claimDma()
+  {
+    dataChannel_ = dma_claim_unused_channel(false);
+    dataControlChannel_ = dma_claim_unused_channel(false);
+    rowChannel_ = dma_claim_unused_channel(false);
+    rowControlChannel_ = dma_claim_unused_channel(false);
+    if (dataChannel_ < 0 || dataControlChannel_ < 0 || rowChannel_ < 0 || rowControlChannel_ < 0)
+    {
+      DEBUG_LOG("HUB75 panel needs 4 free DMA channels");
+      for (int* channel : {&dataChannel_, &dataControlChannel_, &rowChannel_, &rowControlChannel_})
+      {
+        if (*channel >= 0)
+        {
+          dma_channel_unclaim(*channel);
+        }
+        *channel = -1;
+      }
+      return false;
+    }
+
+    configureStream(dataChannel_, dataControlChannel_, sm_, frames_[0].size(), &frontFrame_);
+    configureStream(rowChannel_, rowControlChannel_, row_.sm(), rowCommands_.size(), &rowSource_);
+    return true;
+  }
+
+  // A stream channel moves count words into a state machine's TX FIFO,
+  // then chains to its control channel, which writes *source to the
+  // stream's read address trigger to start it over
+  void configureStream(int channel, int controlChannel, uint sm, size_t count, const uint32_t* const volatile* source)
+  {
+    dma_channel_config config = dma_channel_get_default_config(channel);
+    channel_config_set_transfer_data_size(&config, DMA_SIZE_32);
+    channel_config_set_read_increment(&config, true);
+    channel_config_set_write_increment(&config, false);
+    channel_config_set_dreq(&config, pio_get_dreq(pio_, sm, true));
+    channel_config_set_chain_to(&config, controlChannel);
+    dma_channel_configure(channel, &config, &pio_->txf[sm], nullptr, count, false);
+
+    dma_channel_config control = dma_channel_get_default_config(controlChannel);
+    channel_config_set_transfer_data_size(&control, DMA_SIZE_32);
+    channel_config_set_read_increment(&control, false);
+    channel_config_set_write_increment(&control, false);
+    dma_channel_configure(controlChannel, &control, &dma_hw->ch[channel].al3_read_addr_trig, source, 1, false);
+  }
+
+  int width_;
+  int height_;
+  int scanRows_;
+  int bitDepth_;
+  RowMachine row_;
+  LedCalibration calibration_;
+  uint32_t tableGeneration_ = 0;
+  std::array<uint16_t, 256> lutR_ {};
+  std::array<uint16_t, 256> lutG_ {};
+  std::array<uint16_t, 256> lutB_ {};
+  std::array<std::vector<uint32_t>, 2> frames_;
+  std::vector<uint32_t> rowCommands_;
+  uint32_t lsbCycles_ = 0;
+  const uint32_t* volatile frontFrame_ = nullptr;
+  const uint32_t* volatile rowSource_ = nullptr;
+  int backFrame_ = 0;
+  int dataChannel_ = -1;
+  int dataControlChannel_ = -1;
+  int rowChannel_ = -1;
+  int rowControlChannel_ = -1;
+  uint64_t lastWriteUs_ = 0;
+
+  static inline bool panels_[NUM_PIOS] {};
+};
@@ -3,6 +3,7 @@
 #include "Logging.hpp"
 #include "Math.hpp"
 #include "Pio.hpp"
+#include "PioTiming.hpp"
 
 #include "joybus_host.pio.h"
 #include "joybus_client.pio.h"
@@ -23,19 +24,21 @@ enum class JoybusCommand : uint8_t
   Reset = 0xFF,
 };
 
-struct JoybusBuffer : public PioBuffer
+static constexpr float joybusPioClockHz = JoybusTiming::pioClockHz;
+
+struct JoybusBuffer final : public PioBufferPacker<JoybusBuffer>
 {
   uint8_t* data;
-  JoybusBuffer(uint8_t* data, size_t size) : PioBuffer(size), data(data) {}
+  JoybusBuffer(uint8_t* data, size_t size) : PioBufferPacker(size), data(data) {}
 
-  virtual void pack(uint32_t& dst, size_t i) const override
+  uint32_t packWord(size_t i) const
   {
     // Data being sent is inverted, and left shifted 24 places
     // Only one byte is sent per Tx buffer
-    dst = (~data[i]) << 24;
+    return (uint32_t)(~data[i]) << 24;
   }
 
-  virtual void unpack(const uint32_t& src, size_t i) override
+  void unpackWord(uint32_t src, size_t i)
   {
     // Data received is not inverted, and just needs to be truncated
     // Only one byte is received per Rx buffer
@@ -43,34 +46,44 @@ struct JoybusBuffer : public PioBuffer
   }
 };
 
-struct JoybusBuffer16 : public PioBuffer
+struct JoybusBuffer16 final : public PioBufferPacker<JoybusBuffer16>
 {
   uint16_t* data;
-  JoybusBuffer16(uint16_t* data, size_t size) : PioBuffer(size*2), data(data) {}
+  JoybusBuffer16(uint16_t* data, size_t size) : PioBufferPacker(size*2), data(data) {}
 
-  virtual void pack(uint32_t& dst, size_t i) const override
+  uint32_t packWord(size_t i) const
   {
-    // Data being sent is inverted, and left shifted 24 places
-    // Only one byte is sent per Tx buffer
-    if (i % 2 == 0)
+    // Data being sent is inverted, high byte first, in the top byte
+    return (i & 1) ? ~((uint32_t)data[i/2] << 24) : ~((uint32_t)data[i/2] << 16);
+  }
+
+  void unpackWord(uint32_t src, size_t i)
+  {
+    if (i & 1)
     {
-      dst = ~((uint32_t)data[i/2] << 16);
+      data[i/2] = (src & 0x00FF) | (data[i/2] & 0xFF00);
     }
     else
     {
-      dst = ~((uint32_t)data[i/2] << 24);
+      data[i/2] = (data[i/2] & 0x00FF) | ((src << 8) & 0xFF00);
     }
   }
 
-  virtual void unpack(const uint32_t& src, size_t i) override
+  // Two words per value, with no per word index math
+  void packAll(uint32_t* dst) const
   {
-    if (i % 2 == 0)
+    for (size_t j = 0; j < size / 2; ++j)
     {
-      data[i/2] = (data[i/2] & 0x00FF) | ((src << 8) & 0xFF00);
+      dst[2*j] = ~((uint32_t)data[j] << 16);
+      dst[2*j + 1] = ~((uint32_t)data[j] << 24);
     }
-    else
+  }
+
+  void unpackAll(const uint32_t* src)
+  {
+    for (size_t j = 0; j < size / 2; ++j)
     {
-      data[i/2] = (src & 0x00FF) | (data[i/2] & 0xFF00);
+      data[j] = (uint16_t)(((src[2*j] << 8) & 0xFF00) | (src[2*j + 1] & 0x00FF));
     }
   }
 };
@@ -106,7 +119,7 @@ public:
 
     // Set the pin direction to input at the PIO
     pio_sm_set_consecutive_pindirs(pio_, sm_, pin, 1, false);
-    sm_config_set_clkdiv(&config_, 15.625f);
+    setClockHz(joybusPioClockHz);
 
     // Load our configuration, and jump to the start of the program
     pio_sm_init(pio_, sm_, prog_->offset(), &config_);
@@ -117,8 +130,13 @@ public:
     commandAllowedTime = get_absolute_time();
   }
 
-  // Send a command with no payload, then read the response into a single buffer
-  bool command(JoybusCommand cmd, PioBuffer& responseBuffer)
+  // Call after changing the system clock to keep the bit timing
+  using PioMachine::retune;
+
+  // Send a command with no payload, then read the response into a single
+  // buffer. Templated so buffers of a known type are packed in one call.
+  template <typename Buffer>
+  bool command(JoybusCommand cmd, Buffer& responseBuffer)
   {
     JoybusBuffer commandBuffer((uint8_t*)(&cmd), 1);
 
@@ -153,7 +171,8 @@ public:
     return true;
   }
 
-  bool command(JoybusCommand cmd, uint16_t address, PioBuffer& responseBuffer, uint8_t& crc)
+  template <typename Buffer>
+  bool command(JoybusCommand cmd, uint16_t address, Buffer& responseBuffer, uint8_t& crc)
   {
     JoybusBuffer commandBuffer((uint8_t*)(&cmd), 1);
     JoybusBuffer16 addressBuffer(&address, 1);
@@ -197,7 +216,8 @@ public:
     return true;
   }
 
-  bool command(JoybusCommand cmd, uint16_t address, const PioBuffer& sendBuffer, uint8_t& crc)
+  template <typename Buffer>
+  bool command(JoybusCommand cmd, uint16_t address, const Buffer& sendBuffer, uint8_t& crc)
   {
     JoybusBuffer commandBuffer((uint8_t*)(&cmd), 1);
     JoybusBuffer16 addressBuffer(&address, 1);
@@ -384,7 +404,7 @@ public:
 
     // Set the pin direction to input at the PIO
     pio_sm_set_consecutive_pindirs(pio_, sm_, pin, 1, false);
-    sm_config_set_clkdiv(&config_, 15.625f);
+    setClockHz(joybusPioClockHz);
 
     // Load our configuration, and jump to the start of the program
     pio_sm_init(pio_, sm_, prog_->offset(), &config_);
@@ -397,6 +417,9 @@ public:
     pio_sm_set_enabled(pio_, sm_, true);
   }
 
+  // Call after a system clock change, see PioMachine::retune()
+  using PioMachine::retune;
+
   ~JoybusClient()
   {
     // Erase self from instances list
@@ -0,0 +1,188 @@
+#pragma once
+
+#include "Color.hpp"
+#include "Vector.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <memory>
+
+// Folds color balance, brightness, and gamma into one 256 entry lookup
+// table per channel, so calibrating a pixel costs three table reads
+// instead of float multiplies and powf calls.
+//
+// The tables are built with the same float math as RGBColor's operators
+// and applyGamma(), so the output matches the scalar path exactly. They
+// are only rebuilt by update() after one of the inputs has changed.
+class LedCalibration
+{
+public:
+  void gamma(float gamma)
+  {
+    if (gamma != gamma_)
+    {
+      gamma_ = gamma;
+      dirty_ = true;
+      dirty16_ = true;
+    }
+  }
+
+  float gamma() const
+  {
+    return gamma_;
+  }
+
+  void colorBalance(const Vec3f& colorBalance)
+  {
+    if (colorBalance != colorBalance_)
+    {
+      colorBalance_ = colorBalance;
+      dirty_ = true;
+      dirty16_ = true;
+    }
+  }
+
+  const Vec3f& colorBalance() const
+  {
+    return colorBalance_;
+  }
+
+  void brightness(float brightness)
+  {
+    if (brightness != brightness_)
+    {
+      brightness_ = brightness;
+      dirty_ = true;
+      dirty16_ = true;
+    }
+  }
+
+  float brightness() const
+  {
+    return brightness_;
+  }
+
+  // Rebuild the tables if gamma, color balance, or brightness changed.
+  // Call this once before calibrating a batch of pixels.
+  void update()
+  {
+    if (!dirty_) return;
+
+    for (int i = 0; i < 256; ++i)
+    {
+      RGBColor c = RGBColor{(uint8_t)i, (uint8_t)i, (uint8_t)i} * colorBalance_ * brightness_;
+      c.applyGamma(gamma_);
+      lutR_[i] = c.R;
+      lutG_[i] = c.G;
+      lutB_[i] = c.B;
+    }
+    dirty_ = false;
+    ++generation_;
+  }
+
+  // Incremented every time update() or update16() rebuilds tables, so
+  // colors cached by an output can be checked against them
+  uint32_t generation() const
+  {
+    return generation_;
+  }
+
+  inline RGBColor apply(const RGBColor& c) const
+  {
+    return {lutR_[c.R], lutG_[c.G], lutB_[c.B]};
+  }
+
+  // Calibrate a color and pack it as a 24 bit GRB word (WS2812B wire order)
+  inline uint32_t packGRB(const RGBColor& c) const
+  {
+    return (uint32_t)lutG_[c.G] << 16 | (uint32_t)lutR_[c.R] << 8 | (uint32_t)lutB_[c.B];
+  }
+
+  // Rebuild the 16 bit tables used by apply16() and packGRBDithered().
+  // They are allocated here on the first call, so outputs that never use
+  // 16 bit color don't carry the extra 1.5KB.
+  void update16()
+  {
+    if (!lut16_)
+    {
+      lut16_ = std::make_unique<Lut16>();
+      dirty16_ = true;
+    }
+    if (!dirty16_) return;
+
+    // Entry i is the output for input i * 256, as an 8.8 fixed point code
+    for (int i = 0; i <= 256; ++i)
+    {
+      float v = std::min((float)(i * 256) / 65535.0f, 1.0f) * brightness_;
+      lut16_->R[i] = toCode16(v * colorBalance_.X);
+      lut16_->G[i] = toCode16(v * colorBalance_.Y);
+      lut16_->B[i] = toCode16(v * colorBalance_.Z);
+    }
+    dirty16_ = false;
+    ++generation_;
+  }
+
+  // Calibrate a 16 bit channel value to an 8.8 fixed point output code,
+  // interpolating between table entries
+  static inline uint16_t lookup16(const std::array<uint16_t, 257>& lut, uint16_t v)
+  {
+    uint32_t i = v >> 8;
+    uint32_t frac = v & 0xFF;
+    return (uint16_t)(lut[i] + (((int32_t)lut[i + 1] - (int32_t)lut[i]) * (int32_t)frac >> 8));
+  }
+
+  // Calibrate a 16 bit color to 8.8 fixed point output codes, for outputs
+  // with more than 8 bits per channel. update16() must have been called.
+  inline RGBColor16 apply16(const RGBColor16& c) const
+  {
+    return {lookup16(lut16_->R, c.R), lookup16(lut16_->G, c.G), lookup16(lut16_->B, c.B)};
+  }
+
+  // Calibrate a 16 bit color, then round each channel to 8 bits with
+  // first order temporal dithering: the fraction dropped from the output
+  // is kept in the pixel's error bytes and carried into the next frame,
+  // so over a few frames the light averages out to the 16 bit value.
+  // `error` holds 3 bytes of state per pixel. update16() must have been
+  // called.
+  inline uint32_t packGRBDithered(const RGBColor16& c, uint8_t* error) const
+  {
+    uint32_t r = ditherChannel(lookup16(lut16_->R, c.R), error[0]);
+    uint32_t g = ditherChannel(lookup16(lut16_->G, c.G), error[1]);
+    uint32_t b = ditherChannel(lookup16(lut16_->B, c.B), error[2]);
+    return g << 16 | r << 8 | b;
+  }
+
+private:
+  uint16_t toCode16(float x) const
+  {
+    x = std::clamp(x, 0.0f, 1.0f);
+    return (uint16_t)(powf(x, gamma_) * 255.0f * 256.0f + 0.5f);
+  }
+
+  static inline uint8_t ditherChannel(uint16_t code, uint8_t& error)
+  {
+    // The top code has no fraction, so this never carries past 255
+    uint32_t sum = (uint32_t)error + (code & 0xFF);
+    error = (uint8_t)sum;
+    return (uint8_t)((code >> 8) + (sum >> 8));
+  }
+
+  Vec3f colorBalance_ {1.0f, 1.0f, 1.0f};
+  float gamma_ {1.0f};
+  float brightness_ {1.0f};
+  bool dirty_ {true};
+  bool dirty16_ {true};
+  uint32_t generation_ {0};
+  std::array<uint8_t, 256> lutR_;
+  std::array<uint8_t, 256> lutG_;
+  std::array<uint8_t, 256> lutB_;
+
+  struct Lut16
+  {
+    std::array<uint16_t, 257> R;
+    std::array<uint16_t, 257> G;
+    std::array<uint16_t, 257> B;
+  };
+  std::unique_ptr<Lut16> lut16_;
+};
@@ -0,0 +1,321 @@
+#pragma once
+
+#include "Logging.hpp"
+#include "Color.hpp"
+
+#include <pico/stdlib.h>
+#include <pico/multicore.h>
+#include <hardware/timer.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// Mixes layers of LED effects into one frame, on core1 or on the caller's
+// core. Each layer owns an LEDBuffer that its effect callback redraws every
+// frame, and is mixed over the layers below it with a blend mode and an
+// opacity, all in 8 bit fixed point.
+//
+// Finished frames are handed to the output through a double buffer. The
+// renderer draws into the back buffer while the output sends the front one,
+// and swaps them once the output has released the front. The only shared
+// state is the ready flag, which is only ever loaded and stored, never
+// read-modify-written, so it is lock free on the M0+.
+//
+// On core0:
+//   if (const LEDBuffer* frame = compositor.acquire())
+//   {
+//     strip.writeColors(*frame);
+//     compositor.release();
+//   }
+//
+// Render times are kept for each layer, so an effect that blows the frame
+// budget shows up by name rather than as a dropped frame rate.
+class LedCompositor
+{
+public:
+  enum class BlendMode
+  {
+    Normal,
+    Add,
+    Subtract,
+    Multiply,
+    Screen,
+    Lighten,
+    Darken
+  };
+
+  // Draws a layer's frame into its buffer. frame counts up from 0 and
+  // timeUs is the time the frame started, shared by every layer.
+  using Effect = std::function<void(LEDBuffer& layer, uint32_t frame, uint64_t timeUs)>;
+
+  LedCompositor(size_t pixelCount) :
+    pixelCount_(pixelCount)
+  {
+    buffers_[0].resize(pixelCount);
+    buffers_[1].resize(pixelCount);
+  }
+
+  ~LedCompositor()
+  {
+    stop();
+  }
+
+  // Add a layer on top of the others, returning its index
+  int addLayer(Effect effect, BlendMode mode = BlendMode::Normal, uint8_t opacity = 255)
+  {
+    if (core1Running_.load())
+    {
+      DEBUG_LOG("Can't add compositor layers while core1 is rendering");
+      return -1;
+    }
+    Layer layer;
+    layer.effect = effect;
+    layer.mode = mode;
+    layer.opacity = opacity;
+    layer.pixels.resize(pixelCount_);
+    layers_.push_back(std::move(layer));
+    return (int)layers_.size() - 1;
+  }
+
+  size_t layerCount() const
+  {
+    return layers_.size();
+  }
+
+  // Layer settings may be changed from either core at any time. They are
+  // single bytes, so a frame sees either the old or the new value.
+  void opacity(int layer, uint8_t opacity)
+  {
+    layers_[layer].opacity = opacity;
+  }
+
+  void blendMode(int layer, BlendMode mode)
+  {
+    layers_[layer].mode = mode;
+  }
+
+  void enabled(int layer, bool enabled)
+  {
+    layers_[layer].enabled = enabled;
+  }
+
+  // The layer's own buffer, as its effect last drew it
+  const LEDBuffer& layerPixels(int layer) const
+  {
+    return layers_[layer].pixels;
+  }
+
+  // Render one frame into the back buffer and publish it. Blocks until the
+  // output has released the previous frame, so it never runs ahead of it.
+  void renderFrame()
+  {
+    uint64_t startUs = time_us_64();
+    LEDBuffer& out = buffers_[back_];
+    std::fill(out.begin(), out.end(), RGBColor{0, 0, 0});
+
+    for (Layer& layer : layers_)
+    {
+      if (!layer.enabled || layer.opacity == 0)
+      {
+        layer.renderUs = 0;
+        continue;
+      }
+      uint32_t layerStartUs = time_us_32();
+      if (layer.effect)
+      {
+        layer.effect(layer.pixels, frame_, startUs);
+      }
+      blend(out.data(), layer.pixels.data(), pixelCount_, layer.mode, layer.opacity);
+      layer.renderUs = time_us_32() - layerStartUs;
+      layer.peakUs = std::max(layer.peakUs, layer.renderUs);
+    }
+
+    // Wait for the output to finish with the front buffer, then swap
+    while (ready_.load(std::memory_order_acquire))
+    {
+      if (stopping_.load()) return;
+      tight_loop_contents();
+    }
+    front_ = back_;
+    back_ ^= 1;
+    ready_.store(true, std::memory_order_release);
+
+    ++frame_;
+    frameUs_ = (uint32_t)(time_us_64() - startUs);
+  }
+
+  // The newest finished frame, or nullptr if there is none since the last
+  // release(). The frame stays valid until release() is called.
+  const LEDBuffer* acquire() const
+  {
+    if (!ready_.load(std::memory_order_acquire)) return nullptr;
+    return &buffers_[front_];
+  }
+
+  // Hand the acquired frame back so the renderer can publish the next one
+  void release()
+  {
+    ready_.store(false, std::memory_order_release);
+  }
+
+  // Launch core1 and render frames on it until stop(). Core1 registers as
+  // a multicore lockout victim, so FlashStorage built with
+  // ENABLE_PICO_MULTICORE can still pause it to write flash.
+  void start()
+  {
+    if (core1Running_.load()) return;
+    if (core1Compositor_ != nullptr)
+    {
+      DEBUG_LOG("Core1 is already rendering another compositor");
+      return;
+    }
+    core1Compositor_ = this;
+    stopping_.store(false);
+    core1Running_.store(true);
+    multicore_launch_core1(core1Entry);
+  }
+
+  // Stop core1 after the frame it is rendering, and reset it
+  void stop()
+  {
+    if (!core1Running_.load()) return;
+    stopping_.store(true);
+    while (core1Running_.load())
+    {
+      tight_loop_contents();
+    }
+    multicore_reset_core1();
+    core1Compositor_ = nullptr;
+  }
+
+  bool running() const
+  {
+    return core1Running_.load();
+  }
+
+  // Time the layer's effect and blend took in the last frame, and the
+  // longest they have taken since resetStats()
+  uint32_t layerRenderUs(int layer) const
+  {
+    return layers_[layer].renderUs;
+  }
+
+  uint32_t layerPeakUs(int layer) const
+  {
+    return layers_[layer].peakUs;
+  }
+
+  // Time the last frame took, including any wait for the output
+  uint32_t frameUs() const
+  {
+    return frameUs_;
+  }
+
+  uint32_t framesRendered() const
+  {
+    return frame_;
+  }
+
+  void resetStats()
+  {
+    for (Layer& layer : layers_)
+    {
+      layer.peakUs = 0;
+    }
+  }
+
+  // Mix n pixels of src over dst with a blend mode, then fade the result
+  // in over dst by opacity/255
+  static void blend(RGBColor* dst, const RGBColor* src, size_t n, BlendMode mode, uint8_t opacity)
+  {
+    switch (mode)
+    {
+      case BlendMode::Normal:
+        blendWith(dst, src, n, opacity, [](uint8_t, uint8_t s) { return s; });
+        break;
+      case BlendMode::Add:
+        blendWith(dst, src, n, opacity, [](uint8_t d, uint8_t s) { return qadd8(d, s); });
+        break;
+      case BlendMode::Subtract:
+        blendWith(dst, src, n, opacity, [](uint8_t d, uint8_t s) { return qsub8(d, s); });
+        break;
+      case BlendMode::Multiply:
+        blendWith(dst, src, n, opacity, [](uint8_t d, uint8_t s) { return scale8(d, s); });
+        break;
+      case BlendMode::Screen:
+        blendWith(dst, src, n, opacity, [](uint8_t d, uint8_t s) { return (uint8_t)(255 - scale8(255 - d, 255 - s)); });
+        break;
+      case BlendMode::Lighten:
+        blendWith(dst, src, n, opacity, [](uint8_t d, uint8_t s) { return std::max(d, s); });
+        break;
+      case BlendMode::Darken:
+        blendWith(dst, src, n, opacity, [](uint8_t d, uint8_t s) { return std::min(d, s); });
+        break;
+    }
+  }
+
+private:
+  struct Layer
+  {
+    Effect effect;
+    LEDBuffer pixels;
+    volatile BlendMode mode = BlendMode::Normal;
+    volatile uint8_t opacity = 255;
+    volatile bool enabled = true;
+    uint32_t renderUs = 0;
+    uint32_t peakUs = 0;
+  };
+
+  template <typename Op>
+  static void blendWith(RGBColor* dst, const RGBColor* src, size_t n, uint8_t opacity, Op op)
+  {
+    if (opacity == 255)
+    {
+      for (size_t i = 0; i < n; ++i)
+      {
+        dst[i].R = op(dst[i].R, src[i].R);
+        dst[i].G = op(dst[i].G, src[i].G);
+        dst[i].B = op(dst[i].B, src[i].B);
+      }
+      return;
+    }
+
+    for (size_t i = 0; i < n; ++i)
+    {
+      dst[i].R = lerp8(dst[i].R, op(dst[i].R, src[i].R), opacity);
+      dst[i].G = lerp8(dst[i].G, op(dst[i].G, src[i].G), opacity);
+      dst[i].B = lerp8(dst[i].B, op(dst[i].B, src[i].B), opacity);
+    }
+  }
+
+  static void core1Entry()
+  {
+    multicore_lockout_victim_init();
+    LedCompositor* compositor = core1Compositor_;
+    while (!compositor->stopping_.load())
+    {
+      compositor->renderFrame();
+    }
+    compositor->core1Running_.store(false);
+    while (true)
+    {
+      tight_loop_contents();
+    }
+  }
+
+  static inline LedCompositor* core1Compositor_ = nullptr;
+
+  size_t pixelCount_;
+  std::vector<Layer> layers_;
+  LEDBuffer buffers_[2];
+  volatile int front_ = 0;
+  int back_ = 0;
+  std::atomic<bool> ready_ {false};
+  std::atomic<bool> stopping_ {false};
+  std::atomic<bool> core1Running_ {false};
+  volatile uint32_t frame_ = 0;
+  volatile uint32_t frameUs_ = 0;
+};
@@ -0,0 +1,274 @@
+#pragma once
+
+#include "Logging.hpp"
+#include "Color.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+
+// A 2D view over an LEDBuffer for strips wired as a matrix. The buffer stays
+// in wire order, so it can be passed straight to LedStripWs2812b or the
+// parallel outputs with no copy; the matrix only translates (x, y).
+//
+// The translation is built once, as a table with one buffer index per pixel
+// in row major order. Drawing walks the table and the source rows in order,
+// with no per pixel layout math.
+class LedMatrix
+{
+public:
+  // How a panel's wiring is turned relative to the display, clockwise
+  enum class Rotation
+  {
+    Rotate0,
+    Rotate90,
+    Rotate180,
+    Rotate270
+  };
+
+  struct Layout
+  {
+    // Size of one panel as displayed
+    int width = 8;
+    int height = 8;
+    // Every other row of the wiring runs backwards
+    bool serpentine = true;
+    Rotation rotation = Rotation::Rotate0;
+    // Panels chained into a larger display, left to right then top to bottom
+    int tilesX = 1;
+    int tilesY = 1;
+    // Every other row of panels is chained right to left
+    bool tileSerpentine = false;
+  };
+
+  // The table holds 16 bit indices, so the matrix must end within the
+  // first 65536 pixels of its buffer
+  static constexpr size_t maxPixels = 65536;
+
+  // View `buffer` from `offset` as a matrix. The buffer is grown if it is
+  // too small to hold every pixel of the layout. A layout that would end
+  // past maxPixels is rejected, leaving a 0x0 matrix.
+  LedMatrix(LEDBuffer& buffer, const Layout& layout, size_t offset = 0) :
+    buffer_(buffer),
+    width_(layout.width * layout.tilesX),
+    height_(layout.height * layout.tilesY)
+  {
+    size_t pixelCount = (size_t)width_ * (size_t)height_;
+    if (offset + pixelCount > maxPixels)
+    {
+      DEBUG_LOG("LedMatrix only indexes the first " << maxPixels << " pixels of a buffer, ignoring the layout");
+      width_ = 0;
+      height_ = 0;
+      return;
+    }
+    if (buffer_.size() < offset + pixelCount)
+    {
+      buffer_.resize(offset + pixelCount);
+    }
+
+    map_.resize(pixelCount);
+    for (int y = 0; y < height_; ++y)
+    {
+      for (int x = 0; x < width_; ++x)
+      {
+        map_[y * width_ + x] = (uint16_t)(offset + wireIndex(layout, x, y));
+      }
+    }
+  }
+
+  int width() const
+  {
+    return width_;
+  }
+
+  int height() const
+  {
+    return height_;
+  }
+
+  // Position of pixel (x, y) in the buffer
+  size_t index(int x, int y) const
+  {
+    return map_[y * width_ + x];
+  }
+
+  // Unchecked pixel access
+  RGBColor& at(int x, int y)
+  {
+    return buffer_[map_[y * width_ + x]];
+  }
+
+  const RGBColor& at(int x, int y) const
+  {
+    return buffer_[map_[y * width_ + x]];
+  }
+
+  // Set a pixel, ignoring positions off the matrix
+  void set(int x, int y, const RGBColor& color)
+  {
+    if (x < 0 || y < 0 || x >= width_ || y >= height_) return;
+    at(x, y) = color;
+  }
+
+  void fill(const RGBColor& color)
+  {
+    fillRect(0, 0, width_, height_, color);
+  }
+
+  // Fill a rectangle, clipped to the matrix
+  void fillRect(int x, int y, int w, int h, const RGBColor& color)
+  {
+    int x0 = std::max(x, 0);
+    int y0 = std::max(y, 0);
+    int x1 = std::min(x + w, width_);
+    int y1 = std::min(y + h, height_);
+    RGBColor* pixels = buffer_.data();
+    for (int row = y0; row < y1; ++row)
+    {
+      const uint16_t* map = &map_[row * width_ + x0];
+      for (int i = 0; i < x1 - x0; ++i)
+      {
+        pixels[map[i]] = color;
+      }
+    }
+  }
+
+  // Copy a w by h sprite, stored row major, to (x, y), clipped to the
+  // matrix. Sprite pixels equal to `*transparent` are skipped if given.
+  void blit(const RGBColor* sprite, int w, int h, int x, int y, const RGBColor* transparent = nullptr)
+  {
+    int x0 = std::max(x, 0);
+    int y0 = std::max(y, 0);
+    int x1 = std::min(x + w, width_);
+    int y1 = std::min(y + h, height_);
+    RGBColor* pixels = buffer_.data();
+    for (int row = y0; row < y1; ++row)
+    {
+      const uint16_t* map = &map_[row * width_ + x0];
+      const RGBColor* src = &sprite[(row - y) * w + (x0 - x)];
+      if (transparent)
+      {
+        for (int i = 0; i < x1 - x0; ++i)
+        {
+          const RGBColor& c = src[i];
+          if (c.R != transparent->R || c.G != transparent->G || c.B != transparent->B)
+          {
+            pixels[map[i]] = c;
+          }
+        }
+      }
+      else
+      {
+        for (int i = 0; i < x1 - x0; ++i)
+        {
+          pixels[map[i]] = src[i];
+        }
+      }
+    }
+  }
+
+  // A sprite w pixels wide, its height taken from the buffer size. The size
+  // should be a multiple of w; a partial last row is not drawn.
+  void blit(const LEDBuffer& sprite, int w, int x, int y, const RGBColor* transparent = nullptr)
+  {
+    if (w <= 0) return;
+    blit(sprite.data(), w, (int)(sprite.size() / w), x, y, transparent);
+  }
+
+  // Move the image by (dx, dy) pixels, filling the uncovered area with
+  // `fill`. Works in place, walking away from the direction of travel so
+  // every pixel is read before it is overwritten.
+  void scroll(int dx, int dy, const RGBColor& fill = {})
+  {
+    if (dx >= width_ || -dx >= width_ || dy >= height_ || -dy >= height_)
+    {
+      this->fill(fill);
+      return;
+    }
+
+    RGBColor* pixels = buffer_.data();
+    int w = width_ - std::abs(dx);
+    int h = height_ - std::abs(dy);
+    for (int j = 0; j < h; ++j)
+    {
+      int row = dy > 0 ? height_ - 1 - j : j;
+      const uint16_t* dst = &map_[row * width_];
+      const uint16_t* src = &map_[(row - dy) * width_];
+      if (dx > 0)
+      {
+        for (int col = width_ - 1; col >= dx; --col)
+        {
+          pixels[dst[col]] = pixels[src[col - dx]];
+        }
+      }
+      else
+      {
+        for (int col = 0; col < w; ++col)
+        {
+          pixels[dst[col]] = pixels[src[col - dx]];
+        }
+      }
+    }
+
+    // Uncovered rows, then the uncovered columns of the remaining rows
+    fillRect(0, dy > 0 ? 0 : h, width_, height_ - h, fill);
+    fillRect(dx > 0 ? 0 : w, dy > 0 ? dy : 0, width_ - w, h, fill);
+  }
+
+  LEDBuffer& buffer()
+  {
+    return buffer_;
+  }
+
+private:
+  static size_t wireIndex(const Layout& layout, int x, int y)
+  {
+    int tileX = x / layout.width;
+    int tileY = y / layout.height;
+    x %= layout.width;
+    y %= layout.height;
+
+    if (layout.tileSerpentine && (tileY & 1))
+    {
+      tileX = layout.tilesX - 1 - tileX;
+    }
+    size_t tile = (size_t)(tileY * layout.tilesX + tileX);
+
+    // Position in the panel's wiring, which is width wide unless turned
+    // on its side
+    int wireX = x;
+    int wireY = y;
+    int wireWidth = layout.width;
+    switch (layout.rotation)
+    {
+      case Rotation::Rotate0:
+        break;
+      case Rotation::Rotate90:
+        wireX = y;
+        wireY = layout.width - 1 - x;
+        wireWidth = layout.height;
+        break;
+      case Rotation::Rotate180:
+        wireX = layout.width - 1 - x;
+        wireY = layout.height - 1 - y;
+        break;
+      case Rotation::Rotate270:
+        wireX = layout.height - 1 - y;
+        wireY = x;
+        wireWidth = layout.height;
+        break;
+    }
+
+    if (layout.serpentine && (wireY & 1))
+    {
+      wireX = wireWidth - 1 - wireX;
+    }
+    return tile * (size_t)(layout.width * layout.height) + (size_t)(wireY * wireWidth + wireX);
+  }
+
+  LEDBuffer& buffer_;
+  int width_;
+  int height_;
+  std::vector<uint16_t> map_;
+};
@@ -0,0 +1,124 @@
+#pragma once
+
+#include "Logging.hpp"
+#include "Color.hpp"
+#include "LedCalibration.hpp"
+#include "SPIDevice.hpp"
+
+#include <pico/stdlib.h>
+#include <hardware/spi.h>
+
+#include <algorithm>
+#include <array>
+#include <vector>
+
+// APA102, SK9822, and other clocked LED strips on a hardware SPI port.
+// Unlike the WS2812B these have no fixed bit timing, so the frame rate is
+// set by the SPI clock: at 12MHz a pixel takes under 3us instead of 30us.
+//
+// Each pixel also has a 5 bit brightness that scales the current to its
+// LEDs, independent of the 8 bit color. Frames are packed into a double
+// buffer and sent with DMA, so writes return right away.
+class LedStripApa102
+{
+public:
+  static constexpr uint8_t maxPixelBrightness = 31;
+
+  LedStripApa102(spi_inst_t* spi, uint dataPin, uint clockPin, uint32_t baudRateHz = 12000000) :
+    spi_(spi, SPIDevice::NoPin, dataPin, clockPin, SPIDevice::NoPin, baudRateHz)
+  {
+    DEBUG_LOG("APA102 strip SPI clock " << spi_.baudRate() << "Hz");
+  }
+
+  // Write colors with every pixel at full 5 bit brightness
+  void writeColors(const LEDBuffer& buffer, float brightness = 1.0f)
+  {
+    sendFrame(buffer, nullptr, brightness);
+  }
+
+  // Write colors with a 5 bit brightness (0 to 31) per pixel.
+  // pixelBrightness must be at least as long as buffer.
+  void writeColors(const LEDBuffer& buffer, const std::vector<uint8_t>& pixelBrightness, float brightness = 1.0f)
+  {
+    sendFrame(buffer, pixelBrightness.data(), brightness);
+  }
+
+  // True while a frame is still being clocked out
+  bool busy() const
+  {
+    return spi_.busy();
+  }
+
+  // Block until the last frame has been clocked out
+  void waitForFrame() const
+  {
+    spi_.waitForWrite();
+  }
+
+  // Bytes in a frame of pixelCount pixels: a 4 byte start frame, 4 bytes
+  // per pixel, then an end frame. The end frame is 4 zero bytes for the
+  // SK9822, plus one more clock per 2 pixels because each pixel delays the
+  // data by half a clock.
+  static size_t frameBytes(size_t pixelCount)
+  {
+    return 4 + pixelCount * 4 + 4 + (pixelCount + 15) / 16;
+  }
+
+  // Time to clock out a frame of pixelCount pixels at the actual SPI rate
+  uint64_t frameTimeUs(size_t pixelCount) const
+  {
+    return (uint64_t)frameBytes(pixelCount) * 8 * 1000000 / spi_.baudRate();
+  }
+
+  // The highest rate frames of pixelCount pixels can be shown at
+  float maxFps(size_t pixelCount) const
+  {
+    return 1000000.0f / (float)frameTimeUs(pixelCount);
+  }
+
+  // Pixels per second the strip can take at the actual SPI rate
+  uint32_t pixelsPerSecond() const
+  {
+    return spi_.baudRate() / 32;
+  }
+
+  inline void gamma(float gamma)
+  {
+    calibration_.gamma(gamma);
+  }
+
+  inline void colorBalance(const Vec3f& colorBalance)
+  {
+    calibration_.colorBalance(colorBalance);
+  }
+
+private:
+  void sendFrame(const LEDBuffer& buffer, const uint8_t* pixelBrightness, float brightness)
+  {
+    calibration_.brightness(brightness);
+    calibration_.update();
+
+    // The back buffer is never the one being sent
+    std::vector<uint8_t>& frame = frames_[backFrame_];
+    frame.assign(frameBytes(buffer.size()), 0);
+
+    uint8_t* out = frame.data() + 4;
+    for (size_t i = 0; i < buffer.size(); ++i, out += 4)
+    {
+      RGBColor c = calibration_.apply(buffer[i]);
+      uint8_t level = pixelBrightness ? std::min(pixelBrightness[i], maxPixelBrightness) : maxPixelBrightness;
+      out[0] = 0xE0 | level;
+      out[1] = c.B;
+      out[2] = c.G;
+      out[3] = c.R;
+    }
+
+    spi_.writeAsync(frame.data(), frame.size());
+    backFrame_ ^= 1;
+  }
+
+  SPIDevice spi_;
+  LedCalibration calibration_;
+  std::array<std::vector<uint8_t>, 2> frames_;
+  int backFrame_ = 0;
+};
@@ -2,21 +2,37 @@
 
 #include "Logging.hpp"
 #include "Color.hpp"
+#include "LedCalibration.hpp"
+#include "TrackedLEDBuffer.hpp"
+#include "PowerLimiter.hpp"
 #include "Pio.hpp"
+#include "PioTiming.hpp"
 #include "ws2812b.pio.h"
 
 #include <pico/stdlib.h>
 #include <hardware/pio.h>
 #include <hardware/timer.h>
 
+#include <array>
 #include <memory>
 #include <vector>
 #include <iostream>
 
-using LEDBuffer = std::vector<RGBColor>;
-
 class LedStripWs2812b : PioMachine
 {
+  static constexpr float pioClockHz = Ws2812bTiming::pioClockHz;
+  static constexpr uint32_t cyclesPerBit = Ws2812bTiming::cyclesPerBit;
+
+public:
+  // Time the data line is held low after a frame so the strip latches it
+  static constexpr uint64_t latchTimeUs = Ws2812bTiming::latchTimeUs;
+
+private:
+  static constexpr uint32_t latchLoops = Ws2812bTiming::latchLoops;
+
+  // Command word that tells the PIO program to end the frame and latch it
+  static constexpr uint32_t resetCommand = 0xFFu << 24 | latchLoops;
+
 public:
 
   struct BufferMapping
@@ -25,6 +41,7 @@ public:
     int size;
     int offset;
     int index;
+    bool resetSent;
   };
 
   LedStripWs2812b(uint pin) : PioMachine(&ws2812b_program)
@@ -40,65 +57,293 @@ public:
 
     sm_config_set_in_shift(&config_, false, false, 32);
     sm_config_set_out_shift(&config_, false, false, 32);
+
+    // Colors only go out, so join the FIFOs for 8 words of TX buffering.
+    // writeColorsParallel() keeps several strips fed from one loop, and
+    // this gives it twice as long to come back to each.
+    setBuffering(0, joinedFifoWords);
     
     // Set this pin's GPIO function (connect PIO to the pad)
     pio_gpio_init(pio_, pin);
     // Set the pin direction to input at the PIO
     pio_sm_set_consecutive_pindirs(pio_, sm_, pin, 1, true);
-    sm_config_set_clkdiv(&config_, 5.0f);
+    setClockHz(pioClockHz);
 
     // Load our configuration, and jump to the start of the program
     pio_sm_init(pio_, sm_, offset, &config_);
     // Set the state machine running
     pio_sm_set_enabled(pio_, sm_, true);
+
+    frameEndTime_ = get_absolute_time();
   }
 
+  // Call after changing the system clock to keep the bit timing
+  using PioMachine::retune;
+
   inline void writeColors(const LEDBuffer& buffer, float brightness = 1.0f)
   {
-    RGBColor calibrated;
+    // Don't interleave with a frame that is still streaming
+    waitForFrame();
+
+    // Brightness changes rebuild the calibration tables, nothing else does per frame
+    calibration_.brightness(brightness);
+    calibration_.update();
+    queueFrame(buffer.size());
+    invalidateCache();
+
     uint32_t data = 0;
-    // Send the colors
-    for (int i=0; i < buffer.size(); ++i)
+    if (powerLimiter_)
     {
-      // Format the color for I/O
-      calibrated = buffer[i] * colorBalance_ * brightness;
-      calibrated.applyGamma(gamma_);
-      data = (uint32_t)calibrated.G << 16 | (uint32_t)calibrated.R << 8 | (uint32_t)calibrated.B;
-      pio_sm_put_blocking(pio_, sm_, data);
+      // The whole frame has to be summed before the first pixel goes out
+      std::vector<uint32_t>& frame = frames_[backFrame_];
+      frame.resize(buffer.size() + 1);
+      for (size_t i = 0; i < buffer.size(); ++i)
+      {
+        frame[i] = calibration_.packGRB(buffer[i]);
+      }
+      limitFrame(frame, buffer.size());
+      for (size_t i = 0; i < buffer.size(); ++i)
+      {
+        pio_sm_put_blocking(pio_, sm_, frame[i]);
+      }
     }
-    // Send a reset when done
-    data = 0xFF << 24;
+    else
+    {
+      // Send the colors
+      for (int i=0; i < buffer.size(); ++i)
+      {
+        data = calibration_.packGRB(buffer[i]);
+        pio_sm_put_blocking(pio_, sm_, data);
+      }
+    }
+    // Send a reset when done. The PIO holds the line low for the
+    // latch time, so the next frame can be queued right away.
+    data = resetCommand;
     pio_sm_put_blocking(pio_, sm_, data);
+  }
+
+  // Pack the buffer into a frame of PIO words and stream it to the strip
+  // with DMA, returning as soon as the transfer has started. Frames are
+  // double buffered: the LEDBuffer can be changed and the next frame
+  // written while this one streams. If the previous frame is still
+  // streaming when the next one is packed, this waits for it to finish.
+  // Falls back to blocking writes if no DMA channel is available.
+  void writeColorsAsync(const LEDBuffer& buffer, float brightness = 1.0f)
+  {
+    calibration_.brightness(brightness);
+    calibration_.update();
+
+    // The back buffer is never the one being streamed
+    std::vector<uint32_t>& frame = frames_[backFrame_];
+    frame.resize(buffer.size() + 1);
+    for (size_t i = 0; i < buffer.size(); ++i)
+    {
+      frame[i] = calibration_.packGRB(buffer[i]);
+    }
+
+    invalidateCache();
+    limitFrame(frame, buffer.size());
+    sendBackFrame();
+  }
+
+  // Write a TrackedLEDBuffer, skipping the frame entirely when neither the
+  // buffer nor the calibration changed since the last one. Packed colors
+  // are cached, so only the buffer's dirty range is repacked. Clears the
+  // buffer's dirty range. Uses DMA like writeColorsAsync() when a channel
+  // is available. Returns true if a frame was sent.
+  bool writeColors(TrackedLEDBuffer& buffer, float brightness = 1.0f)
+  {
+    calibration_.brightness(brightness);
+    calibration_.update();
+
+    size_t begin = buffer.dirtyBegin();
+    size_t end = buffer.dirtyEnd();
+    // The dirty range only covers the changes since the cache was packed if
+    // this buffer was the last one packed, and nothing else cleared it since
+    if (packedCache_.size() != buffer.size() || calibration_.generation() != cachedCalibration_ ||
+        &buffer != cachedSource_ || buffer.cleanGeneration() != cachedSourceGeneration_)
+    {
+      // Everything has to be repacked
+      packedCache_.assign(buffer.size(), 0);
+      cachedCalibration_ = calibration_.generation();
+      clearSums();
+      begin = 0;
+      end = buffer.size();
+    }
+
+    // Channel sums for the power limiter follow the cache: the old packed
+    // words of the dirty pixels come out, the new ones go in
+    for (size_t i = begin; i < end; ++i)
+    {
+      subtractSums(packedCache_[i]);
+      packedCache_[i] = calibration_.packGRB(buffer[i]);
+      addSums(packedCache_[i]);
+    }
+    buffer.clearDirty();
+    cachedSource_ = &buffer;
+    cachedSourceGeneration_ = buffer.cleanGeneration();
+
+    // A frame is still needed if another strip on the same limiter changed
+    // the scale this one is shown at
+    uint16_t scale = powerLimiter_ ? updatePowerLimit(buffer.size()) : PowerLimiter::fullScale;
+    if (begin >= end && scale == sentScale_)
+    {
+      ++framesSkipped_;
+      return false;
+    }
+    sentScale_ = scale;
+
+    std::vector<uint32_t>& frame = frames_[backFrame_];
+    frame.resize(packedCache_.size() + 1);
+    if (scale < PowerLimiter::fullScale)
+    {
+      for (size_t i = 0; i < packedCache_.size(); ++i)
+      {
+        frame[i] = scalePacked(packedCache_[i], scale);
+      }
+    }
+    else
+    {
+      std::copy(packedCache_.begin(), packedCache_.end(), frame.begin());
+    }
+    sendBackFrame();
+    return true;
+  }
+
+  // Share a current budget with other strips. Frames written with
+  // writeColors(TrackedLEDBuffer&) keep the strip's current estimate up to
+  // date from the changed pixels only. Every other write method recounts
+  // the whole frame, at the cost of one more pass over it. Either way,
+  // frames are scaled down to fit the budget before they go out. A strip
+  // picks up a scale changed by another strip on its next write.
+  void powerLimiter(PowerLimiter* limiter)
+  {
+    powerLimiter_ = limiter;
+    powerOutput_ = limiter ? limiter->addOutput() : -1;
+  }
+
+  // Frames sent to the strip by any of the write methods
+  uint32_t framesSent() const
+  {
+    return framesSent_;
+  }
+
+  // Frames skipped by writeColors(TrackedLEDBuffer&) because nothing changed
+  uint32_t framesSkipped() const
+  {
+    return framesSkipped_;
+  }
+
+  // Write 16 bit colors with temporal dithering. Each channel is calibrated
+  // to an 8.8 fixed point code, and the fraction the strip can't show is
+  // carried over to the next frame, so fades and low brightness levels
+  // don't step. The extra depth only shows when frames are written
+  // continuously, ideally at or near maxFps(). Uses DMA like
+  // writeColorsAsync() when a channel is available.
+  //
+  // Memory: 3 bytes of dither state per pixel, plus 1.5KB of tables in the
+  // calibration, allocated on first use.
+  void writeColorsDithered(const LEDBuffer16& buffer, float brightness = 1.0f)
+  {
+    calibration_.brightness(brightness);
+    calibration_.update16();
+
+    // Dither state starts from zero when the strip length changes
+    if (ditherError_.size() != buffer.size() * 3)
+    {
+      ditherError_.assign(buffer.size() * 3, 0);
+    }
+
+    std::vector<uint32_t>& frame = frames_[backFrame_];
+    frame.resize(buffer.size() + 1);
+    uint8_t* error = ditherError_.data();
+    for (size_t i = 0; i < buffer.size(); ++i, error += 3)
+    {
+      frame[i] = calibration_.packGRBDithered(buffer[i], error);
+    }
+    invalidateCache();
+    limitFrame(frame, buffer.size());
+    sendBackFrame();
+  }
+
+  // True while a frame from writeColorsAsync() is streaming
+  bool busy() const
+  {
+    return writeBusy();
+  }
+
+  // Block until the frame from writeColorsAsync() has been handed to the PIO
+  void waitForFrame() const
+  {
+    waitForWrite();
+  }
+
+  // Time to send a frame of pixelCount pixels and latch it
+  static uint64_t frameTimeUs(size_t pixelCount)
+  {
+    return (uint64_t)((float)(pixelCount * 24 * cyclesPerBit) * 1000000.0f / pioClockHz) + latchTimeUs;
+  }
 
-    // There is a minimum time to wait here before sending again...
-    // TBI
+  // The highest rate frames of pixelCount pixels can be shown at
+  static float maxFps(size_t pixelCount)
+  {
+    return 1000000.0f / (float)frameTimeUs(pixelCount);
+  }
+
+  // When the last frame written will have been sent and latched. A frame
+  // written before this is queued behind it, so animation loops can
+  // render ahead and write frames back to back at the highest safe rate.
+  absolute_time_t nextFrameTime() const
+  {
+    return frameEndTime_;
   }
 
   static inline void writeColorsParallel(const LEDBuffer& buffer, std::vector<BufferMapping>& mappings, float brightness = 1.0f)
   {
+    // Each strip's frame is packed, and limited, before any goes out, so
+    // the loop below only has to keep the FIFOs fed
     for (BufferMapping& m : mappings)
     {
       m.index = 0;
+      m.resetSent = false;
+      LedStripWs2812b& strip = *m.output;
+      strip.waitForFrame();
+      strip.calibration_.brightness(brightness);
+      strip.calibration_.update();
+      strip.queueFrame(m.size);
+      strip.invalidateCache();
+
+      std::vector<uint32_t>& frame = strip.frames_[strip.backFrame_];
+      frame.resize(m.size + 1);
+      for (int i = 0; i < m.size; ++i)
+      {
+        int bufferIndex = std::clamp(i + m.offset, 0, (int)buffer.size()-1);
+        frame[i] = strip.calibration_.packGRB(buffer[bufferIndex]);
+      }
+      strip.limitFrame(frame, m.size);
     }
 
     while (true)
     {
       for (BufferMapping& m : mappings)
       {
+        const std::vector<uint32_t>& frame = m.output->frames_[m.output->backFrame_];
         while (m.index < m.size && !pio_sm_is_tx_fifo_full(m.output->pio_, m.output->sm_))
         {
-          int bufferIndex = std::clamp((m.index++) + m.offset, 0, (int)buffer.size()-1);
-          RGBColor calibrated = buffer[bufferIndex] * m.output->colorBalance_ * brightness;
-          calibrated.applyGamma(m.output->gamma_);
-          uint32_t data = calibrated.G << 16 | calibrated.R << 8 | calibrated.B;
-          pio_sm_put(m.output->pio_, m.output->sm_, data);
+          pio_sm_put(m.output->pio_, m.output->sm_, frame[m.index++]);
+        }
+
+        if (m.index == m.size && !m.resetSent && !pio_sm_is_tx_fifo_full(m.output->pio_, m.output->sm_))
+        {
+          pio_sm_put(m.output->pio_, m.output->sm_, resetCommand);
+          m.resetSent = true;
         }
       }
 
       int doneCount = 0;
       for (BufferMapping& m : mappings)
       {
-        if (m.index == m.size) ++doneCount;
+        if (m.resetSent) ++doneCount;
       }
       if (doneCount == mappings.size())
       {
@@ -109,15 +354,124 @@ public:
 
   inline void gamma(float gamma)
   {
-    gamma_ = gamma;
+    calibration_.gamma(gamma);
   }
 
   inline void colorBalance(const Vec3f& colorBalance)
   {
-    colorBalance_ = colorBalance;
+    calibration_.colorBalance(colorBalance);
   }
 
 private:
-  Vec3f colorBalance_ {1.0f, 1.0f, 1.0f};
-  float gamma_ {1.0f};
+  // Frames queue in the PIO behind the previous one, so a frame starts when
+  // the last one has latched or now, whichever is later
+  void queueFrame(size_t pixelCount)
+  {
+    absolute_time_t now = get_absolute_time();
+    absolute_time_t start = absolute_time_diff_us(now, frameEndTime_) > 0 ? frameEndTime_ : now;
+    frameEndTime_ = delayed_by_us(start, frameTimeUs(pixelCount));
+    ++framesSent_;
+  }
+
+  // Per channel sums of the packed output codes, for the power limiter
+  void clearSums()
+  {
+    sumR_ = sumG_ = sumB_ = 0;
+  }
+
+  void addSums(uint32_t packed)
+  {
+    sumG_ += (packed >> 16) & 0xFF;
+    sumR_ += (packed >> 8) & 0xFF;
+    sumB_ += packed & 0xFF;
+  }
+
+  void subtractSums(uint32_t packed)
+  {
+    sumG_ -= (packed >> 16) & 0xFF;
+    sumR_ -= (packed >> 8) & 0xFF;
+    sumB_ -= packed & 0xFF;
+  }
+
+  uint16_t updatePowerLimit(size_t pixelCount)
+  {
+    return powerLimiter_->update(powerOutput_, sumR_, sumG_, sumB_, pixelCount);
+  }
+
+  // Sum a whole packed frame for the power limiter and scale it to fit the
+  // budget. Nothing to do without a limiter.
+  void limitFrame(std::vector<uint32_t>& frame, size_t pixelCount)
+  {
+    if (!powerLimiter_) return;
+    clearSums();
+    for (size_t i = 0; i < pixelCount; ++i)
+    {
+      addSums(frame[i]);
+    }
+    uint16_t scale = updatePowerLimit(pixelCount);
+    if (scale < PowerLimiter::fullScale)
+    {
+      for (size_t i = 0; i < pixelCount; ++i)
+      {
+        frame[i] = scalePacked(frame[i], scale);
+      }
+    }
+  }
+
+  // A frame that didn't come from the packed cache went out, and the sums
+  // no longer follow the cache, so the next tracked write repacks and
+  // resends everything
+  void invalidateCache()
+  {
+    packedCache_.clear();
+  }
+
+  // Scale the three codes of a packed word by a Q8 factor of at most 256.
+  // G and B are scaled together, 16 bits apart so they can't overlap.
+  static inline uint32_t scalePacked(uint32_t packed, uint16_t scale)
+  {
+    uint32_t gb = ((packed & 0xFF00FF) * scale >> 8) & 0xFF00FF;
+    uint32_t r = ((packed & 0x00FF00) * scale >> 8) & 0x00FF00;
+    return gb | r;
+  }
+
+  // Send the packed back frame, with DMA when a channel is available
+  void sendBackFrame()
+  {
+    std::vector<uint32_t>& frame = frames_[backFrame_];
+    frame.back() = resetCommand;
+
+    waitForFrame();
+    queueFrame(frame.size() - 1);
+    if (writeAsync(frame.data(), frame.size()))
+    {
+      backFrame_ ^= 1;
+    }
+    else
+    {
+      for (uint32_t data : frame)
+      {
+        pio_sm_put_blocking(pio_, sm_, data);
+      }
+    }
+  }
+
+  LedCalibration calibration_;
+  std::array<std::vector<uint32_t>, 2> frames_;
+  std::vector<uint8_t> ditherError_;
+  std::vector<uint32_t> packedCache_;
+  uint32_t cachedCalibration_ = 0;
+  // The buffer packedCache_ was packed from, and its generation then
+  const TrackedLEDBuffer* cachedSource_ = nullptr;
+  uint32_t cachedSourceGeneration_ = 0;
+  uint32_t framesSent_ = 0;
+  uint32_t framesSkipped_ = 0;
+  PowerLimiter* powerLimiter_ = nullptr;
+  int powerOutput_ = -1;
+  uint32_t sumR_ = 0;
+  uint32_t sumG_ = 0;
+  uint32_t sumB_ = 0;
+  uint16_t sentScale_ = PowerLimiter::fullScale;
+  int backFrame_ = 0;
+  absolute_time_t frameEndTime_;
 };
\ No newline at end of file
@@ -0,0 +1,206 @@
+#pragma once
+
+#include "Logging.hpp"
+#include "Color.hpp"
+#include "LedCalibration.hpp"
+#include "LedStripWs2812b.hpp"
+#include "Pio.hpp"
+#include "ws2812b_parallel.pio.h"
+
+#include <pico/stdlib.h>
+#include <hardware/pio.h>
+
+#include <algorithm>
+#include <array>
+#include <vector>
+
+// Drive up to 8 WS2812B strips on consecutive GPIOs from one state machine.
+// Every lane shifts out at the same time, so a frame takes as long as the
+// longest lane instead of the sum of all of them, and the other state
+// machines stay free for other PIO programs.
+//
+// Each lane reads its pixels from a section of one shared LEDBuffer,
+// described by a LaneMapping (like LedStripWs2812b::BufferMapping).
+// All lanes share one gamma and color balance.
+class LedStripWs2812bParallel : PioMachine
+{
+  // PIO clock, divided down from whatever the system clock is, and cycles
+  // per bit and per latch loop iteration in ws2812b_parallel.pio
+  static constexpr float pioClockHz = 8000000.0f;
+  static constexpr uint32_t cyclesPerBit = 10;
+  static constexpr uint32_t cyclesPerLatchLoop = 32;
+  static constexpr uint32_t latchLoops = (uint32_t)((float)LedStripWs2812b::latchTimeUs * pioClockHz / 1000000.0f / (float)cyclesPerLatchLoop) + 1;
+
+public:
+  static constexpr uint maxLanes = 8;
+
+  struct LaneMapping
+  {
+    int size;
+    int offset;
+  };
+
+  LedStripWs2812bParallel(uint basePin, uint laneCount) 
+    : PioMachine(&ws2812b_parallel_program)
+    , laneCount_{std::min(laneCount, maxLanes)}
+  {
+    uint offset = prog_->offset();
+    config_ = ws2812b_parallel_program_get_default_config(offset);
+
+    // Map the OUT group to the lanes
+    sm_config_set_out_pins(&config_, basePin, laneCount_);
+
+    // Autopull 4 bit planes per word, least significant byte first
+    sm_config_set_out_shift(&config_, true, true, 32);
+
+    // We only ever send data, so join the FIFOs for 8 words of TX buffering
+    setBuffering(0, joinedFifoWords);
+
+    // Set the lane pins' GPIO function (connect PIO to the pads)
+    for (uint i = 0; i < laneCount_; ++i)
+    {
+      pio_gpio_init(pio_, basePin + i);
+    }
+    pio_sm_set_consecutive_pindirs(pio_, sm_, basePin, laneCount_, true);
+
+    // 8 MHz PIO clock, 10 cycles per bit
+    setClockHz(pioClockHz);
+
+    // Load our configuration, and jump to the start of the program
+    pio_sm_init(pio_, sm_, offset, &config_);
+
+    // Park the latch time in ISR, then empty OSR so the first
+    // autopull fetches a frame header
+    pio_sm_put_blocking(pio_, sm_, latchLoops);
+    pio_sm_exec(pio_, sm_, pio_encode_pull(false, true));
+    pio_sm_exec(pio_, sm_, pio_encode_mov(pio_isr, pio_osr));
+    pio_sm_exec(pio_, sm_, pio_encode_out(pio_null, 32));
+
+    // Set the state machine running
+    pio_sm_set_enabled(pio_, sm_, true);
+
+    frameEndTime_ = get_absolute_time();
+  }
+
+  // Keeps the 8MHz PIO clock across system clock changes
+  using PioMachine::retune;
+
+  // Send one frame to all lanes. Lane n takes lanes[n].size pixels from
+  // buffer starting at lanes[n].offset. Lanes shorter than the longest one
+  // are padded with black, which just shifts off the end of those strips.
+  void writeColors(const LEDBuffer& buffer, const std::vector<LaneMapping>& lanes, float brightness = 1.0f)
+  {
+    if (buffer.empty()) return;
+
+    calibration_.brightness(brightness);
+    calibration_.update();
+
+    uint usedLanes = std::min((uint)lanes.size(), laneCount_);
+    int rows = 0;
+    for (uint l = 0; l < usedLanes; ++l)
+    {
+      rows = std::max(rows, lanes[l].size);
+    }
+
+    if (rows == 0) return;
+    queueFrame(rows);
+
+    // Frame header: the number of bit planes, minus one
+    pio_sm_put_blocking(pio_, sm_, (uint32_t)rows * 24 - 1);
+
+    std::array<uint32_t, maxLanes> grb {};
+    std::array<uint32_t, 6> words;
+    for (int row = 0; row < rows; ++row)
+    {
+      for (uint l = 0; l < usedLanes; ++l)
+      {
+        const LaneMapping& m = lanes[l];
+        if (row < m.size)
+        {
+          int bufferIndex = std::clamp(row + m.offset, 0, (int)buffer.size()-1);
+          grb[l] = calibration_.packGRB(buffer[bufferIndex]);
+        }
+        else
+        {
+          grb[l] = 0;
+        }
+      }
+
+      transposeRow(grb, words);
+      for (uint32_t word : words)
+      {
+        pio_sm_put_blocking(pio_, sm_, word);
+      }
+    }
+  }
+
+  // Time to send a frame whose longest lane has pixelCount pixels and latch it
+  static uint64_t frameTimeUs(size_t pixelCount)
+  {
+    return (uint64_t)((float)(pixelCount * 24 * cyclesPerBit) * 1000000.0f / pioClockHz) + LedStripWs2812b::latchTimeUs;
+  }
+
+  // The highest rate frames can be shown at when the longest lane has pixelCount pixels
+  static float maxFps(size_t pixelCount)
+  {
+    return 1000000.0f / (float)frameTimeUs(pixelCount);
+  }
+
+  // When the last frame written will have been sent and latched
+  absolute_time_t nextFrameTime() const
+  {
+    return frameEndTime_;
+  }
+
+  inline void gamma(float gamma)
+  {
+    calibration_.gamma(gamma);
+  }
+
+  inline void colorBalance(const Vec3f& colorBalance)
+  {
+    calibration_.colorBalance(colorBalance);
+  }
+
+  // Turn one GRB word per lane into the 24 bit planes the PIO program
+  // shifts out, most significant bit first, packed 4 planes per word.
+  static inline void transposeRow(const std::array<uint32_t, maxLanes>& grb, std::array<uint32_t, 6>& words)
+  {
+    for (int channel = 0; channel < 3; ++channel)
+    {
+      // Gather this channel's byte from every lane: lane n in byte n
+      int shift = 16 - channel * 8;
+      uint64_t x = 0;
+      for (uint l = 0; l < maxLanes; ++l)
+      {
+        x |= (uint64_t)((grb[l] >> shift) & 0xFF) << (l * 8);
+      }
+
+      // Transpose the 8x8 bit matrix so byte n holds bit n of every lane
+      // (Hacker's Delight, transpose8)
+      uint64_t t;
+      t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAull;
+      x = x ^ t ^ (t << 7);
+      t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCull;
+      x = x ^ t ^ (t << 14);
+      t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ull;
+      x = x ^ t ^ (t << 28);
+
+      // The PIO reads the low byte first, and bit 7 goes out first
+      words[channel * 2 + 0] = __builtin_bswap32((uint32_t)(x >> 32));
+      words[channel * 2 + 1] = __builtin_bswap32((uint32_t)x);
+    }
+  }
+
+private:
+  void queueFrame(size_t pixelCount)
+  {
+    absolute_time_t now = get_absolute_time();
+    absolute_time_t start = absolute_time_diff_us(now, frameEndTime_) > 0 ? frameEndTime_ : now;
+    frameEndTime_ = delayed_by_us(start, frameTimeUs(pixelCount));
+  }
+
+  uint laneCount_;
+  LedCalibration calibration_;
+  absolute_time_t frameEndTime_;
+};
@@ -60,6 +60,52 @@ inline OutT remap(InT val, InT inA, InT inB, OutT outA, OutT outB)
   }
 }
 
+// Compile time versions of log, exp, and pow, for building lookup tables
+// as constexpr data (which lives in flash) instead of at boot. They are
+// accurate to about 1e-12, they are slow, and are not meant for runtime use.
+constexpr double constexprLog(double x)
+{
+  // x = m * 2^k with m in [0.5, 1), then ln(m) = 2 * atanh((m - 1) / (m + 1))
+  constexpr double ln2 = 0.69314718055994530942;
+  int k = 0;
+  while (x >= 1.0) { x *= 0.5; ++k; }
+  while (x < 0.5) { x *= 2.0; --k; }
+  double z = (x - 1.0) / (x + 1.0);
+  double z2 = z * z;
+  double term = z;
+  double sum = 0.0;
+  for (int n = 1; n < 60; n += 2)
+  {
+    sum += term / n;
+    term *= z2;
+  }
+  return 2.0 * sum + k * ln2;
+}
+
+constexpr double constexprExp(double x)
+{
+  // x = k * ln2 + r with |r| <= ln2 / 2, then e^x = 2^k * e^r
+  constexpr double ln2 = 0.69314718055994530942;
+  int k = (int)(x / ln2 + (x < 0.0 ? -0.5 : 0.5));
+  double r = x - k * ln2;
+  double term = 1.0;
+  double sum = 1.0;
+  for (int n = 1; n < 30; ++n)
+  {
+    term *= r / n;
+    sum += term;
+  }
+  while (k > 0) { sum *= 2.0; --k; }
+  while (k < 0) { sum *= 0.5; ++k; }
+  return sum;
+}
+
+// x^y for x >= 0
+constexpr double constexprPow(double x, double y)
+{
+  return (x <= 0.0) ? 0.0 : constexprExp(y * constexprLog(x));
+}
+
 template <typename T>
 static T remapClamp(T value, T inMin, T inMax, T outMin, T outMax)
 {
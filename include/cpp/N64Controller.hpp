@@ -43,13 +43,13 @@ namespace N64Buttons
 }
 
 
-struct N64ControllerInfo : public PioBuffer
+struct N64ControllerInfo final : public PioBufferPacker<N64ControllerInfo>
 {
   uint8_t header1 = 0x05;
   uint8_t header2 = 0x00;
   N64Status::Flag status = N64Status::None;
 
-  N64ControllerInfo() : PioBuffer(3) {}
+  N64ControllerInfo() : PioBufferPacker(3) {}
 
   bool getStatusFlag(N64Status::Flag flag) const
   {
@@ -68,23 +68,20 @@ struct N64ControllerInfo : public PioBuffer
     }
   }
 
-  virtual void pack(uint32_t& dst, size_t i) const override
+  uint32_t packWord(size_t i) const
   {
     switch (i)
     {
       case 0:
-        dst = (uint32_t)header1 << 24;
-        break;
+        return (uint32_t)header1 << 24;
       case 1:
-        dst = (uint32_t)header2 << 24;
-        break;
-      case 2:
-        dst = (uint32_t)status << 24;
-        break;
+        return (uint32_t)header2 << 24;
+      default:
+        return (uint32_t)status << 24;
     }
   }
 
-  virtual void unpack(const uint32_t& src, size_t i) override
+  void unpackWord(uint32_t src, size_t i)
   {
     switch (i)
     {
@@ -99,15 +96,29 @@ struct N64ControllerInfo : public PioBuffer
         break;
     }
   }
+
+  void packAll(uint32_t* dst) const
+  {
+    dst[0] = (uint32_t)header1 << 24;
+    dst[1] = (uint32_t)header2 << 24;
+    dst[2] = (uint32_t)status << 24;
+  }
+
+  void unpackAll(const uint32_t* src)
+  {
+    header1 = (uint8_t)src[0];
+    header2 = (uint8_t)src[1];
+    status = (N64Status::Flag)src[2];
+  }
 };
 
-struct N64ControllerButtonState : public PioBuffer
+struct N64ControllerButtonState final : public PioBufferPacker<N64ControllerButtonState>
 {
   N64Buttons::Flag buttons = N64Buttons::None;
   int8_t xAxis = 0;
   int8_t yAxis = 0;
 
-  N64ControllerButtonState() : PioBuffer(4) {}
+  N64ControllerButtonState() : PioBufferPacker(4) {}
 
   Vec2f getStick()
   {
@@ -138,28 +149,22 @@ struct N64ControllerButtonState : public PioBuffer
   }
 
   // Implementation for PioMachine to use this as as a PioBuffer
-
-
-  virtual void pack(uint32_t& dst, size_t i) const override
+  uint32_t packWord(size_t i) const
   {
     switch (i)
     {
       case 0:
-        dst = (uint32_t)buttons << 16;
-        break;
+        return (uint32_t)buttons << 16;
       case 1:
-        dst = (uint32_t)buttons << 24;
-        break;
+        return (uint32_t)buttons << 24;
       case 2:
-        dst = (uint32_t)xAxis << 24;
-        break;
-      case 3:
-        dst = (uint32_t)yAxis << 24;
-        break;
+        return (uint32_t)xAxis << 24;
+      default:
+        return (uint32_t)yAxis << 24;
     }
   }
 
-  virtual void unpack(const uint32_t& src, size_t i) override
+  void unpackWord(uint32_t src, size_t i)
   {
     switch (i)
     {
@@ -177,6 +182,21 @@ struct N64ControllerButtonState : public PioBuffer
         break;
     }
   }
+
+  void packAll(uint32_t* dst) const
+  {
+    dst[0] = (uint32_t)buttons << 16;
+    dst[1] = (uint32_t)buttons << 24;
+    dst[2] = (uint32_t)xAxis << 24;
+    dst[3] = (uint32_t)yAxis << 24;
+  }
+
+  void unpackAll(const uint32_t* src)
+  {
+    buttons = (N64Buttons::Flag)(((src[0] << 8) & 0xFF00) | (src[1] & 0x00FF));
+    xAxis = (int8_t)src[2];
+    yAxis = (int8_t)src[3];
+  }
 };
 
 // Connect an N64 controller to a Pi Pico and read button
@@ -199,6 +219,9 @@ public:
     , rumblePakReady{false}
   { }
 
+  // Keeps the Joybus bit timing after a system clock change
+  using JoybusHost::retune;
+
   // Update the state of the sticks, buttons, and accessories 
   void update()
   {
@@ -373,6 +396,9 @@ public:
     : JoybusClient(pin)
   { }
 
+  // Keeps the Joybus bit timing after a system clock change
+  using JoybusClient::retune;
+
 protected:
   virtual PioBuffer* onRecieveCommand(JoybusCommand cmd)
   {
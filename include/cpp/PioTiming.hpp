@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+
+// The rates and cycle counts the PIO drivers run their programs with. This
+// header doesn't touch the SDK, so tools/pio_emulator checks the programs
+// with the same numbers the drivers use.
+
+// LedStripWs2812b
+namespace Ws2812bTiming
+{
+  // PIO clock, divided down from whatever the system clock is, and cycles
+  // per bit and per reset loop iteration in ws2812b.pio
+  constexpr float pioClockHz = 25000000.0f;
+  constexpr uint32_t cyclesPerBit = 31;
+  constexpr uint32_t cyclesPerLatchLoop = 32;
+
+  // Time the data line is held low after a frame so the strip latches it.
+  // The WS2812B datasheet asks for more than 280us.
+  constexpr uint64_t latchTimeUs = 300;
+
+  // Reset loop iterations that cover latchTimeUs
+  constexpr uint32_t latchLoops = (uint32_t)((float)latchTimeUs * pioClockHz / 1000000.0f / (float)cyclesPerLatchLoop) + 1;
+}
+
+// JoybusHost and JoybusClient
+namespace JoybusTiming
+{
+  // Both programs are timed for an 8MHz PIO clock, 32 cycles to a 4us bit
+  constexpr float pioClockHz = 8000000.0f;
+}
+
+// PulseCounter
+namespace PulseCounterTiming
+{
+  // The program runs at the system clock and takes 2 cycles per count of
+  // its sample timer
+  constexpr uint32_t cyclesPerDecrement = 2;
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// Keeps the estimated current of one or more LED strips under a supply
+// budget. Strips report the sum of their output codes per channel each
+// frame, and the limiter answers with one scale factor for all of them.
+// The scale is applied to the packed output, after gamma, where it is
+// linear in current.
+//
+// The estimate is the usual one for WS2812B-style LEDs: each channel draws
+// its full current at code 255 and proportionally less below it, plus a
+// fixed idle current per pixel for the driver chip.
+class PowerLimiter
+{
+public:
+  // Scale factor that leaves output unchanged, Q8 (256 = 1.0)
+  static constexpr uint16_t fullScale = 256;
+
+  PowerLimiter(float budgetMa) :
+    budgetMa_(budgetMa)
+  {
+  }
+
+  void budgetMa(float budgetMa)
+  {
+    budgetMa_ = budgetMa;
+    recompute();
+  }
+
+  float budgetMa() const
+  {
+    return budgetMa_;
+  }
+
+  // Current drawn by each channel of one pixel at full brightness
+  void channelCurrent(float redMa, float greenMa, float blueMa)
+  {
+    redMa_ = redMa;
+    greenMa_ = greenMa;
+    blueMa_ = blueMa;
+  }
+
+  // Current drawn by each pixel when it is off
+  void idleCurrent(float idleMa)
+  {
+    pixelIdleMa_ = idleMa;
+  }
+
+  // Register a strip, returning the id it reports its draw with
+  int addOutput()
+  {
+    outputs_.push_back({});
+    return (int)outputs_.size() - 1;
+  }
+
+  // Report an output's frame as the sum of its output codes per channel,
+  // and get back the scale to apply to it, Q8
+  uint16_t update(int output, uint32_t sumR, uint32_t sumG, uint32_t sumB, size_t pixelCount)
+  {
+    Output& o = outputs_[output];
+    o.ledMa = ((float)sumR * redMa_ + (float)sumG * greenMa_ + (float)sumB * blueMa_) / 255.0f;
+    o.idleMa = (float)pixelCount * pixelIdleMa_;
+    recompute();
+    return scale_;
+  }
+
+  // The scale applied to every output, Q8 (256 = 1.0)
+  uint16_t scale() const
+  {
+    return scale_;
+  }
+
+  // Estimated current of all outputs before limiting
+  float requestedMa() const
+  {
+    return totalLedMa_ + totalIdleMa_;
+  }
+
+  // Estimated current of all outputs after limiting
+  float limitedMa() const
+  {
+    return totalLedMa_ * (float)scale_ / (float)fullScale + totalIdleMa_;
+  }
+
+  // Estimated current of one output before limiting
+  float requestedMa(int output) const
+  {
+    return outputs_[output].ledMa + outputs_[output].idleMa;
+  }
+
+  bool limiting() const
+  {
+    return scale_ < fullScale;
+  }
+
+private:
+  struct Output
+  {
+    float ledMa = 0.0f;
+    float idleMa = 0.0f;
+  };
+
+  void recompute()
+  {
+    totalLedMa_ = 0.0f;
+    totalIdleMa_ = 0.0f;
+    for (const Output& o : outputs_)
+    {
+      totalLedMa_ += o.ledMa;
+      totalIdleMa_ += o.idleMa;
+    }
+
+    // Only the LED part of the current scales, the idle current is fixed.
+    // Round down so the limited estimate never exceeds the budget.
+    float available = std::max(budgetMa_ - totalIdleMa_, 0.0f);
+    if (totalLedMa_ <= available)
+    {
+      scale_ = fullScale;
+    }
+    else
+    {
+      scale_ = (uint16_t)(available / totalLedMa_ * (float)fullScale);
+    }
+  }
+
+  float budgetMa_;
+  float redMa_ = 20.0f;
+  float greenMa_ = 20.0f;
+  float blueMa_ = 20.0f;
+  float pixelIdleMa_ = 1.0f;
+  std::vector<Output> outputs_;
+  float totalLedMa_ = 0.0f;
+  float totalIdleMa_ = 0.0f;
+  uint16_t scale_ = fullScale;
+};
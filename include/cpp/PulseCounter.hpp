@@ -2,22 +2,25 @@
 
 #include "pulse_counter.pio.h"
 #include "Pio.hpp"
+#include "PioTiming.hpp"
 #include "Logging.hpp"
 
+#include <hardware/clocks.h>
+
 #include <limits>
 #include <algorithm>
 
 // PulseCounter takes in a pin to listen on and a sample interval.
 // It reports out how many pulses it has seen since on the pin since last update
-// Up to 8 observations can be enqueued, at which point it stalls
+// Observations queue in the RX FIFO, joined to 8 words deep, and past that in
+// a software ring if queueDepth asks for more. When the queue is full it stalls.
 // Pulses shorter than 5us (~200 kHz) may not be counted correctly
 class PulseCounter : private PioMachine
 {
-  static constexpr uint64_t clockFreqHz = 125000000;
-  static constexpr uint64_t nsPerPioDecrement = 1000000000 / clockFreqHz * 2;
+  static constexpr uint32_t cyclesPerPioDecrement = PulseCounterTiming::cyclesPerDecrement;
   float sampleIntervalMs_;
 public:
-  PulseCounter(uint pin, bool pullup = true, float sampleIntervalMs = 16.6667f) 
+  PulseCounter(uint pin, bool pullup = true, float sampleIntervalMs = 16.6667f, size_t queueDepth = joinedFifoWords) 
     : PioMachine{&pulse_counter_program}
     , sampleIntervalMs_{sampleIntervalMs}
   {
@@ -33,6 +36,9 @@ public:
 
       sm_config_set_in_shift(&config_, false, true, 32); // AUTOPUSH on
       sm_config_set_out_shift(&config_, false, false, 32); // AUTOPULL off
+
+      // Only observations come back, so both FIFOs can hold them
+      setBuffering(queueDepth, 0);
       
       // Set this pin's GPIO function (connect PIO to the pad)
       pio_gpio_init(pio_, pin);
@@ -48,16 +54,10 @@ public:
     
       // Load our configuration, and jump to the start of the program
       pio_sm_init(pio_, sm_, offset, &config_);
-      
-      // Set the state machine running
-      pio_sm_set_enabled(pio_, sm_, true);
-      
-      uint64_t counter64 = (uint64_t)((double)sampleIntervalMs_ * 1000000.0 / (double)nsPerPioDecrement);
-      uint32_t counter = (uint32_t)std::min(counter64, (uint64_t)std::numeric_limits<uint32_t>::max());
 
-      DEBUG_LOG("PulseCounter setup with interval of " << sampleIntervalMs_ << "ms or " << counter << " pio counter decrements");
+      DEBUG_LOG("PulseCounter setup with interval of " << sampleIntervalMs_ << "ms or " << sampleDecrements() << " pio counter decrements");
 
-      write(counter);
+      start();
     }
   }
 
@@ -66,14 +66,27 @@ public:
   // Best to call in a loop until it returns false
   bool pop(uint32_t& pulseCount)
   {
-    if (pio_sm_is_rx_fifo_empty(pio_, sm_))
+    uint32_t count;
+    if (eventIo())
     {
-      return false;
+      if (receive(&count, 1) == 0)
+      {
+        return false;
+      }
+    }
+    else
+    {
+      checkFifoFlags();
+      if (pio_sm_is_rx_fifo_empty(pio_, sm_))
+      {
+        return false;
+      }
+      count = pio_sm_get(pio_, sm_);
     }
     // The PIO state machine's counter is messed up because it starts
     // at zero and can only decrement. Just fix that here so the pulse counts
     // are normal.
-    pulseCount = std::numeric_limits<uint32_t>::max() - pio_sm_get(pio_, sm_) + 1;
+    pulseCount = std::numeric_limits<uint32_t>::max() - count + 1;
     return true;
   }
 
@@ -81,4 +94,63 @@ public:
   {
     return sampleIntervalMs_;
   }
+
+  // RX stalls here mean observations were held up because nobody popped
+  // them in time
+  using PioMachine::fifoStats;
+  using PioMachine::logFifoStats;
+
+  // The sample timer counts system clock cycles, so after the system clock
+  // changes it is reloaded for the new rate. The sample in progress when
+  // this is called runs with the old count, and queued observations are
+  // dropped.
+  void retune() override
+  {
+    if (!loaded_) return;
+    pio_sm_set_enabled(pio_, sm_, false);
+    loadSampleTime();
+    pio_sm_set_enabled(pio_, sm_, true);
+  }
+
+  void reset() override
+  {
+    pio_sm_set_enabled(pio_, sm_, false);
+    pio_sm_restart(pio_, sm_);
+    start();
+  }
+
+private:
+  // Start counting with a fresh sample time. The program's first PULL is
+  // done here, so it starts just after it. The count in Y is cleared too,
+  // since restarting the machine leaves a sample cut short in there.
+  void start()
+  {
+    loadSampleTime();
+    pio_sm_exec(pio_, sm_, pio_encode_set(pio_y, 0));
+    pio_sm_exec(pio_, sm_, pio_encode_jmp(prog_->offset() + pulse_counter_wrap_target));
+    pio_sm_set_enabled(pio_, sm_, true);
+  }
+
+  // Put the sample time in OSR, where the program keeps it, with the
+  // machine stopped. The FIFOs are joined for observations, so they are
+  // split for a moment to pass it through TX. Either change flushes them,
+  // and observations already moved to the ring are dropped after that.
+  void loadSampleTime()
+  {
+    pio_sm_config split = config_;
+    sm_config_set_fifo_join(&split, PIO_FIFO_JOIN_NONE);
+    pio_sm_set_config(pio_, sm_, &split);
+    pio_sm_put(pio_, sm_, sampleDecrements());
+    pio_sm_exec(pio_, sm_, pio_encode_pull(false, true));
+    pio_sm_set_config(pio_, sm_, &config_);
+    discardReceived();
+  }
+
+  // Sample timer decrements in one sample interval at the current system
+  // clock
+  uint32_t sampleDecrements() const
+  {
+    double decrements = (double)sampleIntervalMs_ * (double)clock_get_hz(clk_sys) / 1000.0 / (double)cyclesPerPioDecrement;
+    return (uint32_t)std::min(decrements, (double)std::numeric_limits<uint32_t>::max());
+  }
 };
\ No newline at end of file
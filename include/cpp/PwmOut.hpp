@@ -2,6 +2,7 @@
 
 #include "Logging.hpp"
 
+#include <hardware/clocks.h>
 #include <hardware/gpio.h>
 #include <hardware/pwm.h>
 #include <algorithm>
@@ -9,30 +10,14 @@
 class PwmOut
 {
 public:
-  // clock freq is determined by hardware
   // pwmWrapMax is just uint16 max
-  static constexpr uint64_t clockFreqHz = 125000000;
   static constexpr uint16_t pwmWrapMax = 65535;
-  const uint8_t pwmClockDiv;
-  const uint64_t nsPerPwmTick;
-  const uint64_t nsPerPwmCycleDesired;
-  const uint16_t pwmWrap;
-  const double actualPwmFreqHz;
 
   PwmOut(uint pwmPin, uint64_t desiredPwmFreqHz)
     : pwmPin_{pwmPin}
+    , desiredPwmFreqHz_{desiredPwmFreqHz}
     , grabbed_{false}
     , dc_{0.0f}
-    // Determine the best integer value clock divider given our desired pwmFreq
-    // and the 16 bit limit of the pwm wrap register
-    , pwmClockDiv{(uint8_t)(clockFreqHz / pwmWrapMax / desiredPwmFreqHz + 1ull)}
-    // With the clock divider found, calculate the pwm wrap counter value
-    // that gets us closest to our requested frequency
-    , nsPerPwmTick{1000000000 / clockFreqHz * pwmClockDiv}
-    , nsPerPwmCycleDesired{1000000000 / desiredPwmFreqHz}
-    , pwmWrap{(uint16_t)(nsPerPwmCycleDesired / nsPerPwmTick)}
-    // Calculate the actual PWM frequency achieved
-    , actualPwmFreqHz{1000000000.0 / (double)(pwmWrap * nsPerPwmTick)}
   {
     // Allocate the requested pin to a PWM
     gpio_set_function(pwmPin_, GPIO_FUNC_PWM);
@@ -41,8 +26,7 @@ public:
     slice_ = pwm_gpio_to_slice_num(pwmPin_);
 
     // Set the wrap and clock divider
-    pwm_set_clkdiv_int_frac(slice_, pwmClockDiv, 0);
-    pwm_set_wrap(slice_, pwmWrap);
+    setTiming();
 
     // Just in case...
     bool pullUp = false; bool pullDown = false; bool invert = false;
@@ -71,7 +55,7 @@ public:
     DEBUG_LOG("Set up PWM output on GPIO pin " << pwmPin_);
     DEBUG_LOG("    Using PWM slice " << slice_);
     DEBUG_LOG("    Pull up: " << (pullUp ? "[on]" : "[off]") << " Pull down: " << (pullDown ? "[on]" : "[off]") << " Inv: " << (invert ? "[on]" : "[off]"));
-    DEBUG_LOG("    Requested freq: " << desiredPwmFreqHz << " Actual freq: " << actualPwmFreqHz);
+    DEBUG_LOG("    Requested freq: " << desiredPwmFreqHz_ << " Actual freq: " << actualPwmFreqHz_);
   }
 
   ~PwmOut() = default;
@@ -83,7 +67,7 @@ public:
   {
     t = std::clamp(t, 0.0f, 1.0f);
 
-    uint16_t cyclesOn = (uint16_t)((float)pwmWrap * t);
+    uint16_t cyclesOn = (uint16_t)((float)pwmWrap_ * t);
     pwm_set_gpio_level(pwmPin_, cyclesOn);
     dc_ = t;
   }
@@ -93,14 +77,53 @@ public:
     return dc_;
   }
 
+  // The frequency the divider and wrap actually give
+  double actualPwmFreqHz() const
+  {
+    return actualPwmFreqHz_;
+  }
+
+  // Call after changing the system clock to get back to the requested
+  // frequency, at the same duty cycle
+  void retune()
+  {
+    setTiming();
+    setDutyCycle(dc_);
+  }
+
   void release()
   {
     pwm_set_gpio_level(pwmPin_, 0);
+    dc_ = 0.0f;
     grabbed_ = false;
   }
 
 private:
+  // Work out the clock divider and wrap from the system clock as it is now
+  void setTiming()
+  {
+    uint64_t clockFreqHz = clock_get_hz(clk_sys);
+
+    // Determine the best integer value clock divider given our desired pwmFreq
+    // and the 16 bit limit of the pwm wrap register
+    pwmClockDiv_ = (uint8_t)std::min<uint64_t>(clockFreqHz / pwmWrapMax / desiredPwmFreqHz_ + 1, 255);
+
+    // With the clock divider found, calculate the pwm wrap counter value
+    // that gets us closest to our requested frequency
+    pwmWrap_ = (uint16_t)std::min<uint64_t>(clockFreqHz / pwmClockDiv_ / desiredPwmFreqHz_, pwmWrapMax);
+
+    // Calculate the actual PWM frequency achieved
+    actualPwmFreqHz_ = (double)clockFreqHz / (double)pwmClockDiv_ / (double)pwmWrap_;
+
+    pwm_set_clkdiv_int_frac(slice_, pwmClockDiv_, 0);
+    pwm_set_wrap(slice_, pwmWrap_);
+  }
+
   uint pwmPin_;
+  uint64_t desiredPwmFreqHz_;
+  uint8_t pwmClockDiv_;
+  uint16_t pwmWrap_;
+  double actualPwmFreqHz_;
   uint slice_;
   bool grabbed_;
   float dc_;
@@ -3,12 +3,17 @@
 #include "pico/stdlib.h"
 #include "hardware/spi.h"
 #include <hardware/gpio.h>
+#include <hardware/dma.h>
 
 #include <vector>
 
 class SPIDevice
 {
 public:
+  // Pass for pins the device doesn't use, e.g. MISO and chip select on a
+  // write-only LED strip. The pin is left free for other uses.
+  static constexpr uint NoPin = 0xFFFFFFFF;
+
   SPIDevice(spi_inst_t* spiInstance,
             uint misoPin,
             uint mosiPin,
@@ -25,18 +30,39 @@ public:
     , maxBusSpeedHz{maxBusSpeedHz}
     , maxTransferSizeBytes{maxTransferSizeBytes}
   {
-    spi_init((spi_inst_t*)spiInstance, maxBusSpeedHz);
-    gpio_set_function(misoPin, GPIO_FUNC_SPI);
-    gpio_set_function(clockPin, GPIO_FUNC_SPI);
-    gpio_set_function(mosiPin, GPIO_FUNC_SPI);
-    gpio_set_function(chipSelectPin, GPIO_FUNC_SPI);
+    busSpeedHz = spi_init((spi_inst_t*)spiInstance, maxBusSpeedHz);
+    for (uint pin : {misoPin, clockPin, mosiPin, chipSelectPin})
+    {
+      if (pin != NoPin)
+      {
+        gpio_set_function(pin, GPIO_FUNC_SPI);
+      }
+    }
   }
 
   ~SPIDevice()
   {
+    if (dmaChannel >= 0)
+    {
+      dma_channel_abort(dmaChannel);
+      dma_channel_unclaim(dmaChannel);
+    }
     spi_deinit((spi_inst_t*)spiInstance);
   }
 
+  // SPI mode and word size. Devices default to 8 bit words, mode 0, MSB first.
+  void format(uint dataBits, spi_cpol_t cpol, spi_cpha_t cpha)
+  {
+    spi_set_format(spiInstance, dataBits, cpol, cpha, SPI_MSB_FIRST);
+  }
+
+  // The bus speed the hardware actually runs at, which is the closest the
+  // clock dividers get to maxBusSpeedHz without going over
+  uint32_t baudRate() const
+  {
+    return busSpeedHz;
+  }
+
   int write(const std::vector<uint8_t> &buf)
   {
     return write(buf.data(), buf.size());
@@ -71,9 +97,67 @@ public:
     return ret;
   }
 
+  // Start writing buf with DMA and return right away. buf must not change
+  // until busy() is false. Falls back to a blocking write when no DMA
+  // channel is free.
+  void writeAsync(const uint8_t* buf, size_t len)
+  {
+    waitForWrite();
+    if (dmaChannel < 0 && !claimDma())
+    {
+      write(buf, len);
+      return;
+    }
+    dma_channel_transfer_from_buffer_now(dmaChannel, buf, len);
+  }
+
+  // True while a writeAsync() transfer is still being clocked out
+  bool busy() const
+  {
+    return (dmaChannel >= 0 && dma_channel_is_busy(dmaChannel)) || spi_is_busy(spiInstance);
+  }
+
+  // Block until the last writeAsync() has been clocked out
+  void waitForWrite() const
+  {
+    if (dmaChannel < 0) return;
+
+    dma_channel_wait_for_finish_blocking(dmaChannel);
+    while (spi_is_busy(spiInstance))
+    {
+      tight_loop_contents();
+    }
+    // Like spi_write_blocking(), drop what was clocked in while writing so
+    // the next read doesn't see it
+    while (spi_is_readable(spiInstance))
+    {
+      (void)spi_get_hw(spiInstance)->dr;
+    }
+    spi_get_hw(spiInstance)->icr = SPI_SSPICR_RORIC_BITS;
+  }
+
   uint8_t repeatedTxData = 0;
 
   private:
+    bool claimDma()
+    {
+      dmaChannel = dma_claim_unused_channel(false);
+      if (dmaChannel < 0)
+      {
+        return false;
+      }
+
+      // Bytes from an incrementing buffer into the fixed TX data register,
+      // paced by the SPI's TX DREQ
+      dma_channel_config config = dma_channel_get_default_config(dmaChannel);
+      channel_config_set_transfer_data_size(&config, DMA_SIZE_8);
+      channel_config_set_read_increment(&config, true);
+      channel_config_set_write_increment(&config, false);
+      channel_config_set_dreq(&config, spi_get_dreq(spiInstance, true));
+      dma_channel_configure(dmaChannel, &config, &spi_get_hw(spiInstance)->dr, nullptr, 0, false);
+      return true;
+    }
+
     spi_inst_t* spiInstance;
     uint misoPin;
     uint mosiPin;
@@ -81,4 +165,6 @@ public:
     uint chipSelectPin;
     uint32_t maxBusSpeedHz;
     uint32_t maxTransferSizeBytes;
+    uint32_t busSpeedHz;
+    int dmaChannel = -1;
 };
\ No newline at end of file
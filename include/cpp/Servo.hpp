@@ -1,28 +1,18 @@
 #pragma once
 
 #include "Logging.hpp"
+#include "Math.hpp"
 
+#include <hardware/clocks.h>
 #include <hardware/gpio.h>
 #include <hardware/pwm.h>
 
+#include <algorithm>
+
 class Servo
 {
   static constexpr uint64_t pwmFreqHz = 60;
-
-  // Determine the best integer value clock divider given our desired pwmFreq
-  // and the 16 bit limit of the pwm wrap register
-  static constexpr uint64_t clockFreqHz = 125000000;
   static constexpr uint16_t pwmWrapMax = 65535;
-  static constexpr uint8_t pwmClockDiv = clockFreqHz / pwmWrapMax / pwmFreqHz + 1;
-
-  // With the clock divider found, calculate the pwm wrap counter value
-  // that gets us closest to our requested frequency
-  static constexpr uint64_t nsPerPwmTick = 1000000000 / clockFreqHz * pwmClockDiv;
-  static constexpr uint64_t nsPerPwmCycleDesired = 1000000000 / pwmFreqHz;
-  static constexpr uint16_t pwmWrap = nsPerPwmCycleDesired / nsPerPwmTick;
-
-  // Verify our chosen int clock div and wrap get us close to our requested pwmFreq
-  static constexpr double actualPwmFreqHz = 1000000000.0 / (double)(pwmWrap * nsPerPwmTick);
 
 public:
   Servo(int pin, float minDeg = 0.0f, float maxDeg = 180.0f, uint16_t pwmMinUs = 1000, uint16_t pwmMaxUs = 2000)
@@ -41,8 +31,7 @@ public:
     slice_ = pwm_gpio_to_slice_num(pin_);
 
     // Set the wrap and clock divider
-    pwm_set_clkdiv_int_frac(slice_, pwmClockDiv, 0);
-    pwm_set_wrap(slice_, pwmWrap);
+    setTiming();
 
     // Just in case...
     bool pullUp = true; bool pullDown = false; bool invert = false;
@@ -93,8 +82,8 @@ public:
       clamp(t, 0.0, 1.0);
     }
 
-    uint16_t cyclesOn = (uint16_t)(((double)pwmRangeUs_ * t + (double)pwmMinUs_) * 1000.0 / (double)nsPerPwmTick);
-    pwm_set_gpio_level(pin_, cyclesOn);    
+    pulseUs_ = (double)pwmRangeUs_ * t + (double)pwmMinUs_;
+    pwm_set_gpio_level(pin_, (uint16_t)(pulseUs_ * pwmTicksPerUs_));
   }
 
   void posDeg(double deg)
@@ -118,9 +107,18 @@ public:
   void release()
   {
     pwm_set_gpio_level(pin_, 0);
+    pulseUs_ = 0.0;
     grabbed_ = false;
   }
 
+  // Call after changing the system clock. The servo stays at 60Hz and holds
+  // its position.
+  void retune()
+  {
+    setTiming();
+    pwm_set_gpio_level(pin_, (uint16_t)(pulseUs_ * pwmTicksPerUs_));
+  }
+
   enum class OutOfBoundsBehavior
   {
     NoMove,
@@ -136,6 +134,24 @@ public:
   bool invert = false;
 
 private:
+  // Work out the clock divider and wrap from the system clock as it is now
+  void setTiming()
+  {
+    uint64_t clockFreqHz = clock_get_hz(clk_sys);
+
+    // Determine the best integer value clock divider given our desired pwmFreq
+    // and the 16 bit limit of the pwm wrap register
+    uint8_t pwmClockDiv = (uint8_t)std::min<uint64_t>(clockFreqHz / pwmWrapMax / pwmFreqHz + 1, 255);
+
+    // With the clock divider found, calculate the pwm wrap counter value
+    // that gets us closest to our requested frequency
+    uint16_t pwmWrap = (uint16_t)std::min<uint64_t>(clockFreqHz / pwmClockDiv / pwmFreqHz, pwmWrapMax);
+    pwmTicksPerUs_ = (double)clockFreqHz / (double)pwmClockDiv / 1000000.0;
+
+    pwm_set_clkdiv_int_frac(slice_, pwmClockDiv, 0);
+    pwm_set_wrap(slice_, pwmWrap);
+  }
+
   int pin_;
   float minDeg_;
   float maxDeg_;
@@ -143,5 +159,7 @@ private:
   uint16_t pwmMaxUs_;
   uint16_t pwmRangeUs_;
   uint slice_;
+  double pwmTicksPerUs_ = 0.0;
+  double pulseUs_ = 0.0;
   bool grabbed_;
 };
\ No newline at end of file
@@ -0,0 +1,326 @@
+#pragma once
+
+#include "Logging.hpp"
+#include "Color.hpp"
+#include "SPIDevice.hpp"
+
+#include <pico/stdlib.h>
+#include <hardware/gpio.h>
+#include <hardware/spi.h>
+#include <hardware/timer.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// ST7789 and ILI9341 TFT displays on a hardware SPI port.
+//
+// Drawing goes to an RGB565 frame buffer in RAM (2 bytes per pixel, so
+// 115KB for 240x240), and every drawing call grows a dirty rectangle.
+// flush() sends only that rectangle: it sets the display's address window
+// to it once, then streams each of its lines with DMA straight from the
+// frame buffer. When the rectangle is as wide as the screen its lines are
+// contiguous, and go out as one transfer.
+//
+// Chip select and data/command are plain GPIOs, since the display needs
+// DC to change between the command byte and its parameters. Without a CS
+// pin, pass SPIDevice::NoPin, and most modules then need SPI mode 3.
+class SpiDisplay
+{
+public:
+  enum class Controller
+  {
+    ST7789,
+    ILI9341
+  };
+
+  struct Config
+  {
+    Controller controller = Controller::ST7789;
+    // Size as displayed, after rotation
+    int width = 240;
+    int height = 240;
+    // Where the visible area starts in the controller's memory, e.g.
+    // 240x240 ST7789 modules in rotations 2 and 3 start 80 rows in
+    int xOffset = 0;
+    int yOffset = 0;
+    // Quarter turns clockwise
+    int rotation = 0;
+    uint32_t baudRateHz = 62500000;
+    bool spiMode3 = false;
+  };
+
+  SpiDisplay(spi_inst_t* spi,
+             uint dataPin,
+             uint clockPin,
+             uint chipSelectPin,
+             uint dcPin,
+             uint resetPin,
+             const Config& config)
+    : spi_(spi, SPIDevice::NoPin, dataPin, clockPin, SPIDevice::NoPin, config.baudRateHz)
+    , config_(config)
+    , chipSelectPin_(chipSelectPin)
+    , dcPin_(dcPin)
+  {
+    if (config_.spiMode3)
+    {
+      spi_.format(8, SPI_CPOL_1, SPI_CPHA_1);
+    }
+
+    for (uint pin : {chipSelectPin, dcPin, resetPin})
+    {
+      if (pin != SPIDevice::NoPin)
+      {
+        gpio_init(pin);
+        gpio_set_dir(pin, GPIO_OUT);
+        gpio_put(pin, 1);
+      }
+    }
+
+    if (resetPin != SPIDevice::NoPin)
+    {
+      gpio_put(resetPin, 0);
+      sleep_ms(10);
+      gpio_put(resetPin, 1);
+      sleep_ms(120);
+    }
+
+    init();
+
+    framebuffer_.assign((size_t)config_.width * (size_t)config_.height, 0);
+    markDirty(0, 0, config_.width, config_.height);
+    DEBUG_LOG("SPI display " << config_.width << "x" << config_.height << " at " << spi_.baudRate() << "Hz");
+  }
+
+  int width() const
+  {
+    return config_.width;
+  }
+
+  int height() const
+  {
+    return config_.height;
+  }
+
+  // The RGB565 frame buffer, row major. Call markDirty() for anything
+  // drawn into it directly.
+  uint16_t* framebuffer()
+  {
+    return framebuffer_.data();
+  }
+
+  void setPixel(int x, int y, const RGBColor& color)
+  {
+    if (x < 0 || y < 0 || x >= config_.width || y >= config_.height) return;
+    framebuffer_[y * config_.width + x] = color.toRGB565();
+    markDirty(x, y, 1, 1);
+  }
+
+  void fill(const RGBColor& color)
+  {
+    fillRect(0, 0, config_.width, config_.height, color);
+  }
+
+  // Fill a rectangle, clipped to the screen
+  void fillRect(int x, int y, int w, int h, const RGBColor& color)
+  {
+    if (!clip(x, y, w, h)) return;
+    uint16_t c = color.toRGB565();
+    for (int row = y; row < y + h; ++row)
+    {
+      std::fill_n(&framebuffer_[row * config_.width + x], w, c);
+    }
+    markDirty(x, y, w, h);
+  }
+
+  // Copy a w by h image, stored row major, to (x, y), clipped to the screen
+  void blit(const RGBColor* image, int w, int h, int x, int y)
+  {
+    int x0 = x;
+    int y0 = y;
+    int cw = w;
+    int ch = h;
+    if (!clip(x0, y0, cw, ch)) return;
+    for (int row = 0; row < ch; ++row)
+    {
+      packRGB565(&image[(y0 - y + row) * w + (x0 - x)], &framebuffer_[(y0 + row) * config_.width + x0], cw);
+    }
+    markDirty(x0, y0, cw, ch);
+  }
+
+  // Grow the dirty rectangle to cover a w by h area at (x, y)
+  void markDirty(int x, int y, int w, int h)
+  {
+    if (!clip(x, y, w, h)) return;
+    dirtyX0_ = std::min(dirtyX0_, x);
+    dirtyY0_ = std::min(dirtyY0_, y);
+    dirtyX1_ = std::max(dirtyX1_, x + w);
+    dirtyY1_ = std::max(dirtyY1_, y + h);
+  }
+
+  bool dirty() const
+  {
+    return dirtyX0_ < dirtyX1_;
+  }
+
+  // Send the dirty rectangle to the display, then clear it. Returns the
+  // number of pixels sent.
+  size_t flush()
+  {
+    if (!dirty()) return 0;
+
+    uint64_t startUs = time_us_64();
+    int x = dirtyX0_;
+    int y = dirtyY0_;
+    int w = dirtyX1_ - dirtyX0_;
+    int h = dirtyY1_ - dirtyY0_;
+    setWindow(x, y, w, h);
+
+    select();
+    command(0x2C); // RAMWR
+    if (w == config_.width)
+    {
+      spi_.writeAsync((const uint8_t*)&framebuffer_[y * config_.width], (size_t)w * h * 2);
+    }
+    else
+    {
+      for (int row = y; row < y + h; ++row)
+      {
+        spi_.writeAsync((const uint8_t*)&framebuffer_[row * config_.width + x], (size_t)w * 2);
+      }
+    }
+    spi_.waitForWrite();
+    deselect();
+
+    dirtyX0_ = dirtyY0_ = INT32_MAX;
+    dirtyX1_ = dirtyY1_ = 0;
+    lastFlushPixels_ = (size_t)w * h;
+    lastFlushUs_ = time_us_64() - startUs;
+    return lastFlushPixels_;
+  }
+
+  // Send the whole frame buffer, dirty or not
+  size_t flushAll()
+  {
+    markDirty(0, 0, config_.width, config_.height);
+    return flush();
+  }
+
+  // Time taken by the last flush(), and the pixels it sent
+  uint64_t lastFlushUs() const
+  {
+    return lastFlushUs_;
+  }
+
+  size_t lastFlushPixels() const
+  {
+    return lastFlushPixels_;
+  }
+
+  // Time to send pixelCount pixels at the actual SPI rate, not counting
+  // the few bytes of commands per flush
+  uint64_t flushTimeUs(size_t pixelCount) const
+  {
+    return (uint64_t)pixelCount * 16 * 1000000 / spi_.baudRate();
+  }
+
+private:
+  void init()
+  {
+    command(0x01); // SWRESET
+    sleep_ms(150);
+    command(0x11); // SLPOUT
+    sleep_ms(120);
+
+    uint8_t colorMode = 0x55; // 16 bits per pixel
+    command(0x3A, &colorMode, 1); // COLMOD
+
+    // Memory access order for each rotation: MY, MX, MV bits
+    static constexpr uint8_t st7789Madctl[4] = {0x00, 0x60, 0xC0, 0xA0};
+    static constexpr uint8_t ili9341Madctl[4] = {0x48, 0x28, 0x88, 0xE8};
+    int rotation = config_.rotation & 3;
+    uint8_t madctl = (config_.controller == Controller::ST7789) ? st7789Madctl[rotation] : ili9341Madctl[rotation];
+    command(0x36, &madctl, 1); // MADCTL
+
+    if (config_.controller == Controller::ST7789)
+    {
+      // ST7789 panels are wired with inverted colors
+      command(0x21); // INVON
+    }
+    command(0x13); // NORON
+    command(0x29); // DISPON
+    sleep_ms(10);
+  }
+
+  void setWindow(int x, int y, int w, int h)
+  {
+    uint16_t x0 = (uint16_t)(x + config_.xOffset);
+    uint16_t x1 = (uint16_t)(x0 + w - 1);
+    uint16_t y0 = (uint16_t)(y + config_.yOffset);
+    uint16_t y1 = (uint16_t)(y0 + h - 1);
+    uint8_t columns[4] = {(uint8_t)(x0 >> 8), (uint8_t)x0, (uint8_t)(x1 >> 8), (uint8_t)x1};
+    uint8_t rows[4] = {(uint8_t)(y0 >> 8), (uint8_t)y0, (uint8_t)(y1 >> 8), (uint8_t)y1};
+    command(0x2A, columns, 4); // CASET
+    command(0x2B, rows, 4); // RASET
+  }
+
+  // Send a command byte with DC low, then its parameters with DC high.
+  // Leaves DC high, ready for pixel data.
+  void command(uint8_t cmd, const uint8_t* params = nullptr, size_t len = 0)
+  {
+    spi_.waitForWrite();
+    bool selected = selected_;
+    if (!selected) select();
+    gpio_put(dcPin_, 0);
+    spi_.write(&cmd, 1);
+    gpio_put(dcPin_, 1);
+    if (len > 0)
+    {
+      spi_.write(params, len);
+    }
+    if (!selected) deselect();
+  }
+
+  void select()
+  {
+    if (chipSelectPin_ != SPIDevice::NoPin)
+    {
+      gpio_put(chipSelectPin_, 0);
+    }
+    selected_ = true;
+  }
+
+  void deselect()
+  {
+    if (chipSelectPin_ != SPIDevice::NoPin)
+    {
+      gpio_put(chipSelectPin_, 1);
+    }
+    selected_ = false;
+  }
+
+  // Clip a rectangle to the screen, false if nothing is left
+  bool clip(int& x, int& y, int& w, int& h) const
+  {
+    int x1 = std::min(x + w, config_.width);
+    int y1 = std::min(y + h, config_.height);
+    x = std::max(x, 0);
+    y = std::max(y, 0);
+    w = x1 - x;
+    h = y1 - y;
+    return w > 0 && h > 0;
+  }
+
+  SPIDevice spi_;
+  Config config_;
+  uint chipSelectPin_;
+  uint dcPin_;
+  bool selected_ = false;
+  std::vector<uint16_t> framebuffer_;
+  int dirtyX0_ = INT32_MAX;
+  int dirtyY0_ = INT32_MAX;
+  int dirtyX1_ = 0;
+  int dirtyY1_ = 0;
+  uint64_t lastFlushUs_ = 0;
+  size_t lastFlushPixels_ = 0;
+};
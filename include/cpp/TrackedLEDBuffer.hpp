@@ -0,0 +1,129 @@
+#pragma once
+
+#include "Color.hpp"
+
+#include <algorithm>
+#include <cstdint>
+
+// An LEDBuffer that remembers which pixels changed since it was last
+// written to a strip. Every change bumps a generation counter and grows
+// the dirty range, so outputs can skip frames where nothing changed and
+// only repack the pixels that did.
+//
+// Reads are free. Writes go through set(), fill(), or modify(), which is
+// how the dirty range is kept. Writing a buffer clears its dirty range, so
+// a strip fed several buffers, or a buffer fed to several strips, repacks
+// whole frames whenever the buffer it last packed isn't the one in hand.
+class TrackedLEDBuffer
+{
+public:
+  explicit TrackedLEDBuffer(size_t size = 0, const RGBColor& color = {}) :
+    buffer_(size, color)
+  {
+    markDirty(0, size);
+  }
+
+  size_t size() const
+  {
+    return buffer_.size();
+  }
+
+  void resize(size_t size, const RGBColor& color = {})
+  {
+    if (size == buffer_.size()) return;
+    size_t oldSize = buffer_.size();
+    buffer_.resize(size, color);
+    markDirty(std::min(oldSize, size), size);
+  }
+
+  const RGBColor& operator[](size_t index) const
+  {
+    return buffer_[index];
+  }
+
+  const LEDBuffer& buffer() const
+  {
+    return buffer_;
+  }
+
+  // Set one pixel. Writing the color it already has doesn't dirty it.
+  void set(size_t index, const RGBColor& color)
+  {
+    RGBColor& c = buffer_[index];
+    if (c.R == color.R && c.G == color.G && c.B == color.B) return;
+    c = color;
+    markDirty(index, index + 1);
+  }
+
+  void fill(const RGBColor& color)
+  {
+    std::fill(buffer_.begin(), buffer_.end(), color);
+    markDirty(0, buffer_.size());
+  }
+
+  // Direct access to pixels [begin, end) for batch functions such as
+  // nblend8() or fillRainbow(). The whole range is marked dirty.
+  RGBColor* modify(size_t begin, size_t end)
+  {
+    markDirty(begin, end);
+    return buffer_.data() + begin;
+  }
+
+  RGBColor* modify()
+  {
+    return modify(0, buffer_.size());
+  }
+
+  void markDirty(size_t begin, size_t end)
+  {
+    end = std::min(end, buffer_.size());
+    if (begin >= end) return;
+    dirtyBegin_ = std::min(dirtyBegin_, begin);
+    dirtyEnd_ = std::max(dirtyEnd_, end);
+    ++generation_;
+  }
+
+  // Incremented by every change
+  uint32_t generation() const
+  {
+    return generation_;
+  }
+
+  // generation() at the last clearDirty(). The dirty range holds every
+  // change since then, so an output that last saw the buffer at this
+  // generation only needs to repack that range.
+  uint32_t cleanGeneration() const
+  {
+    return cleanGeneration_;
+  }
+
+  bool dirty() const
+  {
+    return dirtyBegin_ < dirtyEnd_;
+  }
+
+  // Pixels changed since clearDirty(), as [dirtyBegin(), dirtyEnd())
+  size_t dirtyBegin() const
+  {
+    return dirtyBegin_;
+  }
+
+  size_t dirtyEnd() const
+  {
+    return dirtyEnd_;
+  }
+
+  void clearDirty()
+  {
+    dirtyBegin_ = SIZE_MAX;
+    dirtyEnd_ = 0;
+    cleanGeneration_ = generation_;
+  }
+
+private:
+  LEDBuffer buffer_;
+  uint32_t generation_ = 0;
+  uint32_t cleanGeneration_ = 0;
+  size_t dirtyBegin_ = SIZE_MAX;
+  size_t dirtyEnd_ = 0;
+};
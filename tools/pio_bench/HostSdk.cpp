@@ -0,0 +1,216 @@
+// Host stand-ins for the pico SDK functions the PIO drivers call. Program
+// memory, state machine and DMA channel claims are tracked like the SDK
+// tracks them, so constructing a PioMachine does the same bookkeeping it
+// does on a pico. Everything that would touch hardware does nothing: FIFOs
+// read empty, DMA finishes at once and interrupts never fire.
+
+#include <pico/stdlib.h>
+#include <hardware/dma.h>
+#include <hardware/pio.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+
+pio_hw_t host_pio_hw[NUM_PIOS];
+
+namespace
+{
+  uint32_t usedInstructions[NUM_PIOS];
+  uint8_t claimedStateMachines[NUM_PIOS];
+  uint16_t claimedDmaChannels;
+  dma_channel_hw_t dmaChannels[NUM_DMA_CHANNELS];
+  const auto bootTime = std::chrono::steady_clock::now();
+
+  uint32_t programMask(const pio_program_t* program)
+  {
+    return (1u << program->length) - 1;
+  }
+
+  // Same search as the SDK: the program's origin if it has one, otherwise
+  // the highest free offset
+  int findOffset(PIO pio, const pio_program_t* program)
+  {
+    uint32_t mask = programMask(program);
+    if (program->origin >= 0)
+    {
+      if (program->origin + program->length > (int)PIO_INSTRUCTION_COUNT) return -1;
+      return (usedInstructions[PIO_NUM(pio)] & (mask << program->origin)) ? -1 : program->origin;
+    }
+    for (int offset = (int)PIO_INSTRUCTION_COUNT - program->length; offset >= 0; --offset)
+    {
+      if (!(usedInstructions[PIO_NUM(pio)] & (mask << offset))) return offset;
+    }
+    return -1;
+  }
+
+  void panic(const char* message)
+  {
+    std::cerr << message << std::endl;
+    std::abort();
+  }
+}
+
+// Time
+
+uint64_t time_us_64()
+{
+  return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - bootTime).count();
+}
+
+uint32_t time_us_32() { return (uint32_t)time_us_64(); }
+absolute_time_t get_absolute_time() { return time_us_64(); }
+absolute_time_t make_timeout_time_us(uint64_t us) { return time_us_64() + us; }
+absolute_time_t make_timeout_time_ms(uint32_t ms) { return time_us_64() + (uint64_t)ms * 1000; }
+absolute_time_t delayed_by_us(absolute_time_t t, uint64_t us) { return t + us; }
+int64_t absolute_time_diff_us(absolute_time_t from, absolute_time_t to) { return (int64_t)(to - from); }
+uint64_t to_us_since_boot(absolute_time_t t) { return t; }
+bool time_reached(absolute_time_t t) { return time_us_64() >= t; }
+bool best_effort_wfe_or_timeout(absolute_time_t timeout) { return time_reached(timeout); }
+void sleep_until(absolute_time_t t) { while (!time_reached(t)) std::this_thread::yield(); }
+void sleep_us(uint64_t us) { sleep_until(make_timeout_time_us(us)); }
+void sleep_ms(uint32_t ms) { sleep_us((uint64_t)ms * 1000); }
+
+// Clocks, GPIO, interrupts
+
+uint32_t clock_get_hz(clock_handle_t) { return 125000000; }
+void gpio_set_pulls(uint, bool, bool) {}
+void gpio_set_input_enabled(uint, bool) {}
+void irq_add_shared_handler(uint, irq_handler_t, uint8_t) {}
+void irq_remove_handler(uint, irq_handler_t) {}
+void irq_set_enabled(uint, bool) {}
+uint32_t save_and_disable_interrupts() { return 0; }
+void restore_interrupts(uint32_t) {}
+
+// DMA
+
+int dma_claim_unused_channel(bool required)
+{
+  for (uint channel = 0; channel < NUM_DMA_CHANNELS; ++channel)
+  {
+    if (!(claimedDmaChannels & (1u << channel)))
+    {
+      claimedDmaChannels |= (uint16_t)(1u << channel);
+      return (int)channel;
+    }
+  }
+  if (required) panic("No DMA channels are available");
+  return -1;
+}
+
+void dma_channel_unclaim(uint channel) { claimedDmaChannels &= (uint16_t)~(1u << channel); }
+dma_channel_config dma_channel_get_default_config(uint) { return {}; }
+void channel_config_set_transfer_data_size(dma_channel_config*, enum dma_channel_transfer_size) {}
+void channel_config_set_read_increment(dma_channel_config*, bool) {}
+void channel_config_set_write_increment(dma_channel_config*, bool) {}
+void channel_config_set_dreq(dma_channel_config*, uint) {}
+void dma_channel_configure(uint, const dma_channel_config*, volatile void*, const volatile void*, uint, bool) {}
+void dma_channel_transfer_from_buffer_now(uint, const volatile void*, uint32_t) {}
+void dma_channel_transfer_to_buffer_now(uint, volatile void*, uint32_t) {}
+bool dma_channel_is_busy(uint) { return false; }
+void dma_channel_wait_for_finish_blocking(uint) {}
+void dma_channel_abort(uint) {}
+void dma_channel_set_irq1_enabled(uint, bool) {}
+bool dma_channel_get_irq1_status(uint) { return false; }
+void dma_channel_acknowledge_irq1(uint) {}
+dma_channel_hw_t* dma_channel_hw_addr(uint channel) { return &dmaChannels[channel]; }
+
+// PIO program memory and state machines
+
+bool pio_can_add_program(PIO pio, const pio_program_t* program)
+{
+  return findOffset(pio, program) >= 0;
+}
+
+uint pio_add_program(PIO pio, const pio_program_t* program)
+{
+  int offset = findOffset(pio, program);
+  if (offset < 0) panic("No program space");
+  usedInstructions[PIO_NUM(pio)] |= programMask(program) << offset;
+  return (uint)offset;
+}
+
+bool pio_can_add_program_at_offset(PIO pio, const pio_program_t* program, uint offset)
+{
+  if (program->origin >= 0 && (uint)program->origin != offset) return false;
+  if (offset + program->length > PIO_INSTRUCTION_COUNT) return false;
+  return !(usedInstructions[PIO_NUM(pio)] & (programMask(program) << offset));
+}
+
+uint pio_add_program_at_offset(PIO pio, const pio_program_t* program, uint offset)
+{
+  if (!pio_can_add_program_at_offset(pio, program, offset)) panic("No program space");
+  usedInstructions[PIO_NUM(pio)] |= programMask(program) << offset;
+  return offset;
+}
+
+void pio_remove_program(PIO pio, const pio_program_t* program, uint loaded_offset)
+{
+  usedInstructions[PIO_NUM(pio)] &= ~(programMask(program) << loaded_offset);
+}
+
+int pio_claim_unused_sm(PIO pio, bool required)
+{
+  for (uint sm = 0; sm < NUM_PIO_STATE_MACHINES; ++sm)
+  {
+    if (!pio_sm_is_claimed(pio, sm))
+    {
+      pio_sm_claim(pio, sm);
+      return (int)sm;
+    }
+  }
+  if (required) panic("No PIO state machines are available");
+  return -1;
+}
+
+void pio_sm_claim(PIO pio, uint sm) { claimedStateMachines[PIO_NUM(pio)] |= (uint8_t)(1u << sm); }
+void pio_sm_unclaim(PIO pio, uint sm) { claimedStateMachines[PIO_NUM(pio)] &= (uint8_t)~(1u << sm); }
+bool pio_sm_is_claimed(PIO pio, uint sm) { return claimedStateMachines[PIO_NUM(pio)] & (1u << sm); }
+
+// PIO interrupts
+
+uint pio_get_irq_num(PIO pio, uint irqn) { return 7 + 2 * PIO_NUM(pio) + irqn; }
+uint pio_get_dreq(PIO pio, uint sm, bool is_tx) { return PIO_NUM(pio) * 8 + sm + (is_tx ? 0 : 4); }
+pio_interrupt_source_t pio_get_rx_fifo_not_empty_interrupt_source(uint sm) { return (pio_interrupt_source_t)(pis_sm0_rx_fifo_not_empty + sm); }
+pio_interrupt_source_t pio_get_tx_fifo_not_full_interrupt_source(uint sm) { return (pio_interrupt_source_t)(pis_sm0_tx_fifo_not_full + sm); }
+void pio_set_irqn_source_enabled(PIO, uint, pio_interrupt_source_t, bool) {}
+
+// PIO state machines
+
+void pio_gpio_init(PIO, uint) {}
+int pio_sm_set_consecutive_pindirs(PIO, uint, uint, uint, bool) { return 0; }
+int pio_sm_init(PIO, uint, uint, const pio_sm_config*) { return 0; }
+void pio_sm_set_config(PIO, uint, const pio_sm_config*) {}
+void pio_sm_set_enabled(PIO, uint, bool) {}
+void pio_sm_restart(PIO, uint) {}
+void pio_sm_clear_fifos(PIO, uint) {}
+void pio_sm_set_clkdiv(PIO, uint, float) {}
+void pio_sm_exec(PIO, uint, uint) {}
+void pio_sm_put(PIO, uint, uint32_t) {}
+void pio_sm_put_blocking(PIO, uint, uint32_t) {}
+uint32_t pio_sm_get(PIO, uint) { return 0; }
+uint32_t pio_sm_get_blocking(PIO, uint) { return 0; }
+bool pio_sm_is_rx_fifo_empty(PIO, uint) { return true; }
+bool pio_sm_is_tx_fifo_full(PIO, uint) { return false; }
+uint pio_sm_get_rx_fifo_level(PIO, uint) { return 0; }
+uint pio_sm_get_tx_fifo_level(PIO, uint) { return 0; }
+
+// Config setters
+
+pio_sm_config pio_get_default_sm_config() { return {}; }
+void sm_config_set_wrap(pio_sm_config* c, uint wrap_target, uint wrap) { c->execctrl = wrap_target << 7 | wrap << 12; }
+void sm_config_set_sideset(pio_sm_config*, uint, bool, bool) {}
+void sm_config_set_sideset_pins(pio_sm_config*, uint) {}
+void sm_config_set_in_pins(pio_sm_config*, uint) {}
+void sm_config_set_out_pins(pio_sm_config*, uint, uint) {}
+void sm_config_set_set_pins(pio_sm_config*, uint, uint) {}
+void sm_config_set_jmp_pin(pio_sm_config*, uint) {}
+void sm_config_set_in_shift(pio_sm_config*, bool, bool, uint) {}
+void sm_config_set_out_shift(pio_sm_config*, bool, bool, uint) {}
+void sm_config_set_clkdiv(pio_sm_config* c, float div) { c->clkdiv = (uint32_t)(div * 65536.0f); }
+void sm_config_set_fifo_join(pio_sm_config* c, enum pio_fifo_join join) { c->shiftctrl = (uint32_t)join << 30; }
+
+uint pio_encode_jmp(uint addr) { return addr; }
+uint pio_encode_set(enum pio_src_dest dest, uint value) { return 0xe000 | dest << 5 | value; }
+uint pio_encode_pull(bool if_empty, bool block) { return 0x8080 | (if_empty ? 0x40 : 0) | (block ? 0x20 : 0); }
@@ -0,0 +1,237 @@
+// Host microbenchmark for the PIO driver code that doesn't need a pico:
+// packing Joybus buffers into FIFO words, and PioMachine's own bookkeeping
+// when state machines are claimed and released. The SDK calls go to the stand-ins
+// in HostSdk.cpp. examples/benchmark runs the same loops on a device.
+
+// pi-pico-cpp headers
+#include <cpp/N64Controller.hpp>
+
+// std headers
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <iterator>
+#include <new>
+#include <optional>
+#include <vector>
+
+// Keeps the compiler from optimizing away benchmark results
+static volatile uint32_t sink;
+
+// Heap allocations so far. The pico's allocator is much slower than a
+// host's, so the count says more about device cost than the time does.
+static size_t allocations;
+
+void* operator new(size_t size)
+{
+  ++allocations;
+  if (void* p = std::malloc(size ? size : 1))
+  {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+  std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+  std::free(p);
+}
+
+// Reports the fastest of several batches, since a host shares its cores
+// with everything else running
+template <typename Func>
+void benchmark(const char* name, size_t itemsPerRun, Func func, int runs = 2000, int batches = 9)
+{
+  // One untimed run to warm the caches
+  func();
+  double bestNs = 0;
+  for (int batch = 0; batch < batches; ++batch)
+  {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < runs; ++i)
+    {
+      func();
+    }
+    double elapsedNs = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    if (batch == 0 || elapsedNs < bestNs)
+    {
+      bestNs = elapsedNs;
+    }
+  }
+  std::cout << name << ": " << bestNs / ((double)itemsPerRun * runs) << " ns per item" << std::endl;
+}
+
+// Hides the buffer's type, so the compiler can't devirtualize calls
+// through the reference the way it could on a host build with full
+// inlining
+template <typename T>
+PioBuffer& opaque(T& buf)
+{
+  PioBuffer* p = &buf;
+  asm volatile("" : "+r"(p));
+  return *p;
+}
+
+// Packs through the virtual interface, the way PioMachine did before the
+// buffer types were known at the call site
+__attribute__((noinline)) void packVirtual(const PioBuffer& buf, uint32_t* dst)
+{
+  for (size_t i = 0; i < buf.size; ++i)
+  {
+    buf.pack(dst[i], i);
+  }
+}
+
+__attribute__((noinline)) void unpackVirtual(PioBuffer& buf, const uint32_t* src)
+{
+  for (size_t i = 0; i < buf.size; ++i)
+  {
+    buf.unpack(src[i], i);
+  }
+}
+
+// The packers PioMachine's templated read() and write() use. Out of line
+// like the virtual ones, so both sides pay one call per buffer.
+template <typename T>
+__attribute__((noinline)) void packStatic(const T& buf, uint32_t* dst)
+{
+  buf.packAll(dst);
+}
+
+template <typename T>
+__attribute__((noinline)) void unpackStatic(T& buf, const uint32_t* src)
+{
+  buf.unpackAll(src);
+}
+
+// A bare state machine, to time PioMachine's own bookkeeping
+struct BenchMachine : PioMachine
+{
+  BenchMachine() : PioMachine(&joybus_host_program) {}
+};
+
+int main(int argc, char** argv)
+{
+  // Joybus buffers, packed 1000 times per run
+  N64ControllerButtonState buttonState;
+  buttonState.buttons = N64Buttons::A;
+  buttonState.xAxis = 40;
+  std::vector<uint16_t> accessory(16, 0x1234);
+  JoybusBuffer16 accessoryBuffer(accessory.data(), accessory.size());
+  PioBuffer& virtualState = opaque(buttonState);
+  PioBuffer& virtualAccessory = opaque(accessoryBuffer);
+  uint32_t words[PioMachine::maxPackedWords];
+
+  std::cout << "PioBuffer packing, 1000 buffers" << std::endl;
+
+  benchmark("  N64 state, virtual pack", 1000, [&]()
+  {
+    uint32_t sum = 0;
+    for (int i = 0; i < 1000; ++i)
+    {
+      buttonState.xAxis = (int8_t)i;
+      packVirtual(virtualState, words);
+      sum += words[2];
+    }
+    sink = sum;
+  });
+
+  benchmark("  N64 state, packAll", 1000, [&]()
+  {
+    uint32_t sum = 0;
+    for (int i = 0; i < 1000; ++i)
+    {
+      buttonState.xAxis = (int8_t)i;
+      packStatic(buttonState, words);
+      sum += words[2];
+    }
+    sink = sum;
+  });
+
+  benchmark("  N64 state, virtual unpack", 1000, [&]()
+  {
+    uint32_t sum = 0;
+    for (int i = 0; i < 1000; ++i)
+    {
+      words[2] = (uint32_t)i;
+      unpackVirtual(virtualState, words);
+      sum += (uint32_t)buttonState.xAxis;
+    }
+    sink = sum;
+  });
+
+  benchmark("  N64 state, unpackAll", 1000, [&]()
+  {
+    uint32_t sum = 0;
+    for (int i = 0; i < 1000; ++i)
+    {
+      words[2] = (uint32_t)i;
+      unpackStatic(buttonState, words);
+      sum += (uint32_t)buttonState.xAxis;
+    }
+    sink = sum;
+  });
+
+  benchmark("  32 byte accessory, virtual pack", 1000, [&]()
+  {
+    uint32_t sum = 0;
+    for (int i = 0; i < 1000; ++i)
+    {
+      accessory[0] = (uint16_t)i;
+      packVirtual(virtualAccessory, words);
+      sum += words[0];
+    }
+    sink = sum;
+  });
+
+  benchmark("  32 byte accessory, packAll", 1000, [&]()
+  {
+    uint32_t sum = 0;
+    for (int i = 0; i < 1000; ++i)
+    {
+      accessory[0] = (uint16_t)i;
+      packStatic(accessoryBuffer, words);
+      sum += words[0];
+    }
+    sink = sum;
+  });
+
+  // Every state machine of both PIOs by default, claimed then released.
+  // Trees from before PioMachine tracked its own claims can only place 4
+  // machines running the same program, so compare those with "pio_bench 4".
+  std::optional<BenchMachine> machines[2 * NUM_PIO_STATE_MACHINES];
+  size_t machineCount = argc > 1 ? std::min((size_t)std::atoi(argv[1]), std::size(machines)) : std::size(machines);
+
+  std::cout << "PioMachine, " << machineCount << " state machines" << std::endl;
+
+  benchmark("  construct and destroy", machineCount, [&]()
+  {
+    for (size_t i = 0; i < machineCount; ++i)
+    {
+      machines[i].emplace();
+    }
+    for (size_t i = 0; i < machineCount; ++i)
+    {
+      machines[i].reset();
+    }
+  }, 20000);
+
+  size_t allocationsBefore = allocations;
+  for (size_t i = 0; i < machineCount; ++i)
+  {
+    machines[i].emplace();
+  }
+  for (size_t i = 0; i < machineCount; ++i)
+  {
+    machines[i].reset();
+  }
+  std::cout << "  heap allocations: " << allocations - allocationsBefore << std::endl;
+
+  return 0;
+}
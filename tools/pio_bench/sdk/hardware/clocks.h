@@ -0,0 +1,8 @@
+#pragma once
+
+#include "pico/types.h"
+
+enum clock_index { clk_gpout0 = 0, clk_ref = 4, clk_sys = 5, clk_peri = 6 };
+typedef enum clock_index clock_handle_t;
+
+uint32_t clock_get_hz(clock_handle_t clock);
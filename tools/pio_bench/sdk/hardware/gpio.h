@@ -0,0 +1,6 @@
+#pragma once
+
+#include "pico/types.h"
+
+void gpio_set_pulls(uint gpio, bool up, bool down);
+void gpio_set_input_enabled(uint gpio, bool enabled);
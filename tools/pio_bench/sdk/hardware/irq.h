@@ -0,0 +1,10 @@
+#pragma once
+
+#include "pico/types.h"
+
+#define DMA_IRQ_0 11
+#define DMA_IRQ_1 12
+
+void irq_add_shared_handler(uint num, irq_handler_t handler, uint8_t order_priority);
+void irq_remove_handler(uint num, irq_handler_t handler);
+void irq_set_enabled(uint num, bool enabled);
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "pico/types.h"
+#include "hardware/gpio.h"
+
+// Register block with the fields the drivers touch directly. pio0 and pio1
+// are host arrays, nothing reads them back.
+typedef struct
+{
+  io_rw_32 ctrl, fstat, fdebug, flevel;
+  io_wo_32 txf[NUM_PIO_STATE_MACHINES];
+  io_ro_32 rxf[NUM_PIO_STATE_MACHINES];
+} pio_hw_t;
+typedef pio_hw_t* PIO;
+
+extern pio_hw_t host_pio_hw[NUM_PIOS];
+#define pio0 (&host_pio_hw[0])
+#define pio1 (&host_pio_hw[1])
+#define PIO_NUM(pio) ((uint)((pio) - host_pio_hw))
+#define PIO_INSTANCE(i) (&host_pio_hw[i])
+
+#define PIO_INSTRUCTION_COUNT 32u
+#define PIO_FDEBUG_TXSTALL_LSB 24
+#define PIO_FDEBUG_TXOVER_LSB 16
+#define PIO_FDEBUG_RXUNDER_LSB 8
+#define PIO_FDEBUG_RXSTALL_LSB 0
+
+typedef struct pio_program
+{
+  const uint16_t* instructions;
+  uint8_t length;
+  int8_t origin;
+  uint8_t pio_version;
+} pio_program_t;
+typedef pio_program_t pio_program;
+
+typedef struct { uint32_t clkdiv, execctrl, shiftctrl, pinctrl; } pio_sm_config;
+
+enum pio_fifo_join { PIO_FIFO_JOIN_NONE = 0, PIO_FIFO_JOIN_TX = 1, PIO_FIFO_JOIN_RX = 2 };
+enum pio_src_dest { pio_pins = 0u, pio_x = 1u, pio_y = 2u, pio_null = 3u, pio_pindirs = 4u, pio_exec_mov = 4u, pio_status = 5u, pio_pc = 5u, pio_isr = 6u, pio_osr = 7u, pio_exec_out = 7u };
+typedef enum pio_interrupt_source
+{
+  pis_sm0_rx_fifo_not_empty = 0,
+  pis_sm0_tx_fifo_not_full = 4,
+  pis_interrupt0 = 8,
+} pio_interrupt_source_t;
+
+// Program memory and state machine claims
+bool pio_can_add_program(PIO pio, const pio_program_t* program);
+uint pio_add_program(PIO pio, const pio_program_t* program);
+bool pio_can_add_program_at_offset(PIO pio, const pio_program_t* program, uint offset);
+uint pio_add_program_at_offset(PIO pio, const pio_program_t* program, uint offset);
+void pio_remove_program(PIO pio, const pio_program_t* program, uint loaded_offset);
+int pio_claim_unused_sm(PIO pio, bool required);
+void pio_sm_claim(PIO pio, uint sm);
+void pio_sm_unclaim(PIO pio, uint sm);
+bool pio_sm_is_claimed(PIO pio, uint sm);
+
+// Interrupts
+uint pio_get_irq_num(PIO pio, uint irqn);
+uint pio_get_dreq(PIO pio, uint sm, bool is_tx);
+pio_interrupt_source_t pio_get_rx_fifo_not_empty_interrupt_source(uint sm);
+pio_interrupt_source_t pio_get_tx_fifo_not_full_interrupt_source(uint sm);
+void pio_set_irqn_source_enabled(PIO pio, uint irq_index, pio_interrupt_source_t source, bool enabled);
+
+// State machines. FIFOs read empty and never fill.
+void pio_gpio_init(PIO pio, uint pin);
+int pio_sm_set_consecutive_pindirs(PIO pio, uint sm, uint pin_base, uint pin_count, bool is_out);
+int pio_sm_init(PIO pio, uint sm, uint initial_pc, const pio_sm_config* config);
+void pio_sm_set_config(PIO pio, uint sm, const pio_sm_config* config);
+void pio_sm_set_enabled(PIO pio, uint sm, bool enabled);
+void pio_sm_restart(PIO pio, uint sm);
+void pio_sm_clear_fifos(PIO pio, uint sm);
+void pio_sm_set_clkdiv(PIO pio, uint sm, float div);
+void pio_sm_exec(PIO pio, uint sm, uint instr);
+void pio_sm_put(PIO pio, uint sm, uint32_t data);
+void pio_sm_put_blocking(PIO pio, uint sm, uint32_t data);
+uint32_t pio_sm_get(PIO pio, uint sm);
+uint32_t pio_sm_get_blocking(PIO pio, uint sm);
+bool pio_sm_is_rx_fifo_empty(PIO pio, uint sm);
+bool pio_sm_is_tx_fifo_full(PIO pio, uint sm);
+uint pio_sm_get_rx_fifo_level(PIO pio, uint sm);
+uint pio_sm_get_tx_fifo_level(PIO pio, uint sm);
+
+// Config setters, which only store their arguments
+pio_sm_config pio_get_default_sm_config();
+void sm_config_set_wrap(pio_sm_config* c, uint wrap_target, uint wrap);
+void sm_config_set_sideset(pio_sm_config* c, uint bit_count, bool optional, bool pindirs);
+void sm_config_set_sideset_pins(pio_sm_config* c, uint sideset_base);
+void sm_config_set_in_pins(pio_sm_config* c, uint in_base);
+void sm_config_set_out_pins(pio_sm_config* c, uint out_base, uint out_count);
+void sm_config_set_set_pins(pio_sm_config* c, uint set_base, uint set_count);
+void sm_config_set_jmp_pin(pio_sm_config* c, uint pin);
+void sm_config_set_in_shift(pio_sm_config* c, bool shift_right, bool autopush, uint push_threshold);
+void sm_config_set_out_shift(pio_sm_config* c, bool shift_right, bool autopull, uint pull_threshold);
+void sm_config_set_clkdiv(pio_sm_config* c, float div);
+void sm_config_set_fifo_join(pio_sm_config* c, enum pio_fifo_join join);
+
+uint pio_encode_jmp(uint addr);
+uint pio_encode_set(enum pio_src_dest dest, uint value);
+uint pio_encode_pull(bool if_empty, bool block);
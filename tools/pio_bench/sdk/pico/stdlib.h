@@ -0,0 +1,8 @@
+#pragma once
+
+#include "pico/types.h"
+#include "pico/time.h"
+#include "hardware/clocks.h"
+#include "hardware/gpio.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "pico/types.h"
+
+uint64_t time_us_64();
+uint32_t time_us_32();
+absolute_time_t get_absolute_time();
+absolute_time_t make_timeout_time_us(uint64_t us);
+absolute_time_t make_timeout_time_ms(uint32_t ms);
+absolute_time_t delayed_by_us(absolute_time_t t, uint64_t us);
+int64_t absolute_time_diff_us(absolute_time_t from, absolute_time_t to);
+uint64_t to_us_since_boot(absolute_time_t t);
+bool time_reached(absolute_time_t t);
+void sleep_until(absolute_time_t t);
+void sleep_us(uint64_t us);
+bool best_effort_wfe_or_timeout(absolute_time_t timeout);
+void sleep_ms(uint32_t ms);
@@ -0,0 +1,25 @@
+#pragma once
+
+// Just enough of the pico SDK's types for the PIO drivers to build on a
+// host. See ../../HostSdk.cpp for what the functions do.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef unsigned int uint;
+typedef uint64_t absolute_time_t;
+typedef void (*irq_handler_t)(void);
+typedef volatile uint32_t io_rw_32;
+typedef volatile uint32_t io_ro_32;
+typedef volatile uint32_t io_wo_32;
+
+#define NUM_PIOS 2
+#define NUM_PIO_STATE_MACHINES 4
+#define NUM_DMA_CHANNELS 12
+#define PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY 0x80
+
+#define __not_in_flash_func(x) x
+#define __time_critical_func(x) x
+#define __force_inline inline
+#define tight_loop_contents() do {} while (0)
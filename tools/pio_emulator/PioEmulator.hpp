@@ -0,0 +1,967 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// A cycle accurate model of one RP2040 PIO block, for running the project's
+// .pio programs on a Linux host and measuring the waveforms they make.
+//
+// It runs the 16 bit instruction words pioasm generates, with four state
+// machines sharing 32 instruction slots, 8 IRQ flags and 32 GPIOs. Each
+// state machine has its own fractional clock divider, 4 word FIFOs (8 when
+// joined), autopush and autopull, side-set, delays, stalls, EXEC and the
+// wrap. Time is counted in system clock cycles, and every change of the
+// pin levels is recorded with the cycle it happened on, so pulse widths
+// come straight from the trace.
+//
+// Pins resolve the way the pads do: a pin the PIO drives (its direction
+// set) takes the PIO's output level, otherwise whatever drive() puts on it
+// from outside, otherwise its pull. Inputs pass through the 2 cycle
+// synchronizer, as on the chip.
+//
+// The model follows the RP2040 datasheet. Two details it can't settle are
+// the autopull refill, modelled as happening on the same cycle as the OUT
+// that empties the OSR, and the autopush stall, modelled as holding the IN
+// until the RX FIFO has room.
+class PioEmulator
+{
+public:
+  static constexpr int numStateMachines = 4;
+  static constexpr int instructionSlots = 32;
+  static constexpr int numPins = 32;
+  static constexpr int fifoDepth = 4;
+
+  // State machine configuration, named after the sm_config_set_* calls
+  // the drivers make, so a driver's setup can be copied across line for line
+  struct Config
+  {
+    uint8_t wrapTarget = 0;
+    uint8_t wrap = instructionSlots - 1;
+    // Side-set bits, counting the enable bit when optional
+    uint8_t sidesetBits = 0;
+    bool sidesetOptional = false;
+    bool sidesetPindirs = false;
+    uint8_t sidesetBase = 0;
+    uint8_t outBase = 0;
+    uint8_t outCount = 0;
+    uint8_t setBase = 0;
+    uint8_t setCount = 0;
+    uint8_t inBase = 0;
+    uint8_t jmpPin = 0;
+    bool inShiftRight = true;
+    bool autopush = false;
+    uint8_t pushThreshold = 32;
+    bool outShiftRight = true;
+    bool autopull = false;
+    uint8_t pullThreshold = 32;
+    bool joinTx = false;
+    bool joinRx = false;
+    bool statusRx = false;
+    uint8_t statusLevel = 0;
+    // Divider in 1/256ths, as the hardware's 16.8 fixed point register
+    uint32_t clkdiv256 = 256;
+
+    void setWrap(unsigned target, unsigned top)
+    {
+      wrapTarget = (uint8_t)target;
+      wrap = (uint8_t)top;
+    }
+
+    // count is the number of side-set pins, not counting the enable bit,
+    // as in .side_set
+    void setSideset(unsigned count, bool optional, bool pindirs)
+    {
+      sidesetBits = (uint8_t)(count + (optional ? 1 : 0));
+      sidesetOptional = optional;
+      sidesetPindirs = pindirs;
+    }
+
+    void setSidesetPins(unsigned base)
+    {
+      sidesetBase = (uint8_t)base;
+    }
+
+    void setOutPins(unsigned base, unsigned count)
+    {
+      outBase = (uint8_t)base;
+      outCount = (uint8_t)count;
+    }
+
+    void setSetPins(unsigned base, unsigned count)
+    {
+      setBase = (uint8_t)base;
+      setCount = (uint8_t)count;
+    }
+
+    void setInPins(unsigned base)
+    {
+      inBase = (uint8_t)base;
+    }
+
+    void setJmpPin(unsigned pin)
+    {
+      jmpPin = (uint8_t)pin;
+    }
+
+    void setInShift(bool shiftRight, bool autopushEnabled, unsigned threshold)
+    {
+      inShiftRight = shiftRight;
+      autopush = autopushEnabled;
+      pushThreshold = (uint8_t)threshold;
+    }
+
+    void setOutShift(bool shiftRight, bool autopullEnabled, unsigned threshold)
+    {
+      outShiftRight = shiftRight;
+      autopull = autopullEnabled;
+      pullThreshold = (uint8_t)threshold;
+    }
+
+    void setFifoJoin(bool tx, bool rx)
+    {
+      joinTx = tx;
+      joinRx = rx;
+    }
+
+    void setMovStatus(bool rx, unsigned level)
+    {
+      statusRx = rx;
+      statusLevel = (uint8_t)level;
+    }
+
+    void setClkdiv(float div)
+    {
+      clkdiv256 = (uint32_t)(div * 256.0f + 0.5f);
+    }
+
+    void setClkdivIntFrac(unsigned whole, unsigned frac)
+    {
+      clkdiv256 = whole * 256 + frac;
+    }
+  };
+
+  enum class Pull
+  {
+    None,
+    Up,
+    Down
+  };
+
+  // A stretch of one level on a pin, in system clock cycles
+  struct Pulse
+  {
+    bool level;
+    uint64_t start;
+    uint64_t length;
+  };
+
+  struct Transition
+  {
+    uint64_t cycle;
+    uint32_t levels;
+  };
+
+  PioEmulator()
+  {
+    for (int sm = 0; sm < numStateMachines; ++sm)
+    {
+      init(sm, 0, Config());
+    }
+    transitions_.push_back({0, levels_});
+  }
+
+  // Load a program where the SDK's pio_add_program() would, filling from
+  // the top, and relocate its jumps. Returns the offset, or -1 if it
+  // doesn't fit.
+  int load(const uint16_t* instructions, size_t length, int origin = -1)
+  {
+    int offset = findOffset(length, origin);
+    if (offset < 0) return -1;
+    for (size_t i = 0; i < length; ++i)
+    {
+      uint16_t instruction = instructions[i];
+      // JMP targets are relative to the start of the program
+      if ((instruction >> 13) == 0)
+      {
+        instruction = (uint16_t)((instruction & ~0x1f) | ((instruction + offset) & 0x1f));
+      }
+      memory_[offset + i] = instruction;
+    }
+    used_ |= mask(length, offset);
+    return offset;
+  }
+
+  template <size_t N>
+  int load(const uint16_t (&instructions)[N], int origin = -1)
+  {
+    return load(instructions, N, origin);
+  }
+
+  // Like pio_sm_init(): apply the configuration, clear the FIFOs and
+  // shift registers, restart the divider and jump to initialPc. Leaves the
+  // state machine disabled.
+  void init(int sm, unsigned initialPc, const Config& config)
+  {
+    StateMachine& s = sms_[sm];
+    s = StateMachine();
+    s.config = config;
+    s.pc = (uint8_t)initialPc;
+  }
+
+  // Change a running machine's config, like pio_sm_set_config(). Changing
+  // the FIFO join flushes both FIFOs, as on hardware.
+  void setConfig(int sm, const Config& config)
+  {
+    StateMachine& s = sms_[sm];
+    if (config.joinTx != s.config.joinTx || config.joinRx != s.config.joinRx)
+    {
+      s.tx.clear();
+      s.rx.clear();
+    }
+    s.config = config;
+  }
+
+  void enable(int sm, bool enabled)
+  {
+    sms_[sm].enabled = enabled;
+  }
+
+  // Run an instruction on a state machine straight away, enabled or not,
+  // like pio_sm_exec(). A jump moves its program counter. One that stalls
+  // is held and retried on the machine's clock, as an OUT EXEC would be.
+  void exec(int sm, uint16_t instruction)
+  {
+    StateMachine& s = sms_[sm];
+    int jump = -1;
+    bool done = execute(sm, s, instruction, jump);
+    applySideset(s, instruction);
+    updateLevels();
+    if (!done)
+    {
+      s.instruction = instruction;
+      s.stalled = true;
+      s.stalledExec = true;
+      return;
+    }
+    if (jump >= 0)
+    {
+      s.pc = (uint8_t)jump;
+    }
+  }
+
+  // Set pin directions from the PIO, like pio_sm_set_consecutive_pindirs()
+  void setPindirs(unsigned base, unsigned count, bool output)
+  {
+    for (unsigned i = 0; i < count; ++i)
+    {
+      uint32_t bit = 1u << ((base + i) % numPins);
+      pioOe_ = output ? (pioOe_ | bit) : (pioOe_ & ~bit);
+    }
+    updateLevels();
+  }
+
+  void setPins(unsigned base, unsigned count, uint32_t values)
+  {
+    for (unsigned i = 0; i < count; ++i)
+    {
+      uint32_t bit = 1u << ((base + i) % numPins);
+      pioOut_ = ((values >> i) & 1) ? (pioOut_ | bit) : (pioOut_ & ~bit);
+    }
+    updateLevels();
+  }
+
+  // Drive a pin from outside the PIO, as the device on the other end of
+  // the wire would. The PIO wins where both drive.
+  void drive(unsigned pin, bool level)
+  {
+    extDriven_ |= 1u << pin;
+    extLevel_ = level ? (extLevel_ | (1u << pin)) : (extLevel_ & ~(1u << pin));
+    updateLevels();
+  }
+
+  void release(unsigned pin)
+  {
+    extDriven_ &= ~(1u << pin);
+    updateLevels();
+  }
+
+  // Pins with no pull, and nothing driving them, read low
+  void setPull(unsigned pin, Pull pull)
+  {
+    pullUp_ &= ~(1u << pin);
+    if (pull == Pull::Up) pullUp_ |= 1u << pin;
+    updateLevels();
+  }
+
+  bool pin(unsigned pin) const
+  {
+    return (levels_ >> pin) & 1;
+  }
+
+  uint32_t pins() const
+  {
+    return levels_;
+  }
+
+  // Push a word to the TX FIFO. false if it is full.
+  bool put(int sm, uint32_t word)
+  {
+    StateMachine& s = sms_[sm];
+    if ((int)s.tx.size() >= txDepth(s)) return false;
+    s.tx.push_back(word);
+    return true;
+  }
+
+  // Pop a word from the RX FIFO. false if it is empty.
+  bool get(int sm, uint32_t& word)
+  {
+    StateMachine& s = sms_[sm];
+    if (s.rx.empty()) return false;
+    word = s.rx.front();
+    s.rx.pop_front();
+    return true;
+  }
+
+  size_t txLevel(int sm) const
+  {
+    return sms_[sm].tx.size();
+  }
+
+  size_t rxLevel(int sm) const
+  {
+    return sms_[sm].rx.size();
+  }
+
+  bool irq(unsigned flag) const
+  {
+    return (irqFlags_ >> flag) & 1;
+  }
+
+  void setIrq(unsigned flag, bool set)
+  {
+    irqFlags_ = set ? (irqFlags_ | (1u << flag)) : (irqFlags_ & ~(1u << flag));
+  }
+
+  unsigned pc(int sm) const
+  {
+    return sms_[sm].pc;
+  }
+
+  uint32_t x(int sm) const
+  {
+    return sms_[sm].x;
+  }
+
+  uint32_t y(int sm) const
+  {
+    return sms_[sm].y;
+  }
+
+  bool stalled(int sm) const
+  {
+    return sms_[sm].stalled;
+  }
+
+  // State machine cycles spent issuing instructions, stalled, and in
+  // delays, since init()
+  uint64_t instructionsExecuted(int sm) const
+  {
+    return sms_[sm].executed;
+  }
+
+  uint64_t stallCycles(int sm) const
+  {
+    return sms_[sm].stallCycles;
+  }
+
+  uint64_t delayCycles(int sm) const
+  {
+    return sms_[sm].delayCycles;
+  }
+
+  // System clock cycles run so far
+  uint64_t cycle() const
+  {
+    return cycle_;
+  }
+
+  // Run one system clock cycle
+  void step()
+  {
+    // Inputs are sampled through the synchronizer before anything runs,
+    // so every state machine sees the same levels this cycle
+    inputs_ = synced_[1];
+    for (int sm = 0; sm < numStateMachines; ++sm)
+    {
+      StateMachine& s = sms_[sm];
+      if (!s.enabled) continue;
+      s.divider += 256;
+      if (s.divider < s.config.clkdiv256) continue;
+      s.divider -= s.config.clkdiv256;
+      tick(sm);
+    }
+    ++cycle_;
+    updateLevels();
+    synced_[1] = synced_[0];
+    synced_[0] = levels_;
+  }
+
+  void run(uint64_t cycles)
+  {
+    for (uint64_t i = 0; i < cycles; ++i)
+    {
+      step();
+    }
+  }
+
+  // Run until done() is true, checked after every cycle, or maxCycles
+  // pass. true if done() became true.
+  bool runUntil(const std::function<bool()>& done, uint64_t maxCycles)
+  {
+    for (uint64_t i = 0; i < maxCycles; ++i)
+    {
+      step();
+      if (done()) return true;
+    }
+    return false;
+  }
+
+  // Every change of the pin levels, oldest first. The first entry is the
+  // levels at cycle 0.
+  const std::vector<Transition>& transitions() const
+  {
+    return transitions_;
+  }
+
+  // Forget the trace so far, keeping the current levels as its start
+  void clearTrace()
+  {
+    transitions_.clear();
+    transitions_.push_back({cycle_, levels_});
+  }
+
+  // The stretches of each level on a pin, from the start of the trace up
+  // to now. The last one is still going.
+  std::vector<Pulse> pulses(unsigned pin) const
+  {
+    std::vector<Pulse> result;
+    for (const Transition& t : transitions_)
+    {
+      bool level = (t.levels >> pin) & 1;
+      if (!result.empty() && result.back().level == level) continue;
+      if (!result.empty())
+      {
+        result.back().length = t.cycle - result.back().start;
+      }
+      result.push_back({level, t.cycle, 0});
+    }
+    if (!result.empty())
+    {
+      result.back().length = cycle_ - result.back().start;
+    }
+    return result;
+  }
+
+  // Write the trace as a Value Change Dump, for GTKWave or PulseView.
+  // Each name goes with the pin at the same index in pins.
+  void writeVcd(std::ostream& out, double clockHz, const std::vector<unsigned>& pins, const std::vector<std::string>& names) const
+  {
+    uint64_t picosPerCycle = (uint64_t)(1e12 / clockHz + 0.5);
+    out << "$timescale 1ps $end\n$scope module pio $end\n";
+    for (size_t i = 0; i < pins.size(); ++i)
+    {
+      std::string name = i < names.size() ? names[i] : "gpio" + std::to_string(pins[i]);
+      out << "$var wire 1 " << vcdId(i) << " " << name << " $end\n";
+    }
+    out << "$upscope $end\n$enddefinitions $end\n";
+
+    uint32_t previous = 0;
+    for (size_t t = 0; t < transitions_.size(); ++t)
+    {
+      const Transition& transition = transitions_[t];
+      bool first = true;
+      for (size_t i = 0; i < pins.size(); ++i)
+      {
+        bool level = (transition.levels >> pins[i]) & 1;
+        if (t > 0 && level == (bool)((previous >> pins[i]) & 1)) continue;
+        if (first)
+        {
+          out << "#" << transition.cycle * picosPerCycle << "\n";
+          first = false;
+        }
+        out << (level ? '1' : '0') << vcdId(i) << "\n";
+      }
+      previous = transition.levels;
+    }
+    out << "#" << cycle_ * picosPerCycle << "\n";
+  }
+
+private:
+  struct StateMachine
+  {
+    Config config;
+    bool enabled = false;
+    uint8_t pc = 0;
+    uint32_t x = 0;
+    uint32_t y = 0;
+    uint32_t isr = 0;
+    uint32_t osr = 0;
+    uint8_t isrCount = 0;
+    // The OSR starts empty, so autopull fills it on the first OUT
+    uint8_t osrCount = 32;
+    std::deque<uint32_t> tx;
+    std::deque<uint32_t> rx;
+    uint32_t divider = 0;
+    uint8_t delay = 0;
+    bool stalled = false;
+    bool stalledExec = false;
+    uint16_t instruction = 0;
+    bool execPending = false;
+    uint16_t execInstruction = 0;
+    bool pushPending = false;
+    bool irqWaitSet = false;
+    uint64_t executed = 0;
+    uint64_t stallCycles = 0;
+    uint64_t delayCycles = 0;
+  };
+
+  static uint32_t mask(size_t length, unsigned offset)
+  {
+    uint32_t bits = length >= 32 ? UINT32_MAX : (1u << length) - 1;
+    return bits << offset;
+  }
+
+  int findOffset(size_t length, int origin) const
+  {
+    if (length > instructionSlots) return -1;
+    if (origin >= 0)
+    {
+      if ((size_t)origin > instructionSlots - length) return -1;
+      return (used_ & mask(length, origin)) ? -1 : origin;
+    }
+    for (int offset = instructionSlots - (int)length; offset >= 0; --offset)
+    {
+      if (!(used_ & mask(length, offset))) return offset;
+    }
+    return -1;
+  }
+
+  static std::string vcdId(size_t i)
+  {
+    return std::string(1, (char)('!' + i));
+  }
+
+  static uint32_t rotateRight(uint32_t value, unsigned shift)
+  {
+    shift &= 31;
+    return shift ? (value >> shift) | (value << (32 - shift)) : value;
+  }
+
+  static uint32_t reverse(uint32_t value)
+  {
+    uint32_t result = 0;
+    for (int i = 0; i < 32; ++i)
+    {
+      result = (result << 1) | ((value >> i) & 1);
+    }
+    return result;
+  }
+
+  static int txDepth(const StateMachine& s)
+  {
+    return s.config.joinTx ? 2 * fifoDepth : (s.config.joinRx ? 0 : fifoDepth);
+  }
+
+  static int rxDepth(const StateMachine& s)
+  {
+    return s.config.joinRx ? 2 * fifoDepth : (s.config.joinTx ? 0 : fifoDepth);
+  }
+
+  void updateLevels()
+  {
+    uint32_t levels = (pioOe_ & pioOut_) | (~pioOe_ & extDriven_ & extLevel_) | (~pioOe_ & ~extDriven_ & pullUp_);
+    if (levels != levels_)
+    {
+      levels_ = levels;
+      transitions_.push_back({cycle_, levels_});
+    }
+  }
+
+  // Write count bits of values to pins from base, or their directions
+  void writePins(unsigned base, unsigned count, uint32_t values, bool pindirs)
+  {
+    uint32_t& target = pindirs ? pioOe_ : pioOut_;
+    for (unsigned i = 0; i < count; ++i)
+    {
+      uint32_t bit = 1u << ((base + i) % numPins);
+      target = ((values >> i) & 1) ? (target | bit) : (target & ~bit);
+    }
+  }
+
+  unsigned irqIndex(int sm, unsigned index) const
+  {
+    // The rel bit adds the state machine number to the low two bits
+    if (index & 0x10)
+    {
+      return (index & 0x4) | ((index + sm) & 0x3);
+    }
+    return index & 0x7;
+  }
+
+  // One state machine clock
+  void tick(int sm)
+  {
+    StateMachine& s = sms_[sm];
+    if (s.delay > 0)
+    {
+      --s.delay;
+      ++s.delayCycles;
+      return;
+    }
+
+    bool fromExec = false;
+    bool firstIssue = !s.stalled;
+    if (firstIssue)
+    {
+      if (s.execPending)
+      {
+        s.instruction = s.execInstruction;
+        s.execPending = false;
+        fromExec = true;
+      }
+      else
+      {
+        s.instruction = memory_[s.pc];
+      }
+    }
+    else
+    {
+      fromExec = s.stalledExec;
+    }
+
+    int jump = -1;
+    bool done = execute(sm, s, s.instruction, jump);
+    // Side-set happens when the instruction issues, stalled or not, and
+    // wins over an OUT or SET to the same pins
+    if (firstIssue)
+    {
+      applySideset(s, s.instruction);
+    }
+    if (!done)
+    {
+      s.stalled = true;
+      s.stalledExec = fromExec;
+      ++s.stallCycles;
+      return;
+    }
+    s.stalled = false;
+    ++s.executed;
+
+    if (jump >= 0)
+    {
+      s.pc = (uint8_t)jump;
+    }
+    else if (!fromExec)
+    {
+      s.pc = s.pc == s.config.wrap ? s.config.wrapTarget : (uint8_t)((s.pc + 1) % instructionSlots);
+    }
+
+    // An instruction queued by OUT EXEC or MOV EXEC runs next, and its own
+    // delay counts rather than the one that queued it
+    if (!s.execPending)
+    {
+      s.delay = delayOf(s, s.instruction);
+    }
+  }
+
+  uint8_t delayOf(const StateMachine& s, uint16_t instruction) const
+  {
+    unsigned delayBits = 5 - s.config.sidesetBits;
+    return (uint8_t)((instruction >> 8) & ((1u << delayBits) - 1));
+  }
+
+  void applySideset(StateMachine& s, uint16_t instruction)
+  {
+    const Config& c = s.config;
+    if (c.sidesetBits == 0) return;
+    unsigned field = (instruction >> 8) & 0x1f;
+    unsigned value = field >> (5 - c.sidesetBits);
+    unsigned count = c.sidesetBits;
+    if (c.sidesetOptional)
+    {
+      if (!(field & 0x10)) return;
+      --count;
+      value &= (1u << count) - 1;
+    }
+    writePins(c.sidesetBase, count, value, c.sidesetPindirs);
+  }
+
+  uint32_t readSource(const StateMachine& s, unsigned source) const
+  {
+    switch (source)
+    {
+      case 0: return rotateRight(inputs_, s.config.inBase);
+      case 1: return s.x;
+      case 2: return s.y;
+      case 5:
+      {
+        size_t level = s.config.statusRx ? s.rx.size() : s.tx.size();
+        return level < s.config.statusLevel ? UINT32_MAX : 0;
+      }
+      case 6: return s.isr;
+      case 7: return s.osr;
+      default: return 0;
+    }
+  }
+
+  bool tryPush(StateMachine& s)
+  {
+    if ((int)s.rx.size() >= rxDepth(s)) return false;
+    s.rx.push_back(s.isr);
+    s.isr = 0;
+    s.isrCount = 0;
+    return true;
+  }
+
+  bool tryPull(StateMachine& s)
+  {
+    if (s.tx.empty()) return false;
+    s.osr = s.tx.front();
+    s.tx.pop_front();
+    s.osrCount = 0;
+    return true;
+  }
+
+  // Execute an instruction. false if it stalls, and it is tried again on
+  // the next state machine clock. jump is set for a taken jump.
+  bool execute(int sm, StateMachine& s, uint16_t instruction, int& jump)
+  {
+    const Config& c = s.config;
+    unsigned opcode = instruction >> 13;
+    unsigned arg1 = (instruction >> 5) & 0x7;
+    unsigned arg2 = instruction & 0x1f;
+
+    switch (opcode)
+    {
+      case 0: // JMP
+      {
+        bool taken = false;
+        switch (arg1)
+        {
+          case 0: taken = true; break;
+          case 1: taken = s.x == 0; break;
+          case 2: taken = s.x != 0; --s.x; break;
+          case 3: taken = s.y == 0; break;
+          case 4: taken = s.y != 0; --s.y; break;
+          case 5: taken = s.x != s.y; break;
+          case 6: taken = (inputs_ >> c.jmpPin) & 1; break;
+          case 7: taken = s.osrCount < c.pullThreshold; break;
+        }
+        if (taken) jump = arg2;
+        return true;
+      }
+
+      case 1: // WAIT
+      {
+        bool polarity = (instruction >> 7) & 1;
+        unsigned source = (instruction >> 5) & 0x3;
+        bool level = false;
+        if (source == 0)
+        {
+          level = (inputs_ >> arg2) & 1;
+        }
+        else if (source == 1)
+        {
+          level = (inputs_ >> ((c.inBase + arg2) % numPins)) & 1;
+        }
+        else if (source == 2)
+        {
+          unsigned flag = irqIndex(sm, arg2);
+          level = (irqFlags_ >> flag) & 1;
+          // Waiting for a flag to be set also clears it
+          if (polarity && level)
+          {
+            irqFlags_ &= ~(1u << flag);
+          }
+        }
+        return level == polarity;
+      }
+
+      case 2: // IN
+      {
+        if (!s.pushPending)
+        {
+          unsigned count = arg2 ? arg2 : 32;
+          uint32_t data = readSource(s, arg1);
+          if (count < 32) data &= (1u << count) - 1;
+          if (count == 32)
+          {
+            s.isr = data;
+          }
+          else if (c.inShiftRight)
+          {
+            s.isr = (s.isr >> count) | (data << (32 - count));
+          }
+          else
+          {
+            s.isr = (s.isr << count) | data;
+          }
+          s.isrCount = (uint8_t)std::min<unsigned>(32, s.isrCount + count);
+          s.pushPending = c.autopush && s.isrCount >= c.pushThreshold;
+        }
+        if (s.pushPending)
+        {
+          if (!tryPush(s)) return false;
+          s.pushPending = false;
+        }
+        return true;
+      }
+
+      case 3: // OUT
+      {
+        if (c.autopull && s.osrCount >= c.pullThreshold && !tryPull(s)) return false;
+
+        unsigned count = arg2 ? arg2 : 32;
+        uint32_t data;
+        if (count == 32)
+        {
+          data = s.osr;
+          s.osr = 0;
+        }
+        else if (c.outShiftRight)
+        {
+          data = s.osr & ((1u << count) - 1);
+          s.osr >>= count;
+        }
+        else
+        {
+          data = s.osr >> (32 - count);
+          s.osr <<= count;
+        }
+        s.osrCount = (uint8_t)std::min<unsigned>(32, s.osrCount + count);
+
+        switch (arg1)
+        {
+          case 0: writePins(c.outBase, c.outCount, data, false); break;
+          case 1: s.x = data; break;
+          case 2: s.y = data; break;
+          case 4: writePins(c.outBase, c.outCount, data, true); break;
+          case 5: jump = data & 0x1f; break;
+          case 6: s.isr = data; s.isrCount = (uint8_t)count; break;
+          case 7: s.execPending = true; s.execInstruction = (uint16_t)data; break;
+          default: break;
+        }
+
+        // The OSR refills on the same cycle it empties, if there is data
+        if (c.autopull && s.osrCount >= c.pullThreshold)
+        {
+          tryPull(s);
+        }
+        return true;
+      }
+
+      case 4: // PUSH and PULL
+      {
+        bool conditional = (instruction >> 6) & 1;
+        bool block = (instruction >> 5) & 1;
+        if (!((instruction >> 7) & 1))
+        {
+          if (conditional && s.isrCount < c.pushThreshold) return true;
+          if (tryPush(s)) return true;
+          if (block) return false;
+          // A non-blocking push with the FIFO full drops the data
+          s.isr = 0;
+          s.isrCount = 0;
+          return true;
+        }
+
+        // With autopull on, PULL only acts once the OSR is used up, so it
+        // can fence off the start of a transfer
+        if ((conditional || c.autopull) && s.osrCount < c.pullThreshold) return true;
+        if (tryPull(s)) return true;
+        if (block) return false;
+        s.osr = s.x;
+        s.osrCount = 0;
+        return true;
+      }
+
+      case 5: // MOV
+      {
+        unsigned op = (instruction >> 3) & 0x3;
+        uint32_t data = readSource(s, instruction & 0x7);
+        if (op == 1) data = ~data;
+        if (op == 2) data = reverse(data);
+        switch (arg1)
+        {
+          case 0: writePins(c.outBase, c.outCount, data, false); break;
+          case 1: s.x = data; break;
+          case 2: s.y = data; break;
+          case 4: s.execPending = true; s.execInstruction = (uint16_t)data; break;
+          case 5: jump = data & 0x1f; break;
+          case 6: s.isr = data; s.isrCount = 0; break;
+          case 7: s.osr = data; s.osrCount = 0; break;
+          default: break;
+        }
+        return true;
+      }
+
+      case 6: // IRQ
+      {
+        bool clear = (instruction >> 6) & 1;
+        bool wait = (instruction >> 5) & 1;
+        unsigned flag = irqIndex(sm, arg2);
+        if (clear)
+        {
+          irqFlags_ &= ~(1u << flag);
+          return true;
+        }
+        if (!s.irqWaitSet)
+        {
+          irqFlags_ |= 1u << flag;
+          if (!wait) return true;
+          s.irqWaitSet = true;
+        }
+        // IRQ WAIT holds until something else clears the flag
+        if ((irqFlags_ >> flag) & 1) return false;
+        s.irqWaitSet = false;
+        return true;
+      }
+
+      case 7: // SET
+      {
+        switch (arg1)
+        {
+          case 0: writePins(c.setBase, c.setCount, arg2, false); break;
+          case 1: s.x = arg2; break;
+          case 2: s.y = arg2; break;
+          case 4: writePins(c.setBase, c.setCount, arg2, true); break;
+          default: break;
+        }
+        return true;
+      }
+    }
+    return true;
+  }
+
+  std::array<uint16_t, instructionSlots> memory_ {};
+  uint32_t used_ = 0;
+  std::array<StateMachine, numStateMachines> sms_;
+  uint8_t irqFlags_ = 0;
+  uint32_t pioOut_ = 0;
+  uint32_t pioOe_ = 0;
+  uint32_t extDriven_ = 0;
+  uint32_t extLevel_ = 0;
+  uint32_t pullUp_ = 0;
+  uint32_t levels_ = 0;
+  uint32_t inputs_ = 0;
+  uint32_t synced_[2] = {0, 0};
+  uint64_t cycle_ = 0;
+  std::vector<Transition> transitions_;
+};
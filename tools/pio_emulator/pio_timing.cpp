@@ -0,0 +1,428 @@
+// Runs the project's PIO programs on PioEmulator, set up the way their
+// drivers set them up, and checks the waveforms against each protocol's
+// timing. Exits non-zero if anything is out of spec, so a change to a .pio
+// file or a clock divider can be caught on a plain Linux box.
+//
+// Every check runs at a few system clocks, with the dividers and cycle
+// counts worked out from the clock as the drivers do. Pass a directory to
+// also write each waveform at the first clock there as a .vcd file.
+
+#include "PioEmulator.hpp"
+
+// The drivers' clock rates and cycle counts
+#include "PioTiming.hpp"
+
+// Generated by pioasm, without the SDK parts
+#include "ws2812b.pio.h"
+#include "joybus_host.pio.h"
+#include "joybus_client.pio.h"
+#include "pulse_counter.pio.h"
+
+// std headers
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// The system clock of the current run
+static double sysClockHz = 125000000.0;
+static double nsPerCycle = 1e9 / sysClockHz;
+
+static int failures = 0;
+static std::string vcdDir;
+
+// Report the range of a measurement and check it against [minNs, maxNs].
+// A max of 0 reports it without a limit.
+static void check(const char* program, const char* name, const std::vector<uint64_t>& cycles, double minNs, double maxNs)
+{
+  std::cout << std::left << std::setw(14) << program << std::setw(22) << name << std::right;
+  if (cycles.empty())
+  {
+    std::cout << "not seen  FAIL" << std::endl;
+    ++failures;
+    return;
+  }
+  auto range = std::minmax_element(cycles.begin(), cycles.end());
+  double lowNs = *range.first * nsPerCycle;
+  double highNs = *range.second * nsPerCycle;
+  std::cout << std::fixed << std::setprecision(0) << std::setw(8) << lowNs << " - " << std::setw(8) << highNs << " ns";
+  if (maxNs > 0)
+  {
+    bool ok = lowNs >= minNs && highNs <= maxNs;
+    std::cout << "  (" << minNs << " - " << maxNs << ")  " << (ok ? "ok" : "FAIL");
+    if (!ok) ++failures;
+  }
+  std::cout << std::endl;
+}
+
+static void expect(const char* program, const char* name, bool ok)
+{
+  std::cout << std::left << std::setw(14) << program << std::setw(22) << name << std::right << (ok ? "ok" : "FAIL") << std::endl;
+  if (!ok) ++failures;
+}
+
+// Clock divider for a state machine running at hz, as
+// PioMachine::clockDivider() works it out
+static float clockDivider(double hz)
+{
+  return std::clamp((float)sysClockHz / (float)hz, 1.0f, 65536.0f);
+}
+
+static uint64_t cyclesFromUs(double us)
+{
+  return (uint64_t)(us * sysClockHz / 1e6);
+}
+
+static void writeVcd(const PioEmulator& pio, const char* name, unsigned pin)
+{
+  if (vcdDir.empty() || sysClockHz != 125000000.0) return;
+  std::ofstream out(vcdDir + "/" + name + ".vcd");
+  pio.writeVcd(out, sysClockHz, {pin}, {name});
+}
+
+// Configured as LedStripWs2812b does: one pin for SET, 32 bit words with
+// no autopull, and the state machine at 25MHz
+static void ws2812b()
+{
+  constexpr unsigned pin = 0;
+  // LedStripWs2812b's latch command
+  constexpr uint32_t resetCommand = 0xFFu << 24 | Ws2812bTiming::latchLoops;
+  constexpr uint32_t grb = 0xA55AF0;
+
+  PioEmulator pio;
+  int offset = pio.load(ws2812b_program_instructions);
+  PioEmulator::Config config;
+  config.setWrap(offset + ws2812b_wrap_target, offset + ws2812b_wrap);
+  config.setOutPins(pin, 1);
+  config.setSetPins(pin, 1);
+  config.setInPins(pin);
+  config.setJmpPin(pin);
+  config.setInShift(false, false, 32);
+  config.setOutShift(false, false, 32);
+  config.setClkdiv(clockDivider(Ws2812bTiming::pioClockHz));
+  pio.setPindirs(pin, 1, true);
+  pio.init(0, offset, config);
+  pio.enable(0, true);
+
+  // Two one pixel frames, so the latch sits between them
+  pio.put(0, grb);
+  pio.put(0, resetCommand);
+  pio.put(0, grb);
+  pio.run(cyclesFromUs(480));
+  writeVcd(pio, "ws2812b", pin);
+
+  std::vector<uint64_t> t0h, t1h, t0l, t1l, period, latch;
+  std::vector<PioEmulator::Pulse> pulses = pio.pulses(pin);
+  int bit = 0;
+  for (size_t i = 0; i + 1 < pulses.size(); ++i)
+  {
+    if (!pulses[i].level) continue;
+    bool one = (grb >> (23 - bit % 24)) & 1;
+    const PioEmulator::Pulse& low = pulses[i + 1];
+    (one ? t1h : t0h).push_back(pulses[i].length);
+    if (bit % 24 == 23)
+    {
+      if (bit == 23) latch.push_back(low.length);
+    }
+    else
+    {
+      (one ? t1l : t0l).push_back(low.length);
+      period.push_back(pulses[i].length + low.length);
+    }
+    ++bit;
+  }
+
+  // WS2812B datasheet timing, each +/-150ns
+  check("ws2812b", "T0H", t0h, 250, 550);
+  check("ws2812b", "T1H", t1h, 650, 950);
+  check("ws2812b", "T0L", t0l, 700, 1000);
+  check("ws2812b", "T1L", t1l, 300, 600);
+  check("ws2812b", "bit period", period, 650, 1850);
+  check("ws2812b", "latch", latch, 280000, 1e9);
+  expect("ws2812b", "48 bits sent", bit == 48);
+}
+
+// JoybusHost and JoybusClient on one wire, configured as their drivers do:
+// autopush and autopull at 8 bits, the state machines at 8MHz, and the
+// pin pulled up. The host sends an N64 controller poll and the client
+// replies with 4 bytes of buttons and stick, so both bit values show up on
+// both sides.
+static void joybus()
+{
+  constexpr unsigned pin = 0;
+  constexpr uint8_t command = 0x01;
+  const std::vector<uint8_t> reply = {0x80, 0x05, 0x7F, 0xA1};
+
+  PioEmulator pio;
+  int hostOffset = pio.load(joybus_host_program_instructions);
+  int clientOffset = pio.load(joybus_client_program_instructions);
+  pio.setPull(pin, PioEmulator::Pull::Up);
+
+  for (int sm : {0, 1})
+  {
+    int offset = sm == 0 ? hostOffset : clientOffset;
+    PioEmulator::Config config;
+    if (sm == 0)
+    {
+      config.setWrap(offset + joybus_host_wrap_target, offset + joybus_host_wrap);
+    }
+    else
+    {
+      config.setWrap(offset + joybus_client_wrap_target, offset + joybus_client_wrap);
+    }
+    config.setInPins(pin);
+    config.setOutPins(pin, 1);
+    config.setSetPins(pin, 1);
+    config.setJmpPin(pin);
+    config.setInShift(false, true, 8);
+    config.setOutShift(false, true, 8);
+    config.setClkdiv(clockDivider(JoybusTiming::pioClockHz));
+    pio.init(sm, offset, config);
+  }
+  pio.setPindirs(pin, 1, false);
+  pio.enable(0, true);
+  pio.enable(1, true);
+  pio.run(100);
+  pio.clearTrace();
+
+  // What JoybusHost::command() writes: bits to send minus one, the
+  // inverted command byte, then bits to receive minus one
+  pio.put(0, 7);
+  pio.put(0, (uint32_t)(uint8_t)~command << 24);
+  pio.put(0, reply.size() * 8 - 1);
+
+  // What JoybusClient::advanceState() writes once the command is in: no
+  // command data, then the reply
+  std::vector<uint32_t> clientWords = {0, (uint32_t)reply.size() * 8 - 1};
+  for (uint8_t byte : reply)
+  {
+    clientWords.push_back((uint32_t)(uint8_t)~byte << 24);
+  }
+
+  uint32_t received = 0;
+  bool commandSeen = false;
+  size_t clientSent = 0;
+  std::vector<uint8_t> hostReceived;
+  pio.runUntil([&]()
+  {
+    uint32_t word;
+    if (!commandSeen && pio.get(1, word))
+    {
+      received = word;
+      commandSeen = true;
+    }
+    while (commandSeen && clientSent < clientWords.size() && pio.put(1, clientWords[clientSent]))
+    {
+      ++clientSent;
+    }
+    while (pio.get(0, word))
+    {
+      hostReceived.push_back((uint8_t)word);
+    }
+    return hostReceived.size() == reply.size();
+  }, 200000);
+  // Let the device stop finish
+  pio.run(1000);
+  writeVcd(pio, "joybus", pin);
+
+  // Low pulses in order: the host's 8 bits and stop, then the client's
+  // bits and stop
+  std::vector<PioEmulator::Pulse> pulses = pio.pulses(pin);
+  std::vector<uint64_t> hostZeroLow, hostOneLow, hostPeriod, hostStopLow;
+  std::vector<uint64_t> clientZeroLow, clientOneLow, clientPeriod, clientStopLow, turnaround;
+  size_t replyBits = reply.size() * 8;
+  size_t index = 0;
+  for (size_t i = 0; i < pulses.size(); ++i)
+  {
+    if (pulses[i].level) continue;
+    uint64_t highAfter = i + 1 < pulses.size() ? pulses[i + 1].length : 0;
+    if (index < 8)
+    {
+      bool one = (command >> (7 - index)) & 1;
+      (one ? hostOneLow : hostZeroLow).push_back(pulses[i].length);
+      hostPeriod.push_back(pulses[i].length + highAfter);
+    }
+    else if (index == 8)
+    {
+      hostStopLow.push_back(pulses[i].length);
+      turnaround.push_back(highAfter);
+    }
+    else if (index < 9 + replyBits)
+    {
+      size_t bit = index - 9;
+      bool one = (reply[bit / 8] >> (7 - bit % 8)) & 1;
+      (one ? clientOneLow : clientZeroLow).push_back(pulses[i].length);
+      if (bit + 1 < replyBits)
+      {
+        clientPeriod.push_back(pulses[i].length + highAfter);
+      }
+    }
+    else if (index == 9 + replyBits)
+    {
+      clientStopLow.push_back(pulses[i].length);
+    }
+    ++index;
+  }
+
+  // Nominal Joybus timing, +/-10%
+  check("joybus_host", "bit 0 low", hostZeroLow, 2700, 3300);
+  check("joybus_host", "bit 1 low", hostOneLow, 900, 1100);
+  check("joybus_host", "bit period", hostPeriod, 3600, 4400);
+  check("joybus_host", "stop low", hostStopLow, 900, 1100);
+  check("joybus_client", "reply delay", turnaround, 0, 0);
+  check("joybus_client", "bit 0 low", clientZeroLow, 2700, 3300);
+  check("joybus_client", "bit 1 low", clientOneLow, 900, 1100);
+  check("joybus_client", "bit period", clientPeriod, 3600, 4400);
+  check("joybus_client", "stop low", clientStopLow, 1800, 2200);
+  expect("joybus_client", "command received", commandSeen && (uint8_t)received == command);
+  expect("joybus_host", "reply received", hostReceived == reply);
+}
+
+// Set up as PulseCounter does: autopush at 32 bits, a divider of 1, and
+// the sample period in 2 cycle loop iterations. start() splits the FIFOs
+// to pass the period through TX and runs the program's PULL itself, then
+// joins RX again so it holds 8 observations, clears Y and jumps past the
+// PULL.
+static void startPulseCounter(PioEmulator& pio, unsigned pin, uint32_t sampleLoops, bool joinRx)
+{
+  // pio_encode_pull(false, true), pio_encode_set(pio_y, 0) and
+  // pio_encode_jmp(addr)
+  constexpr uint16_t pullBlock = 0x80a0;
+  constexpr uint16_t setYZero = 0xe040;
+  auto jmp = [](unsigned addr) { return (uint16_t)(0x0000 | addr); };
+
+  int offset = pio.load(pulse_counter_program_instructions);
+  PioEmulator::Config config;
+  config.setWrap(offset + pulse_counter_wrap_target, offset + pulse_counter_wrap);
+  config.setInPins(pin);
+  config.setJmpPin(pin);
+  config.setInShift(false, true, 32);
+  config.setOutShift(false, false, 32);
+  config.setFifoJoin(false, joinRx);
+  config.setClkdiv(1.0f);
+  pio.setPull(pin, PioEmulator::Pull::Up);
+  pio.init(0, offset, config);
+
+  PioEmulator::Config split = config;
+  split.setFifoJoin(false, false);
+  pio.setConfig(0, split);
+  pio.put(0, sampleLoops);
+  pio.exec(0, pullBlock);
+  pio.setConfig(0, config);
+  pio.exec(0, setYZero);
+  pio.exec(0, jmp(offset + pulse_counter_wrap_target));
+  pio.enable(0, true);
+}
+
+// A 100kHz square wave over 1ms samples should count 100 pulses
+static void pulseCounter()
+{
+  constexpr unsigned pin = 0;
+  const uint64_t halfPeriodCycles = cyclesFromUs(5);
+  const uint32_t sampleLoops = (uint32_t)(cyclesFromUs(1000) / PulseCounterTiming::cyclesPerDecrement);
+
+  PioEmulator pio;
+  startPulseCounter(pio, pin, sampleLoops, true);
+
+  std::vector<uint64_t> counts, intervals;
+  uint64_t lastSample = 0;
+  pio.runUntil([&]()
+  {
+    pio.drive(pin, (pio.cycle() / halfPeriodCycles) & 1);
+    uint32_t word;
+    if (pio.get(0, word))
+    {
+      // PulseCounter::pop() undoes the count starting at zero and
+      // decrementing
+      counts.push_back(UINT32_MAX - word + 1);
+      if (lastSample > 0)
+      {
+        intervals.push_back(pio.cycle() - lastSample);
+      }
+      lastSample = pio.cycle();
+    }
+    return counts.size() == 4;
+  }, cyclesFromUs(8000));
+  writeVcd(pio, "pulse_counter", pin);
+
+  // check() takes cycles, so each count is reported as the cycles of that
+  // many 10us pulses
+  std::vector<uint64_t> countCycles;
+  for (uint64_t count : counts)
+  {
+    countCycles.push_back(count * cyclesFromUs(10));
+  }
+  check("pulse_counter", "sample interval", intervals, 990000, 1010000);
+  check("pulse_counter", "count x 10us", countCycles, 990000, 1010000);
+}
+
+// PulseCounter popped late: 1ms samples read every 6ms, with the RX FIFO
+// on its own and joined with TX. While the FIFO is full the program is
+// stalled on its autopush and not counting.
+static void pulseCounterQueue()
+{
+  constexpr unsigned pin = 0;
+  const uint64_t halfPeriodCycles = cyclesFromUs(5);
+  const uint32_t sampleLoops = (uint32_t)(cyclesFromUs(1000) / PulseCounterTiming::cyclesPerDecrement);
+  const uint64_t readCycles = cyclesFromUs(6000);
+  const uint64_t runCycles = 10 * readCycles;
+
+  for (bool joinRx : {false, true})
+  {
+    PioEmulator pio;
+    startPulseCounter(pio, pin, sampleLoops, joinRx);
+    uint64_t start = pio.cycle();
+    uint64_t stallsBefore = pio.stallCycles(0);
+    size_t samples = 0;
+    pio.runUntil([&]()
+    {
+      pio.drive(pin, (pio.cycle() / halfPeriodCycles) & 1);
+      uint64_t elapsed = pio.cycle() - start;
+      if (elapsed % readCycles == 0)
+      {
+        uint32_t word;
+        while (pio.get(0, word))
+        {
+          ++samples;
+        }
+      }
+      return elapsed >= runCycles;
+    }, runCycles + 1);
+
+    std::vector<uint64_t> stalled = {pio.stallCycles(0) - stallsBefore};
+    check("pulse_counter", joinRx ? "stalled, RX joined" : "stalled, 4 deep", stalled, 0, 0);
+    std::cout << std::left << std::setw(14) << "pulse_counter" << std::setw(22) << (joinRx ? "samples, RX joined" : "samples, 4 deep")
+              << std::right << std::setw(8) << samples << " in 60ms" << std::endl;
+    if (joinRx)
+    {
+      expect("pulse_counter", "no stalls, RX joined", stalled[0] == 0);
+    }
+  }
+}
+
+int main(int argc, char** argv)
+{
+  if (argc > 1)
+  {
+    vcdDir = argv[1];
+  }
+
+  // The RP2040's default clock, a common overclock that doesn't divide
+  // evenly, and the top of the RP2040's rated range
+  for (double hz : {125000000.0, 133000000.0, 200000000.0})
+  {
+    sysClockHz = hz;
+    nsPerCycle = 1e9 / sysClockHz;
+    std::cout << "System clock " << std::fixed << std::setprecision(0) << hz / 1e6 << "MHz" << std::endl;
+    ws2812b();
+    joybus();
+    pulseCounter();
+    pulseCounterQueue();
+  }
+
+  std::cout << (failures ? "FAILED" : "All timing in spec") << std::endl;
+  return failures ? 1 : 0;
+}